@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include <type_traits>
+
+#define _ThreadArena ScratchArena::getThreadArena()
+
+// bump allocator for the scratch memory of a render loop.
+// memory is only given back by release()/reset(), which rewind the
+// arena but keep its blocks, so once the blocks are large enough for a
+// sample the loop runs without heap allocation.
+// a thread has one arena (_ThreadArena), see ScratchScope
+class ScratchArena {
+public:
+  struct Marker {
+    int block;
+    std::size_t offset;
+  };
+
+private:
+  struct Block {
+    char* data;
+    std::size_t size;
+  };
+  std::vector<Block> blocks;
+  int curBlock = 0;
+  std::size_t offset = 0;
+  std::size_t blockSize;
+
+  // counters
+  long long heapAllocs = 0; // blocks ever allocated
+  std::size_t capacity = 0;
+
+  void* allocBytes(std::size_t n, std::size_t align);
+
+public:
+  ScratchArena(std::size_t blockSize = 1<<18): blockSize(blockSize) {}
+  ScratchArena(const ScratchArena&) = delete;
+  const ScratchArena& operator=(const ScratchArena&) = delete;
+  ~ScratchArena();
+
+  static ScratchArena& getThreadArena();
+
+  // n uninitialized T
+  template<typename T>
+  inline T* alloc(std::size_t n) {
+    return static_cast<T*>(allocBytes(n*sizeof(T), alignof(T)));
+  }
+
+  inline Marker mark() const {return {curBlock, offset};}
+  // drop all memory allocated after m
+  inline void release(Marker m) {curBlock = m.block; offset = m.offset;}
+  inline void reset() {release({0, 0});}
+
+  // blocks ever allocated, stays the same when the loop does not
+  // allocate from heap, checked by tests/renderAlloc.cpp
+  inline long long getHeapAllocCount() const {return heapAllocs;}
+  inline std::size_t getCapacity() const {return capacity;}
+};
+
+// release the arena to where it was when the scope begins
+class ScratchScope {
+private:
+  ScratchArena& arena;
+  ScratchArena::Marker marker;
+
+public:
+  ScratchScope(ScratchArena& arena): arena(arena), marker(arena.mark()) {}
+  ScratchScope(const ScratchScope&) = delete;
+  const ScratchScope& operator=(const ScratchScope&) = delete;
+  ~ScratchScope() {arena.release(marker);}
+};
+
+// allocator for std containers, draws from arena, or from heap when
+// arena is nullptr. a container on an arena must not outlive the
+// ScratchScope it is created in
+template<typename T>
+class ScratchAllocator {
+public:
+  using value_type = T;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  ScratchArena* arena;
+
+  ScratchAllocator(ScratchArena* arena = nullptr): arena(arena) {}
+  template<typename U>
+  ScratchAllocator(const ScratchAllocator<U>& other): arena(other.arena) {}
+
+  inline T* allocate(std::size_t n) {
+    if(arena) return arena->alloc<T>(n);
+    return static_cast<T*>(::operator new(n*sizeof(T)));
+  }
+  inline void deallocate(T* p, std::size_t n) {
+    if(!arena) ::operator delete(p);
+  }
+};
+
+template<typename T, typename U>
+inline bool operator==(
+  const ScratchAllocator<T>& a, const ScratchAllocator<U>& b) {
+  return a.arena == b.arena;
+}
+
+template<typename T, typename U>
+inline bool operator!=(
+  const ScratchAllocator<T>& a, const ScratchAllocator<U>& b) {
+  return a.arena != b.arena;
+}
+
+template<typename T>
+using ScratchVector = std::vector<T, ScratchAllocator<T>>;
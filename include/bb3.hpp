@@ -33,11 +33,24 @@ public:
     return *this;
   }
 
+  // the overlap, check it with isValid
+  inline BB3 Intersect(const BB3& bb3) const{
+    return BB3(glm::max(pMin, bb3.pMin), glm::min(pMax, bb3.pMax));
+  }
+
+  inline bool isValid() const{
+    return pMin.x<=pMax.x && pMin.y<=pMax.y && pMin.z<=pMax.z;
+  }
+
   // world pos -> pos relative in bb3(0~1)
   inline glm::vec3 getRelativePos(const glm::vec3 pos) const{ 
     return (pos - pMin)/(pMax - pMin);
   }
 
+  inline glm::vec3 getMin() const {return pMin;}
+  inline glm::vec3 getMax() const {return pMax;}
+  inline glm::vec3 getDiagonal() const {return pMax - pMin;}
+
   inline float getSurfaceArea() const{
     glm::vec3 t = pMax-pMin;
     return 2*(t.x*t.y+t.x*t.z+t.y*t.z);
@@ -92,6 +105,22 @@ public:
     cs[7] = glm::vec3(pMax.x, pMin.y, pMax.z);
   }
 
+  // slab test with 1/d precomputed by the caller, dirIsNeg picks the near
+  // plane of each axis. NaN from 0*inf (origin on a slab plane) fails the
+  // comparisons and is ignored, tMax is enlarged to be conservative
+  inline bool intersect(const Ray& ray, const glm::vec3& invDir, 
+    const int dirIsNeg[3], float tLimit) const{
+    float tMin = 0.0f, tMax = tLimit;
+    for(int axis = 0; axis<3; axis++) {
+      float t1 = ((dirIsNeg[axis]? pMax[axis]: pMin[axis]) - ray.o[axis])*invDir[axis];
+      float t2 = ((dirIsNeg[axis]? pMin[axis]: pMax[axis]) - ray.o[axis])*invDir[axis];
+      t2 *= 1.0f + 2.0f*_Gamma(3);
+      if(t1 > tMin) tMin = t1;
+      if(t2 < tMax) tMax = t2;
+    }
+    return tMin <= tMax;
+  }
+
   inline bool intersect(const Ray& ray, float& tMin, float& tMax) const{
     tMin = FLOAT_MIN, tMax = FLOAT_MAX;
     return itsc_help(ray, tMin, tMax, 0) &&
@@ -6,24 +6,29 @@
 #include "bxdf.hpp"
 #include "medium.hpp"
 #include "integrator.hpp"
+#include "arena.hpp"
 
+// only the shading frame of the hit is kept, not the hit record
 struct PathVertex {
-  Intersection itsc;
+  ShadingPoint itsc;
   glm::vec3 dir_o;
   glm::vec3 beta;
   const BXDF* bxdf;
   const Light* light;
   const Medium* inMedium;
+  float bxdfWeight = 1.0f; // of the lobe bxdf picked from the material
   float fwdPdf = -1.0f;
   float revPdf = -1.0f;
   PathVertex(): bxdf(nullptr), light(nullptr), inMedium(nullptr) {}
-  PathVertex(const Intersection& itsc, glm::vec3 dir_o, glm::vec3 beta, 
+  PathVertex(const ShadingPoint& itsc, glm::vec3 dir_o, glm::vec3 beta, 
     const BXDF* bxdf = nullptr, const Light* light = nullptr, 
     const Medium* inm = nullptr):
     itsc(itsc), dir_o(dir_o), beta(beta), bxdf(bxdf), 
     light(light), inMedium(inm) {}
 };
 
+using PathVertices = ScratchVector<PathVertex>;
+
 class SubPathGenerator{
 public:
   enum TerminateState {
@@ -35,18 +40,25 @@ public:
     None
   };
 
-  std::vector<PathVertex> pathVerticesLt;
-  std::vector<PathVertex> pathVerticesCam;
+  PathVertices pathVerticesLt;
+  PathVertices pathVerticesCam;
   TerminateState tstateLt = TerminateState::None;
   TerminateState tstateCam = TerminateState::None;
 
 private:
   void createSubPath(
     const Ray& start_ray, const Scene& scene, 
-    std::vector<PathVertex>& pathVertices, 
+    PathVertices& pathVertices, 
     TerminateState& tstate, int max_bounce);
 
 public: 
+  // the vertices are drawn from arena, see ScratchAllocator
+  SubPathGenerator(ScratchArena& arena, int max_bounce): 
+    pathVerticesLt(&arena), pathVerticesCam(&arena) {
+    pathVerticesLt.reserve(max_bounce+1);
+    pathVerticesCam.reserve(max_bounce+1);
+  }
+
   void createSubPath(const Ray& start_ray, const Scene& scene, 
     TMode tmode, PathVertex& iniVtx, int max_bounce);
 
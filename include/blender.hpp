@@ -2,18 +2,32 @@
 #include "itsc.hpp"
 #include "texture.hpp"
 
+// closed set, getBlendVal switches on the type
 class Blender {
 public:
+  enum BlenderType {
+    Fix,
+    Tex,
+    DielectricFresnel
+  };
+
+protected:
+  BlenderType type;
+
+public:
+  Blender(BlenderType type): type(type) {}
   virtual ~Blender() {}
-  virtual float getBlendVal(const Intersection& itsc, const Ray& ray_o) const = 0;
+  inline float getBlendVal(const ShadingPoint& itsc, const Ray& ray_o) const;
+  inline BlenderType getType() const {return type;}
 };
 
 class FixBlender: public Blender {
 private:
   float blendCoe;
 public:
-  FixBlender(float blendCoe): blendCoe(blendCoe) {}
-  float getBlendVal(const Intersection& itsc, const Ray& ray_o) const override {
+  FixBlender(float blendCoe): Blender(BlenderType::Fix), blendCoe(blendCoe) {}
+  inline float getBlendCoe() const {return blendCoe;}
+  inline float getBlendVal(const ShadingPoint& itsc, const Ray& ray_o) const {
     return blendCoe;
   }
 };
@@ -22,8 +36,8 @@ class TexBlender: public Blender {
 private:
   const Texture* tex;
 public:
-  TexBlender(const Texture* tex): tex(tex) {}
-  float getBlendVal(const Intersection& itsc, const Ray& ray_o) const override {
+  TexBlender(const Texture* tex): Blender(BlenderType::Tex), tex(tex) {}
+  inline float getBlendVal(const ShadingPoint& itsc, const Ray& ray_o) const {
     return tex->tex2D(itsc.itscVtx.uv).x;
   }
 };
@@ -41,9 +55,10 @@ private:
     return (r1*r1+r2*r2) / 2.0f;
   }
 public:
-  DielectricFresnelBlender(float IOR): IOR(IOR) {}
+  DielectricFresnelBlender(float IOR): 
+    Blender(BlenderType::DielectricFresnel), IOR(IOR) {}
   // return reflection proportion
-  float getBlendVal(const Intersection& itsc, const Ray& ray_o) const override {
+  inline float getBlendVal(const ShadingPoint& itsc, const Ray& ray_o) const {
     float cIOR = itsc.normalReverse? IOR: 1.0f/IOR;
     float cosThetaI = glm::clamp(glm::dot(ray_o.d, itsc.itscVtx.normal), 0.0f, 1.0f);
     float sinThetaI = glm::sqrt(1 - cosThetaI*cosThetaI);
@@ -54,4 +69,16 @@ public:
       return FrDielectric(cosThetaI, cosThetaT);
     }
   }
-};
\ No newline at end of file
+};
+
+inline float Blender::getBlendVal(
+  const ShadingPoint& itsc, const Ray& ray_o) const {
+  switch(type) {
+    case Fix: 
+      return static_cast<const FixBlender*>(this)->getBlendVal(itsc, ray_o);
+    case Tex: 
+      return static_cast<const TexBlender*>(this)->getBlendVal(itsc, ray_o);
+    default: return static_cast<const DielectricFresnelBlender*>(this)->
+      getBlendVal(itsc, ray_o);
+  }
+}
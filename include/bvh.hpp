@@ -7,31 +7,166 @@
 
 #include "debug/pcshow.hpp"
 
+// nodes are stored depth first, the first child of an interior node
+// is always the next node, so only the second child needs to be stored
 struct BVHNode {
   BB3 bb3;
-  int offset, _size;
-  int lft, rgt;
+  int offset; // leaf: first prim in prims, interior: second child index
+  unsigned short _size; // prims in leaf, 0 for interior node
+  unsigned short axis; // split axis of interior node
+
+  inline bool isLeaf() const {return _size > 0;}
+};
+
+// leaf prims packed as SoA groups so that the leaf kernel tests a whole
+// group at once, every leaf starts at a new group. leaf offsets count
+// lanes, lane i is group i/Width. triangles keep v0 and the edges, other
+// prims (id < 0) and unused lanes have zero edges and are never hit
+// by the kernel, they go through the Primitive virtuals
+struct BVHLeafGroup {
+  static constexpr int Width = 4;
+  float v0[3][Width], e1[3][Width], e2[3][Width];
+  int id[Width]; // index in the scene prims, ~index if not a triangle
+
+  static inline int primIdx(int id) {return id < 0 ? ~id : id;}
+};
+
+// SAH cost model and build limits, costs are relative to each other
+struct BVHParams {
+  enum BuildMethod {
+    BinnedSAH, // best tree
+    LBVH, // morton codes, much faster build for large models
+    SBVH // binned SAH with spatial splits, for long thin triangles
+  };
+  static constexpr int MaxLeafPrims = 0xffff; // limited by BVHNode::_size
+  static constexpr int MaxStackDeep = 64; // traversal stack size
+
+  float traversalCost = 0.5f; // cost to visit an interior node
+  float intersectCost = 1.0f; // cost to intersect one primitive
+  int bucketNum = 16; // centroid bins per split
+  int maxDeep = 15; // if maxDeep == -1, deep no restriction
+  int maxPrimsInNode = 8;
+  // subtrees with at least this prims may be built on another thread
+  int parallelThreshold = 4096;
+  int maxThreadNum = 0; // 0: use hardware concurrency
+  BuildMethod method = BuildMethod::BinnedSAH;
+  // LBVH: build the levels above the treelets with SAH instead of morton
+  bool lbvhSAHRefine = true;
+  // SBVH: at most this ratio of extra prim references from spatial splits
+  float sbvhMaxRefGrowth = 0.3f;
+  // SBVH: try spatial splits when the overlap area of the object split
+  // children is larger than this ratio of the root area
+  float sbvhOverlapRatio = 1e-5f;
+  // Scene::update rebuilds when refit grows the SAH cost more than this
+  float maxRefitSAHGrowth = 1.5f;
+  // Scene batch queries interleave the rays (BVH::intersectStream) only
+  // for the binary BVH with at least this nodes, smaller trees stay in
+  // cache and the single ray traversal is faster
+  int streamMinNodes = 1<<18;
 };
 
 class BVH {
 private:
+  struct BuildPrim;
+  struct BuildNode;
+  class BuildTask;
+  struct ObjectSplit;
+  struct SpatialSplit;
+
   std::vector<const Primitive*> & prims; // from scene
+  // prims in leaf order, the leaves point into it, SBVH may repeat prims
+  std::vector<BVHLeafGroup> leafGroups;
   std::vector<BVHNode> bvhNodes;
-  int maxDeep, maxPrimsInNode; // if maxDeep == -1, deep no restriction
+  BVHParams params;
+  float buildSAHCost = 0.0f;
+  int builtPrimNum = 0; // prims.size() at the last build
+
+  void clearBuild();
+
+  void initBuildPrims(std::vector<BuildPrim>& bprims) const;
+  void finishBuild(BuildNode* root, const std::vector<BuildPrim>& bprims);
+  BuildNode* buildRecursive(BuildTask& task, 
+    std::vector<BuildPrim>& bprims, int start, int end, int deep) const;
+  ObjectSplit findObjectSplit(const std::vector<BuildPrim>& bprims, 
+    int start, int end, const BB3& totbb3, const BB3& centerbb3) const;
+  BB3 clipRef(const BuildPrim& ref, int axis, float lo, float hi) const;
+  SpatialSplit findSpatialSplit(
+    const std::vector<BuildPrim>& refs, const BB3& totbb3) const;
+  BuildNode* buildSBVHRecursive(BuildTask& task, 
+    std::vector<BuildPrim>& refs, int deep) const;
+  BuildNode* emitLBVH(const std::vector<BuildPrim>& bprims, 
+    const std::vector<unsigned int>& codes, 
+    int start, int end, int bitIndex, int deep) const;
+  BuildNode* buildUpperMorton(std::vector<BuildNode*>& roots, 
+    const std::vector<unsigned int>& rootCodes, 
+    int start, int end, int bitIndex) const;
+  BuildNode* buildUpperSAH(
+    std::vector<BuildNode*>& roots, int start, int end, int deep) const;
+  int flatten(const BuildNode* node);
+  template<bool AnyHit>
+  void traverseStream(const Ray* rays, int n, HitRecord* hits, 
+    const float* tMaxs, bool* anyHits, const Primitive* const* prims) const;
+  void setLeafPrim(int lane, int primIdx);
+  void refitNode(int nIdx);
+
 public:
-  BVH(std::vector<const Primitive*> & primitives, int maxDeep = 15, int maxPrimsInNode = 8): 
-    prims(primitives), maxDeep(maxDeep), maxPrimsInNode(maxPrimsInNode){}
-  int buildSAHBVH(int start, int end, int deep);
+  BVH(std::vector<const Primitive*> & primitives, 
+    const BVHParams& params = BVHParams()): prims(primitives) {
+    setParams(params);
+  }
+
+  // maxPrimsInNode is clamped to MaxLeafPrims
+  void setParams(const BVHParams& params);
+  inline const BVHParams& getParams() const {return params;}
 
-  void intersect(const Ray& ray, Intersection& itsc, 
-    int nIdx, const Primitive* prim = nullptr) const;
-  bool intersectTest(const Ray& ray, int nIdx, const Primitive* prim = nullptr) const;
+  // build with params.method
+  void build();
+  // binned SAH
+  void buildSAHBVH();
+  // morton code linear BVH
+  void buildLBVH();
+  // binned SAH, prims may be split into several leaves by spatial splits
+  void buildSBVH();
+  // recalculate the bounds after prims moved, the tree is not changed
+  void refit();
+
+  // the closest hit in [tMin, hit.t)
+  void intersect(const Ray& ray, HitRecord& hit, 
+    const Primitive* prim = nullptr, float tMin = 0.0f) const;
+  // coherent rays, e.g. RayPacket::rays, share the node fetches. 
+  // the hits are the same as intersect for each ray, up to ties in t
+  void intersectPacket(const Ray* rays, int n, HitRecord* hits) const;
+  // incoherent rays, e.g. the bounce rays of many paths. StreamWidth
+  // rays are traversed interleaved, each step prefetches the next node
+  // of a ray and switches to the next ray to hide the memory latency.
+  // prims[i] is the prim avoided by rays[i], prims may be nullptr
+  static constexpr int StreamWidth = 8;
+  void intersectStream(const Ray* rays, int n, HitRecord* hits, 
+    const Primitive* const* prims = nullptr) const;
+  // hits[i]: any hit of rays[i] in [0, tMaxs[i])
+  void intersectTestStream(const Ray* rays, int n, const float* tMaxs, 
+    bool* hits, const Primitive* const* prims = nullptr) const;
+  // any hit in [tMin, tMax), stops at the first one found
+  bool intersectTest(const Ray& ray, const Primitive* prim = nullptr, 
+    float tMin = 0.0f, float tMax = FLOAT_MAX) const;
   bool occlude(const Intersection& it1, const Intersection& it2, 
     Ray& testRay, float& rayLen) const;
   // For Debug, after build BVH
   void generatePointCloud(PCShower& pc);
   BB3 getWholeBound() const;
+  // expected cost of a random ray under params, used to compare tree quality
+  float getSAHCost() const;
+  // SAH cost right after the last build, refit only makes it worse
+  inline float getBuildSAHCost() const {return buildSAHCost;}
+  // the prims appended after the last build are not in the tree
+  inline int getBuiltPrimNum() const {return builtPrimNum;}
+
+  // test the leaf lanes [start, start+count), shared with the wide BVHs
+  void intersectLeaf(const Ray& ray, HitRecord& hit, 
+    int start, int count, const Primitive* prim, float tMin = 0.0f) const;
+  bool intersectTestLeaf(const Ray& ray, int start, int count, 
+    const Primitive* prim, float tMin, float tMax) const;
 
   inline const std::vector<const Primitive*> & getPrims() const {return prims;}
   inline const std::vector<BVHNode> & getNodes() const {return bvhNodes;}
-};
\ No newline at end of file
+};
@@ -18,8 +18,23 @@
   (BXDF::BXDFNature::wtype & (ctype))
 #define _Connectable(ctype) (!((ctype) & 0x030))
 
+// the leaves of the material tree. the set is closed, evaluate, 
+// sample_ev, sample_pdf and needMIS switch on bxdfClass to the
+// functions of the same names in the subclasses (see bxdf.cpp)
 class BXDF: public BXDFNode {
 public:
+  enum BXDFClass {
+    Lambertian,
+    PureTrans,
+    Specular,
+    SpecularTrans,
+    GGXRefl,
+    GGXTrans,
+    Henyey,
+    SubSurface,
+    Group // the non-delta lobes of a material, see LobeGroup
+  };
+
   enum BXDFNature {
     // BXDF Type (mutual)
     REFLECT = 0x001, // ray do not pass surafce
@@ -36,51 +51,46 @@ public:
   };
 
 protected:
+  BXDFClass bxdfClass;
   int type;
 
 public:
   virtual ~BXDF() {}
-  BXDF(int type): type(type) {}
+  BXDF(BXDFClass bxdfClass, int type): 
+    BXDFNode(NodeType::Leaf), bxdfClass(bxdfClass), type(type) {}
 
-  inline virtual int getType() const {return type;}
+  inline int getType() const {return type;}
+  inline BXDFClass getClass() const {return bxdfClass;}
 
   // NOTICE: we always make sure 'dot(ray.d, normal)>0'
 
   // return brdf*|cos|, always not return black
-  virtual glm::vec3 evaluate(
-    const Intersection& itsc, const Ray& ray_o, const Ray& ray_i) const = 0;
+  glm::vec3 evaluate(
+    const ShadingPoint& itsc, const Ray& ray_o, const Ray& ray_i) const;
   // return brdf*|cos|/pdf (to reduce unneccessary calc)
   // this func directly calc beta(as pbrt)
   // if return black, the sample ray is invalid!
-  virtual glm::vec3 sample_ev(
-    const Intersection& itsc, const Ray& ray_o, Ray& ray_i) const = 0;
+  glm::vec3 sample_ev(
+    const ShadingPoint& itsc, const Ray& ray_o, Ray& ray_i) const;
 
   // return pdf (respect to solid angle)
-  virtual float sample_pdf(
-    const Intersection& itsc, const Ray& ray_i, const Ray& ray_o) const = 0;
+  float sample_pdf(
+    const ShadingPoint& itsc, const Ray& ray_i, const Ray& ray_o) const;
 
-  inline float getBXDF(
-    const Intersection& itsc, const Ray& ray_o, const BXDFNode*& bxdfNode) const override {
-    bxdfNode = this;
-    return 1.0f;
-  }
-  
-  inline virtual bool needMIS(const Intersection& itsc) const {return false;}
+  bool needMIS(const ShadingPoint& itsc) const;
+
+  // estimated reflectance, the lobes of a material are sampled in 
+  // proportion to it
+  glm::vec3 getAlbedo(const ShadingPoint& itsc, const Ray& ray_o) const;
 };
 
 /************************BSSRDF Base******************************/
 
+// not implemented yet, the calls on it warn and return black
 class BSSRDF: public BXDF {
 
 public:
-  BSSRDF(): BXDF(BXDFNature::BSSRDF) {}
-
-  glm::vec3 evaluate(
-    const Intersection& itsc, const Ray& ray_o, const Ray& ray_i) const override;
-  glm::vec3 sample_ev(
-    const Intersection& itsc, const Ray& ray_o, Ray& ray_i) const override;
-  float sample_pdf(
-    const Intersection& itsc, const Ray& ray_i, const Ray& ray_o) const override;
+  BSSRDF(): BXDF(BXDFClass::SubSurface, BXDFNature::BSSRDF) {}
 };
 
 /************************LambertianReflection******************************/
@@ -90,16 +100,19 @@ private:
   const Texture* texture;
 
 public:
-  LambertianReflection(const Texture* tex): BXDF(BXDFNature::REFLECT), texture(tex) {}
+  LambertianReflection(const Texture* tex): BXDF(BXDFClass::Lambertian, BXDFNature::REFLECT), texture(tex) {}
+
+  inline glm::vec3 getAlbedo(const ShadingPoint& itsc, const Ray& ray_o) const {
+    return texture->tex2D(itsc.itscVtx.uv);
+  }
 
   glm::vec3 evaluate(
-    const Intersection& itsc, const Ray& ray_o, const Ray& ray_i) const override;
+    const ShadingPoint& itsc, const Ray& ray_o, const Ray& ray_i) const;
   glm::vec3 sample_ev(
-    const Intersection& itsc, const Ray& ray_o, Ray& ray_i) const override;
+    const ShadingPoint& itsc, const Ray& ray_o, Ray& ray_i) const;
   float sample_pdf(
-    const Intersection& itsc, const Ray& ray_i, const Ray& ray_o) const override;
+    const ShadingPoint& itsc, const Ray& ray_i, const Ray& ray_o) const;
 
-  inline bool needMIS(const Intersection& itsc) const override {return false;}
 };
 
 /************************PerfectSpecular******************************/
@@ -107,22 +120,27 @@ public:
 class PureTransmission: public BXDF { // for no surface medium
 public:
   PureTransmission(): 
-    BXDF(BXDFNature::NoInteractive|BXDFNature::TRANSMISSION) {}
+    BXDF(BXDFClass::PureTrans, 
+      BXDFNature::NoInteractive|BXDFNature::TRANSMISSION) {}
+
+  inline glm::vec3 getAlbedo(const ShadingPoint& itsc, const Ray& ray_o) const {
+    return glm::vec3(1.0f);
+  }
 
   inline glm::vec3 evaluate(
-    const Intersection& itsc, const Ray& ray_o, const Ray& ray_i) const override {
+    const ShadingPoint& itsc, const Ray& ray_o, const Ray& ray_i) const {
     return glm::vec3(0.0f);
   }
 
   glm::vec3 sample_ev(
-    const Intersection& itsc, const Ray& ray_o, Ray& ray_i) const override {
+    const ShadingPoint& itsc, const Ray& ray_o, Ray& ray_i) const {
     ray_i.o = ray_o.o;
     ray_i.d = -ray_o.d;
     return glm::vec3(1.0f);
   }
 
   float sample_pdf(
-    const Intersection& itsc, const Ray& ray_i, const Ray& ray_o) const override {
+    const ShadingPoint& itsc, const Ray& ray_i, const Ray& ray_o) const {
     return 0.0f;
   }
 };
@@ -135,18 +153,23 @@ private:
 
 public:
   PerfectSpecular(const Texture* tex): 
-    BXDF(BXDFNature::DELTA|BXDFNature::REFLECT), absorb(tex) {}
+    BXDF(BXDFClass::Specular, BXDFNature::DELTA|BXDFNature::REFLECT), 
+    absorb(tex) {}
+
+  inline glm::vec3 getAlbedo(const ShadingPoint& itsc, const Ray& ray_o) const {
+    return absorb->tex2D(itsc.itscVtx.uv);
+  }
 
   inline glm::vec3 evaluate(
-    const Intersection& itsc, const Ray& ray_o, const Ray& ray_i) const override {
+    const ShadingPoint& itsc, const Ray& ray_o, const Ray& ray_i) const {
     return glm::vec3(0.0f);
   }
 
   glm::vec3 sample_ev(
-    const Intersection& itsc, const Ray& ray_o, Ray& ray_i) const override;
+    const ShadingPoint& itsc, const Ray& ray_o, Ray& ray_i) const;
   
   float sample_pdf(
-    const Intersection& itsc, const Ray& ray_i, const Ray& ray_o) const override {
+    const ShadingPoint& itsc, const Ray& ray_i, const Ray& ray_o) const {
     return 0.0f;
   }
 };
@@ -160,18 +183,23 @@ private:
 
 public:
   PerfectTransimission(const Texture* tex, float IOR): 
-    BXDF(BXDFNature::DELTA|BXDFNature::TRANSMISSION), IOR(IOR), absorb(tex) {}
+    BXDF(BXDFClass::SpecularTrans, 
+      BXDFNature::DELTA|BXDFNature::TRANSMISSION), IOR(IOR), absorb(tex) {}
+
+  inline glm::vec3 getAlbedo(const ShadingPoint& itsc, const Ray& ray_o) const {
+    return absorb->tex2D(itsc.itscVtx.uv);
+  }
 
   inline glm::vec3 evaluate(
-    const Intersection& itsc, const Ray& ray_o, const Ray& ray_i) const override {
+    const ShadingPoint& itsc, const Ray& ray_o, const Ray& ray_i) const {
     return glm::vec3(0.0f);
   }
 
   glm::vec3 sample_ev(
-    const Intersection& itsc, const Ray& ray_o, Ray& ray_i) const override;
+    const ShadingPoint& itsc, const Ray& ray_o, Ray& ray_i) const;
   
   float sample_pdf(
-    const Intersection& itsc, const Ray& ray_i, const Ray& ray_o) const override {
+    const ShadingPoint& itsc, const Ray& ray_i, const Ray& ray_o) const {
     return 0.0f;
   }
 };
@@ -184,19 +212,23 @@ private:
 
 public:
   GGXReflection(const Texture* roughness, const Texture* albedo): 
-    BXDF(BXDFNature::REFLECT | BXDFNature::GLOSSY), 
+    BXDF(BXDFClass::GGXRefl, BXDFNature::REFLECT | BXDFNature::GLOSSY), 
     roughness(roughness), albedo(albedo) {}
 
-  inline glm::vec3 evaluate(
-    const Intersection& itsc, const Ray& ray_o, const Ray& ray_i) const override;
+  inline glm::vec3 getAlbedo(const ShadingPoint& itsc, const Ray& ray_o) const {
+    return albedo->tex2D(itsc.itscVtx.uv);
+  }
+
+  glm::vec3 evaluate(
+    const ShadingPoint& itsc, const Ray& ray_o, const Ray& ray_i) const;
 
   glm::vec3 sample_ev(
-    const Intersection& itsc, const Ray& ray_o, Ray& ray_i) const override;
+    const ShadingPoint& itsc, const Ray& ray_o, Ray& ray_i) const;
   
   float sample_pdf(
-    const Intersection& itsc, const Ray& ray_i, const Ray& ray_o) const override;
+    const ShadingPoint& itsc, const Ray& ray_i, const Ray& ray_o) const;
   
-  inline virtual bool needMIS(const Intersection& itsc) const {
+  inline bool needMIS(const ShadingPoint& itsc) const {
     //if(roughness->tex2D(itsc.itscVtx.uv).x < 0.1f)
     return true;
   }
@@ -211,19 +243,24 @@ private:
 
 public:
   GGXTransimission(float IOR, const Texture* roughness, const Texture* albedo): 
-    BXDF(BXDFNature::TRANSMISSION | BXDFNature::GLOSSY), 
+    BXDF(BXDFClass::GGXTrans, 
+      BXDFNature::TRANSMISSION | BXDFNature::GLOSSY), 
     IOR(IOR), roughness(roughness), albedo(albedo) {}
 
-  inline glm::vec3 evaluate(
-    const Intersection& itsc, const Ray& ray_o, const Ray& ray_i) const override;
+  inline glm::vec3 getAlbedo(const ShadingPoint& itsc, const Ray& ray_o) const {
+    return albedo->tex2D(itsc.itscVtx.uv);
+  }
+
+  glm::vec3 evaluate(
+    const ShadingPoint& itsc, const Ray& ray_o, const Ray& ray_i) const;
 
   glm::vec3 sample_ev(
-    const Intersection& itsc, const Ray& ray_o, Ray& ray_i) const override;
+    const ShadingPoint& itsc, const Ray& ray_o, Ray& ray_i) const;
   
   float sample_pdf(
-    const Intersection& itsc, const Ray& ray_i, const Ray& ray_o) const override;
+    const ShadingPoint& itsc, const Ray& ray_i, const Ray& ray_o) const;
   
-  inline virtual bool needMIS(const Intersection& itsc) const {
+  inline bool needMIS(const ShadingPoint& itsc) const {
     //if(roughness->tex2D(itsc.itscVtx.uv).x < 0.1f)
     return true;
   }
@@ -240,24 +277,29 @@ private:
   float samplePhaseCosTheta() const;
 
 public:
-  HenyeyPhase(float g, glm::vec3 sigmaS): BXDF(BXDFNature::NoSurface), 
+  HenyeyPhase(float g, glm::vec3 sigmaS): 
+    BXDF(BXDFClass::Henyey, BXDFNature::NoSurface), 
     g(g), sigmaS(sigmaS) {}
 
+  inline glm::vec3 getAlbedo(const ShadingPoint& itsc, const Ray& ray_o) const {
+    return sigmaS;
+  }
+
   // return phase distribution value
   inline glm::vec3 evaluate(
-    const Intersection& itsc, const Ray& ray_o, const Ray& ray_i) const override{
+    const ShadingPoint& itsc, const Ray& ray_o, const Ray& ray_i) const {
     // convert direction
     float cosTheta = -glm::dot(ray_o.d, ray_i.d);
     return glm::vec3(0.25f*INV_PI*(1-g*g)/ (1+g*g+2*g*cosTheta));
   }
 
   glm::vec3 sample_ev(
-    const Intersection& itsc, const Ray& ray_o, Ray& ray_i) const override;
+    const ShadingPoint& itsc, const Ray& ray_o, Ray& ray_i) const;
 
   float sample_pdf(
-    const Intersection& itsc, const Ray& ray_i, const Ray& ray_o) const override;
+    const ShadingPoint& itsc, const Ray& ray_i, const Ray& ray_o) const;
 
-  inline virtual bool needMIS(const Intersection& itsc) const {
+  inline bool needMIS(const ShadingPoint& itsc) const {
     //if(g > 0.6f || g < -0.4f)
     return true;
   }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <algorithm>
+
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
@@ -71,11 +73,83 @@ class RayGenerator {
 protected:
   const Camera& camera;
   Block2D curRenderBlock;
+  int tileX = 0, tileY = 0; // packets walk the block tile by tile
+  int sampleIndex = 0; // of the last ray of genNextRay
+
+  // the offset of the ray of a pixel sample in the pixel
+  virtual glm::vec2 getJitter(glm::ivec2 pixel, int index) const = 0;
+
+  // rasterPos = pixel + jitter, kept inside the pixel
+  void genPixelRay(Ray& ray, glm::vec2& rasterPos, 
+    glm::vec2 pixel, glm::vec2 jitter) const {
+    rasterPos = jitter+pixel;
+
+    // !! NOTICE: just like 300.0f + 0.99999f == 301.0f
+    /*
+    浮点数加法对阶（小阶对大阶）时右移可能发生进位（相当于+1）。
+    减去一个很小的浮点数也可能因为对阶的舍入（相当于-0）没用。
+    使用std::nextafter能够得到最近的大于或小于某个数的浮点数，是最好的选择。
+    这一部分非常重要，用中文写明
+    */
+    if(rasterPos.x >= pixel.x+1) 
+      rasterPos.x=std::nextafter(rasterPos.x, rasterPos.x-1);
+    if(rasterPos.y >= pixel.y+1) 
+      rasterPos.y=std::nextafter(rasterPos.y, rasterPos.y-1);
+
+    camera.generateRay(ray, rasterPos);
+  }
+
+  // the samples of the same index of the pixels of the current tile
+  void genTilePacket(RayPacket& packet, int index) const {
+    int w = std::min((int)PacketTile, curRenderBlock.width - tileX);
+    int h = std::min((int)PacketTile, curRenderBlock.height - tileY);
+    packet.size = 0;
+    for(int y = 0; y<h; y++) {
+      for(int x = 0; x<w; x++) {
+        glm::vec2 pixel(tileX+x+curRenderBlock.offsetX, 
+          tileY+y+curRenderBlock.offsetY);
+        genPixelRay(packet.rays[packet.size], packet.rasterPos[packet.size], 
+          pixel, getJitter(glm::ivec2(pixel), index));
+        packet.sampleIndex[packet.size] = index;
+        packet.size++;
+      }
+    }
+  }
+
+  inline void nextTile() {
+    tileX += PacketTile;
+    if(tileX >= curRenderBlock.width) {
+      tileX = 0;
+      tileY += PacketTile;
+    }
+  }
+
+  inline bool tilesDone() const {
+    return curRenderBlock.width <= 0 || tileY >= curRenderBlock.height;
+  }
+
 public:
+  static constexpr int PacketTile = 8; // PacketTile^2 <= RayPacket::MaxSize
+
   RayGenerator(const Camera& cam): camera(cam),
     curRenderBlock({cam.getReX(), cam.getReY(), 0, 0}) {}
   ~RayGenerator() {}
   virtual bool genNextRay(Ray& ray, glm::vec2& rasterPos) = 0;
+  // the key of the path of the last ray of genNextRay is its pixel and
+  // the sample index, see GeneralSampler::startSample
+  inline int getSampleIndex() const {return sampleIndex;}
+
+  // coherent rays for packet traversal, by default just the next rays.
+  // NOTICE: do not mix it with genNextRay before reset
+  virtual bool genNextPacket(RayPacket& packet) {
+    packet.size = 0;
+    while(packet.size < RayPacket::MaxSize && genNextRay(
+      packet.rays[packet.size], packet.rasterPos[packet.size])) {
+      packet.sampleIndex[packet.size] = sampleIndex;
+      packet.size++;
+    }
+    return packet.size > 0;
+  }
 
   inline glm::vec3 getCamPos() const {return camera.getPosition();}
   inline glm::vec2 world2raster(glm::vec3 wp) const {return camera.world2raster(wp);}
@@ -95,7 +169,11 @@ public:
   void reset(const Block2D renderBlock) {
     curRenderBlock = renderBlock;
     cntx = cnty = cntspp = 0;
-    sp2d.clear();
+    tileX = tileY = 0;
+  }
+
+  glm::vec2 getJitter(glm::ivec2 pixel, int index) const {
+    return sp2d.get2(index, pixel);
   }
 
   bool genNextRay(Ray& ray, glm::vec2& rasterPos) {
@@ -106,21 +184,8 @@ public:
       cntx+curRenderBlock.offsetX,
       cnty+curRenderBlock.offsetY
     );
-    rasterPos = sp2d.get2()+offset;
-    
-    // !! NOTICE: just like 300.0f + 0.99999f == 301.0f
-    /*
-    浮点数加法对阶（小阶对大阶）时右移可能发生进位（相当于+1）。
-    减去一个很小的浮点数也可能因为对阶的舍入（相当于-0）没用。
-    使用std::nextafter能够得到最近的大于或小于某个数的浮点数，是最好的选择。
-    这一部分非常重要，用中文写明
-    */
-    if(rasterPos.x >= offset.x+1) 
-      rasterPos.x=std::nextafter(rasterPos.x, rasterPos.x-1);
-    if(rasterPos.y >= offset.y+1) 
-      rasterPos.y=std::nextafter(rasterPos.y, rasterPos.y-1);
-
-    camera.generateRay(ray, rasterPos);
+    sampleIndex = cntspp;
+    genPixelRay(ray, rasterPos, offset, getJitter(glm::ivec2(offset), cntspp));
     cntspp++;
     if(cntspp>=spp) {
       cntspp = 0;
@@ -132,6 +197,18 @@ public:
     }
     return true;
   }
+
+  // one stratum for the whole tile, then the next stratum
+  bool genNextPacket(RayPacket& packet) {
+    if(tilesDone()) return false;
+    genTilePacket(packet, cntspp);
+    cntspp++;
+    if(cntspp>=spp) {
+      cntspp = 0;
+      nextTile();
+    }
+    return true;
+  }
 };
 
 
@@ -142,20 +219,21 @@ private:
   HaltonSampler2D hsp2d;
 public:
   HaltonRGen(const Camera& cam): RayGenerator(cam), cntx(0), cnty(0){}
+
+  // the same for all pixels of a pass
+  glm::vec2 getJitter(glm::ivec2 pixel, int index) const {
+    return hspRasPos;
+  }
   
   bool genNextRay(Ray& ray, glm::vec2& rasterPos) {
     if(cntx >= curRenderBlock.width || 
        cnty >= curRenderBlock.height) return false;
 
-    int offx = cntx+curRenderBlock.offsetX;
-    int offy = cnty+curRenderBlock.offsetY;
-    rasterPos = hspRasPos+glm::vec2(offx, offy);
-    if(rasterPos.x >= offx+1) 
-      rasterPos.x=std::nextafter(rasterPos.x, rasterPos.x-1);
-    if(rasterPos.y >= offy+1) 
-      rasterPos.y=std::nextafter(rasterPos.y, rasterPos.y-1);
-
-    camera.generateRay(ray, rasterPos);
+    glm::vec2 offset(
+      cntx+curRenderBlock.offsetX,
+      cnty+curRenderBlock.offsetY
+    );
+    genPixelRay(ray, rasterPos, offset, hspRasPos);
     cntx++;
     if(cntx>=curRenderBlock.width) {
       cntx = 0;
@@ -164,8 +242,17 @@ public:
     return true;
   }
 
+  bool genNextPacket(RayPacket& packet) {
+    if(tilesDone()) return false;
+    genTilePacket(packet, sampleIndex);
+    nextTile();
+    return true;
+  }
+
   void reset(int index) {
     cntx = cnty = 0;
+    tileX = tileY = 0;
+    sampleIndex = index;
     hspRasPos = hsp2d.get2(index);
   }
 };
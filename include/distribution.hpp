@@ -5,11 +5,13 @@
 #include <algorithm>
 
 #include "sampler.hpp"
+#include "arena.hpp"
 
 class DiscreteDistribution1D {
 
 private:
-  std::vector<float> cdf;
+  // on heap, or on the arena given to the constructor
+  ScratchVector<float> cdf;
   float sum_pdf;
 
   bool cdfHaveCalc = false;
@@ -17,12 +19,22 @@ private:
 public:
   DiscreteDistribution1D(){}
   // will calc pdf
-  DiscreteDistribution1D(const std::vector<float>& pdf): cdf(pdf) {
+  DiscreteDistribution1D(const std::vector<float>& pdf): 
+    cdf(pdf.begin(), pdf.end()) {
     calcCdf();
   }
   DiscreteDistribution1D(int num) {
     cdf.resize(num, 0);
   }
+  // the cdf is drawn from arena, see ScratchAllocator
+  explicit DiscreteDistribution1D(ScratchArena& arena, int num = 0): 
+    cdf(num, 0.0f, ScratchAllocator<float>(&arena)) {}
+
+  // num zero pdfs again, reuses the memory of cdf
+  void reset(int num) {
+    cdf.assign(num, 0.0f);
+    cdfHaveCalc = false;
+  }
   
   // will not calc pdf, after all pdf added, need call calcCdf explicitly
   void addPdf(float pdf) {
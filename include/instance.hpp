@@ -0,0 +1,88 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+
+#include <glm/glm.hpp>
+
+#include "primitive.hpp"
+#include "bvh.hpp"
+#include "model.hpp"
+
+// geometry shared by all its instances, the prims and the bottom level
+// BVH are in object space and built only once
+// NOTICE: the prims are owned by the model meshes, keep the model alive
+class InstanceGeometry {
+private:
+  std::vector<const Primitive*> prims;
+  std::unordered_map<const Primitive*, int> primIDs;
+  BVH bvh;
+
+public:
+  InstanceGeometry(Model& model, const BVHParams& params = BVHParams());
+  InstanceGeometry(const InstanceGeometry&) = delete;
+  const InstanceGeometry& operator=(const InstanceGeometry&) = delete;
+
+  inline const BVH& getBVH() const {return bvh;}
+  inline const std::vector<const Primitive*>& getPrims() const {return prims;}
+  // index of prim in getPrims()
+  inline int getPrimID(const Primitive* prim) const {
+    return primIDs.find(prim)->second;
+  }
+};
+
+// a placed InstanceGeometry, it is a leaf of the top level BVH.
+// rays are transformed to object space at the instance boundary and the
+// itsc of the inner prim is transformed back by handleItscResult,
+// itsc.prim is the inner prim so that material lookups are unchanged
+// NOTICE: prim_avd of scene queries is not passed into instances
+class Instance: public Primitive {
+private:
+  const InstanceGeometry* geometry;
+  glm::mat4x4 toWorld, toObject;
+  glm::mat3x3 normalToWorld;
+  BB3 worldBB3;
+
+  void updateTransform();
+  // d of the returned ray is normalized, scale = |toObject*d|
+  Ray toObjectRay(const Ray& ray, float& scale) const;
+
+public:
+  Instance(const InstanceGeometry* geometry, const glm::mat4x4& toWorld);
+
+  Primitive* copy(const Mesh* mesh) const;
+
+  BB3 getBB3() const {return worldBB3;}
+
+  // these move the instance, the shared geometry is not touched
+  void translate(glm::vec3);
+  void scale(glm::vec3);
+  void rotate(glm::vec3, float);
+  void setTransform(const glm::mat4x4& trans);
+  inline const glm::mat4x4& getTransform() const {return toWorld;}
+
+  inline const InstanceGeometry* getGeometry() const {return geometry;}
+
+  inline glm::vec3 getCenter() const {return worldBB3.getCenter();}
+
+  // instances are never the itsc prim, so they have no area
+  inline float getArea() const {return 0;}
+
+  float getAPointOnSurface(Intersection& itsc) const;
+
+  void intersect(const Ray& ray, HitRecord& hit, float tMin = 0.0f) const;
+
+  bool intersectTest(const Ray& ray,
+    float tMin = 0.0f, float tMax = FLOAT_MAX) const;
+
+  // the position on the ray of a hit, for the inner prim
+  inline glm::vec3 toObjectPoint(glm::vec3 p) const {
+    return toObject*glm::vec4(p, 1.0f);
+  }
+
+  // itsc is calculated by the inner prim in object space, to world space
+  void handleItscResult(Intersection& itsc) const;
+  void handleItscGeometry(Intersection& itsc) const;
+
+  void genPrimPointCloud(PCShower& pc, glm::vec3 col) const;
+};
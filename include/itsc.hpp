@@ -9,17 +9,14 @@
 #include "ray.hpp"
 
 class Primitive;
+class Instance;
 
-class Intersection {
+// the shading frame of a hit, what bxdf, material and light read.
+// filled by Scene::handleItscResult, see HitRecord for the hit
+class ShadingPoint {
 public:
-  float t;
   // all interpolated when triangle
   Vertex itscVtx;
-  // NOTICE when use uv map, do not use it !! use itscVtx.uv
-  // localUV used in triangle intersect, 
-  // some custom primitive intersect will not use it
-  glm::vec2 localUV;
-  glm::vec3 itscError; // the error bound of the itsc point
   glm::vec3 geoNormal; // the real normal for the surface
   const Primitive* prim;
 
@@ -28,26 +25,7 @@ public:
   // shading normal satisfy it
   bool normalReverse = false;
 
-  Intersection(): t(FLOAT_MAX), localUV(0), 
-    itscError(0), prim(nullptr) {}
-
-  // NOTICE: make sure t > 0 !
-  inline void updateItscInfo(float t, const Primitive* prim, const Ray& ray) {
-    if(t < this->t) {
-      this->t = t;
-      this->prim = prim;
-      this->itscVtx.position = ray.pass(t);
-    }
-  }
-
-  // NOTICE: make sure t > 0 !
-  inline void updateItscInfo(float t, const Primitive* prim, glm::vec2 luv) {
-    if(t < this->t) {
-      this->t = t;
-      this->prim = prim;
-      this->localUV = luv;
-    }
-  }
+  ShadingPoint(): prim(nullptr) {}
 
   inline void reverseNormal() {
     geoNormal = -geoNormal;
@@ -61,15 +39,6 @@ public:
     return normalReverse ^ ct;
   }
 
-  // offset pos by error and the relation of normal and dir
-  // make sure that dir is on the same side with geoNormal
-  inline void maxErrorOffset(glm::vec3 dir, glm::vec3& pos) const{
-    float errord = glm::dot(itscError, glm::abs(geoNormal));
-    errord = std::nextafter(errord, FLOAT_MAX); //+1 ulp
-    if(glm::dot(dir, geoNormal) > 0) pos += errord*geoNormal;
-    else pos -= errord*geoNormal;
-  }
-
   // from world space direction to calc tangent space angles
   
   // dot(w, n) should >0, with real geoNormal
@@ -96,4 +65,64 @@ public:
   inline glm::vec3 toWorldSpace(glm::vec3 p) const{
     return itscVtx.toWorldSpace(p);
   }
-};
\ No newline at end of file
+};
+
+// the closest hit of a traversal, all the traversal writes.
+// Scene::handleItscResult builds the Intersection from it
+struct HitRecord {
+  float t;
+  // NOTICE when use uv map, do not use it !! use itscVtx.uv
+  // localUV used in triangle intersect, 
+  // some custom primitive intersect will not use it
+  glm::vec2 localUV;
+  const Primitive* prim;
+  // the instance prim is in, nullptr if prim is in world space
+  const Instance* instance;
+
+  HitRecord(float tMax = FLOAT_MAX): t(tMax), localUV(0), 
+    prim(nullptr), instance(nullptr) {}
+
+  // NOTICE: make sure t > 0 !
+  inline void update(float t, const Primitive* prim, 
+    glm::vec2 luv = glm::vec2(0)) {
+    if(t < this->t) {
+      this->t = t;
+      this->prim = prim;
+      this->instance = nullptr;
+      this->localUV = luv;
+    }
+  }
+};
+
+// a handled hit, the shading frame with the hit record and error bound
+class Intersection: public ShadingPoint {
+public:
+  float t;
+  glm::vec2 localUV; // see HitRecord
+  glm::vec3 itscError; // the error bound of the itsc point
+  // the instance prim is in, nullptr if prim is in world space
+  const Instance* instance;
+
+  Intersection(): t(FLOAT_MAX), localUV(0), 
+    itscError(0), instance(nullptr) {}
+
+  // a new frame for the hit, the position is on the ray. the prims 
+  // which need more fill the rest in handleItscResult
+  inline void setHit(const HitRecord& hit, glm::vec3 position) {
+    t = hit.t; localUV = hit.localUV;
+    prim = hit.prim; instance = hit.instance;
+    itscVtx = Vertex(position);
+    geoNormal = glm::vec3(0.0f);
+    itscError = glm::vec3(0.0f);
+    normalReverse = false;
+  }
+
+  // offset pos by error and the relation of normal and dir
+  // make sure that dir is on the same side with geoNormal
+  inline void maxErrorOffset(glm::vec3 dir, glm::vec3& pos) const{
+    float errord = glm::dot(itscError, glm::abs(geoNormal));
+    errord = std::nextafter(errord, FLOAT_MAX); //+1 ulp
+    if(glm::dot(dir, geoNormal) > 0) pos += errord*geoNormal;
+    else pos -= errord*geoNormal;
+  }
+};
@@ -11,21 +11,37 @@
 class Scene;
 class Model;
 
+// the set of lights is closed, the calls while rendering switch on 
+// the type (see light.cpp), the setup ones stay virtual
 class Light {
 public:
+  enum LightType {
+    Shape,
+    Point,
+    Directional,
+    Environment
+  };
+
+protected:
+  LightType type;
+
+public:
+  Light(LightType type): type(type) {}
   virtual ~Light() {}
+  inline LightType getType() const {return type;}
+
   // TO BE Improved
   virtual float selectProbality(const Scene& scene) = 0;
   // return pdf
-  virtual float getItscOnLight(Intersection& itsc, glm::vec3 evaP) const = 0;
+  float getItscOnLight(Intersection& itsc, glm::vec3 evaP) const;
   // if the itsc on the light, return the pdf sampling this itsc
-  virtual float getItscPdf(const Intersection& itsc, const Ray& rayToLight) const = 0;
+  float getItscPdf(const ShadingPoint& itsc, const Ray& rayToLight) const;
   // return le
-  virtual glm::vec3 evaluate(const Intersection& itsc, glm::vec3 dir) const = 0;
+  glm::vec3 evaluate(const ShadingPoint& itsc, glm::vec3 dir) const;
   // return ray pdf_A*pdf_dir
-  virtual void genRay(Intersection& itsc, Ray& ray, float& pdf_A, float& pdf_D) const = 0;
+  void genRay(Intersection& itsc, Ray& ray, float& pdf_A, float& pdf_D) const;
   // itsc: litsc
-  virtual float getRayPdf(const Intersection& itsc, glm::vec3 dir) const = 0;
+  float getRayPdf(const ShadingPoint& itsc, glm::vec3 dir) const;
 
   virtual void addToScene(Scene& scene) = 0;
 };
@@ -42,23 +58,24 @@ public:
   ShapeLight(const Texture* ltMp, Model& shape);
 
   void addToScene(Scene& scene);
+  inline Model& getModel() {return model;}
 
   inline float selectProbality(const Scene& scene) {
     return selectP;
   }
 
   // return le, dir in world space, dir point to outside surface
-  inline glm::vec3 evaluate(const Intersection& itsc, glm::vec3 dir) const{
+  inline glm::vec3 evaluate(const ShadingPoint& itsc, glm::vec3 dir) const{
     return lightMap->tex2D(itsc.itscVtx.uv);
   }
 
-  inline float getItscPdf(const Intersection& itsc, const Ray& rayToLight) const{
+  inline float getItscPdf(const ShadingPoint& itsc, const Ray& rayToLight) const{
     return 1.0f/totArea;
   }
 
   void genRay(Intersection& itsc, Ray& ray, float& pdf_A, float& pdf_D) const;
 
-  float getRayPdf(const Intersection& itsc, glm::vec3 dir) const {
+  float getRayPdf(const ShadingPoint& itsc, glm::vec3 dir) const {
     return itsc.itscVtx.cosTheta(dir)<0? 0.0:1.0f/PI2;
   }
 
@@ -73,13 +90,14 @@ private:
 
 public:
   // le falloff by default square relationship
-  PointLight(glm::vec3 le, glm::vec3 pos): le(le), position(pos){}
+  PointLight(glm::vec3 le, glm::vec3 pos): 
+    Light(LightType::Point), le(le), position(pos){}
 
   void addToScene(Scene& scene) {}
 
   inline float selectProbality(const Scene& scene) {return Luminance(le);}
 
-  inline glm::vec3 evaluate(const Intersection& itsc, glm::vec3 dir) const {return le;}
+  inline glm::vec3 evaluate(const ShadingPoint& itsc, glm::vec3 dir) const {return le;}
 
   inline float getItscOnLight(Intersection& itsc, glm::vec3 evaP) const {
     itsc.itscVtx.position = position;
@@ -90,11 +108,11 @@ public:
 
   void genRay(Intersection& itsc, Ray& ray, float& pdf_A, float& pdf_D) const;
 
-  inline float getItscPdf(const Intersection& itsc, const Ray& rayToLight) const{
+  inline float getItscPdf(const ShadingPoint& itsc, const Ray& rayToLight) const{
     return 1.0f;
   }
 
-  float getRayPdf(const Intersection& itsc, glm::vec3 dir) const {
+  float getRayPdf(const ShadingPoint& itsc, glm::vec3 dir) const {
     return 1.0f/PI4;
   }
 
@@ -109,13 +127,13 @@ private:
 
 public:
   DirectionalLight(glm::vec3 le, glm::vec3 dir): 
-    le(le), direction(glm::normalize(dir)){}
+    Light(LightType::Directional), le(le), direction(glm::normalize(dir)){}
 
   void addToScene(Scene& scene) {}
 
   float selectProbality(const Scene& scene);
 
-  inline glm::vec3 evaluate(const Intersection& itsc, glm::vec3 dir) const {
+  inline glm::vec3 evaluate(const ShadingPoint& itsc, glm::vec3 dir) const {
     return le;
   }
 
@@ -133,11 +151,11 @@ public:
     ray.d = direction;
   }
 
-  inline float getItscPdf(const Intersection& itsc, const Ray& rayToLight) const{
+  inline float getItscPdf(const ShadingPoint& itsc, const Ray& rayToLight) const{
     return 4.0f/(PI*sceneDiameter*sceneDiameter);
   }
 
-  float getRayPdf(const Intersection& itsc, glm::vec3 dir) const {
+  float getRayPdf(const ShadingPoint& itsc, glm::vec3 dir) const {
     return 0.0f;
   }
 
@@ -160,11 +178,11 @@ public:
 
   float selectProbality(const Scene& scene);
 
-  glm::vec3 evaluate(const Intersection& itsc, glm::vec3 dir) const;
+  glm::vec3 evaluate(const ShadingPoint& itsc, glm::vec3 dir) const;
 
   float getItscOnLight(Intersection& itsc, glm::vec3 evaP) const;
 
-  float getItscPdf(const Intersection& itsc, const Ray& rayToLight) const;
+  float getItscPdf(const ShadingPoint& itsc, const Ray& rayToLight) const;
 
   void genRay(Intersection& itsc, Ray& ray, float& pdf_A, float& pdf_D) const {
     pdf_D = 1.0f;
@@ -178,7 +196,7 @@ public:
   // used for BXDF sample
   void genRayItsc(Intersection& itsc, const Ray& rayToLight, glm::vec3 evaP) const;
 
-  float getRayPdf(const Intersection& itsc, glm::vec3 dir) const {
+  float getRayPdf(const ShadingPoint& itsc, glm::vec3 dir) const {
     return 0.0f;
   }
 
@@ -5,13 +5,29 @@
 
 #include <vector>
 
-// Tree recursion with inheritance and polymorphism
+class BXDF;
+
+// Tree recursion with inheritance, the node types are closed and
+// getBXDF switches on them. the leaves are BXDF
 class BXDFNode {
 public:
+  enum NodeType {
+    Leaf,
+    Weighted,
+    Mixed,
+    Add
+  };
+
+protected:
+  NodeType nodeType;
+
+public:
+  BXDFNode(NodeType nodeType): nodeType(nodeType) {}
   virtual ~BXDFNode() {}
-  // return weight, and also return the node
-  virtual float getBXDF(
-    const Intersection& itsc, const Ray& ray_o, const BXDFNode*& bxdfNode) const = 0;
+  // return weight, and also return the leaf
+  float getBXDF(
+    const ShadingPoint& itsc, const Ray& ray_o, const BXDF*& bxdf) const;
+  inline NodeType getNodeType() const {return nodeType;}
 };
 
 class WeightedBXDF: public BXDFNode {
@@ -22,12 +38,15 @@ private:
 public:
   virtual ~WeightedBXDF() {delete blender;}
   WeightedBXDF(const BXDFNode* bxdfNode, const Blender* blender):
-    bxdfNode(bxdfNode), blender(blender) {}
+    BXDFNode(NodeType::Weighted), bxdfNode(bxdfNode), blender(blender) {}
+
+  inline const BXDFNode* getChild() const {return bxdfNode;}
+  inline const Blender* getBlender() const {return blender;}
   
   inline float getBXDF(
-    const Intersection& itsc, const Ray& ray_o, const BXDFNode*& bxdfNode) const override {
+    const ShadingPoint& itsc, const Ray& ray_o, const BXDF*& bxdf) const {
     return blender->getBlendVal(itsc, ray_o) *
-      this->bxdfNode->getBXDF(itsc, ray_o, bxdfNode);
+      bxdfNode->getBXDF(itsc, ray_o, bxdf);
   }
 };
 
@@ -40,14 +59,21 @@ private:
 public:
   virtual ~MixedBXDF() {delete blender;}
   MixedBXDF(const BXDFNode* bxdfNode1, const BXDFNode* bxdfNode2, const Blender* blender):
+    BXDFNode(NodeType::Mixed), 
     bxdfNode1(bxdfNode1), bxdfNode2(bxdfNode2), blender(blender) {}
 
+  // child 0 is picked with probability of the blend value
+  inline const BXDFNode* getChild(int i) const {
+    return i == 0 ? bxdfNode1 : bxdfNode2;
+  }
+  inline const Blender* getBlender() const {return blender;}
+
   inline float getBXDF(
-    const Intersection& itsc, const Ray& ray_o, const BXDFNode*& bxdfNode) const override {
+    const ShadingPoint& itsc, const Ray& ray_o, const BXDF*& bxdf) const {
     float blend = blender->getBlendVal(itsc, ray_o);
     return _ThreadSampler.get1() < blend ?
-      bxdfNode1->getBXDF(itsc, ray_o, bxdfNode):
-      bxdfNode2->getBXDF(itsc, ray_o, bxdfNode);
+      bxdfNode1->getBXDF(itsc, ray_o, bxdf):
+      bxdfNode2->getBXDF(itsc, ray_o, bxdf);
   }
 };
 
@@ -59,20 +85,23 @@ private:
 public:
   virtual ~AddBXDF() {}
   AddBXDF(const BXDFNode* bxdfNode1, const BXDFNode* bxdfNode2):
-    bxdfNode1(bxdfNode1), bxdfNode2(bxdfNode2) {}
+    BXDFNode(NodeType::Add), bxdfNode1(bxdfNode1), bxdfNode2(bxdfNode2) {}
+
+  inline const BXDFNode* getChild(int i) const {
+    return i == 0 ? bxdfNode1 : bxdfNode2;
+  }
 
   inline float getBXDF(
-    const Intersection& itsc, const Ray& ray_o, const BXDFNode*& bxdfNode) const override {
+    const ShadingPoint& itsc, const Ray& ray_o, const BXDF*& bxdf) const {
     return _ThreadSampler.get1() < 0.5f ?
-      2.0f*bxdfNode1->getBXDF(itsc, ray_o, bxdfNode):
-      2.0f*bxdfNode2->getBXDF(itsc, ray_o, bxdfNode);
+      2.0f*bxdfNode1->getBXDF(itsc, ray_o, bxdf):
+      2.0f*bxdfNode2->getBXDF(itsc, ray_o, bxdf);
   }
 };
 
 class Medium;
 class Light;
 class Texture;
-class BXDF;
 
 struct MaterialInfo {
   float IOR = 1.0f;
@@ -97,8 +126,9 @@ public:
   const Texture* normalMap = nullptr;
 
 public:
+  // walks bxdfNode, Scene::getBXDF uses the compiled program instead
   float getBXDF(
-    const Intersection& itsc, const Ray& ray_o, const BXDF*& bxdfNode) const;
+    const ShadingPoint& itsc, const Ray& ray_o, const BXDF*& bxdf) const;
 
   void bumpMapping(Intersection& itsc) const;
 
@@ -27,7 +27,7 @@ public:
 
   void addToScene(Scene& scene, bool noBXDF = true);
 
-  glm::vec3 sampleNextItsc(const Ray& ray, Intersection& itsc) const;
+  glm::vec3 sampleNextItsc(const Ray& ray, HitRecord& hit) const;
 
   glm::vec3 tr(float t) const {
     return glm::vec3(glm::exp(-sigmaT*t));
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "material.hpp"
+#include "primitive.hpp"
 #include <glm/glm.hpp>
 
 class Mesh {
@@ -30,22 +31,36 @@ public:
   virtual void translate(glm::vec3) = 0;
   virtual void scale(glm::vec3) = 0;
   virtual void rotate(glm::vec3, float) = 0;
+  // the prims are owned by the mesh, keep it alive while they are used
   virtual void toPrimitives(std::vector<const Primitive*>& vp) = 0;
 };
 
+// counts of VertexMesh::optimize
+struct MeshOptimizeStats {
+  int verticesBefore = 0, verticesAfter = 0;
+  int facesBefore = 0, facesAfter = 0;
+  int degenerateFaces = 0, duplicateFaces = 0;
+
+  void add(const MeshOptimizeStats& other);
+  void print(const char* title) const;
+};
+
 class VertexMesh: public Mesh {
 private:
   bool needInitVertex = false;
 
 public:
-  std::vector<Vertex*> vertices;
+  VertexStreams vertices;
   std::vector<uint32_t> indices;
+  // one block for all the faces, created by the first toPrimitives
+  std::vector<Triangle> triangles;
 
-  ~VertexMesh();
   VertexMesh(): Mesh(Mesh::MeshType::VertexMesh){}
   Mesh* copy() const override; // copy Vertex
 
   void transform(glm::mat4x4 trans);
+  // see VertexStreams::setHalfUV
+  inline void setHalfUV(bool half) {vertices.setHalfUV(half);}
 
   void translate(glm::vec3) override;
   void scale(glm::vec3) override;
@@ -54,6 +69,11 @@ public:
   // vp: all prims, vl: light(emission) prims
   void toPrimitives(std::vector<const Primitive*>& vp) override;
 
+  // weld identical vertices, drop degenerate and duplicate faces, then
+  // reorder the faces along a morton curve and the vertices by first 
+  // use. must be called before toPrimitives
+  MeshOptimizeStats optimize();
+
   static VertexMesh* CreateTriangle(glm::vec3 pos[3]);
   static VertexMesh* CreateRectangle(glm::vec3 pos[4]);
 };
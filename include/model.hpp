@@ -20,7 +20,8 @@ private:
 public:
   ~Model();
   Model() {}
-  Model(const char* filename);
+  // optimizeMeshes: weld and clean the meshes, see VertexMesh::optimize
+  Model(const char* filename, bool optimizeMeshes = false);
   Model(Mesh* mesh);
   Model(const Model& model);
   Model(Model && model) = delete;
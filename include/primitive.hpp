@@ -25,12 +25,25 @@ public:
 
   virtual BB3 getBB3() const = 0;
 
+  // bound of the part in the slab lo<=p[axis]<=hi, used by SBVH build.
+  // by default just the bound cut by the slab, not tight
+  virtual BB3 getClippedBB3(int axis, float lo, float hi) const {
+    glm::vec3 slabMin(FLOAT_MIN), slabMax(FLOAT_MAX);
+    slabMin[axis] = lo;
+    slabMax[axis] = hi;
+    return getBB3().Intersect(BB3(slabMin, slabMax));
+  }
+
   virtual void translate(glm::vec3) = 0;
   virtual void scale(glm::vec3) = 0;
   virtual void rotate(glm::vec3, float) = 0;
 
   virtual bool hasSurface() const {return true;}
 
+  // triangles give their positions so that the BVH can keep a copy in
+  // leaf order, the other prims are intersected through the virtuals
+  virtual bool getTriangle(glm::vec3 (&pos)[3]) const {return false;}
+
   virtual inline const Mesh* getMesh() const {return mesh;}
 
   virtual inline glm::vec3 getCenter() const = 0;
@@ -42,41 +55,79 @@ public:
   // return pdf
   virtual float getAPointOnSurface(Intersection& itsc) const = 0;
 
-  // notice: itsc as in-out variable
-  virtual void intersect(const Ray& ray, Intersection& itsc) const = 0;
+  // notice: hit as in-out variable, the hit is searched in [tMin, hit.t)
+  virtual void intersect(const Ray& ray, HitRecord& hit, 
+    float tMin = 0.0f) const = 0;
 
-  // just return whether intersect or not
-  virtual bool intersectTest(const Ray& ray) const = 0;
+  // just return whether intersect in [tMin, tMax) or not, 
+  // no itsc info is calculated
+  virtual bool intersectTest(const Ray& ray, 
+    float tMin = 0.0f, float tMax = FLOAT_MAX) const = 0;
 
-  //set normal, uv, and other for itsc
+  //set normal, uv, and other for itsc, from the hit record and the
+  // position on the ray set by Intersection::setHit
   virtual void handleItscResult(Intersection& itsc) const = 0;
+  // only position, geoNormal and itscError, enough to offset a ray 
+  // through the itsc (e.g. medium bounds), no shading frame or uv
+  virtual void handleItscGeometry(Intersection& itsc) const {
+    handleItscResult(itsc);
+  }
 
   virtual void genPrimPointCloud(PCShower& pc, glm::vec3 col) const = 0;
 };
 
 class Triangle: public Primitive { //Triangle
 private:
-  Vertex* verts[3];
-  // geoNormal is the real normal for the triangle surface
-  // itsc.normal is always the interpolated normal or even
-  // bump mapping normal
-  glm::vec3 geoNormal;
+  // the vertices are vi[] of the streams of the mesh
+  VertexStreams* vtxs;
+  uint32_t vi[3];
 
 public:
   Triangle() {}
-  Triangle(Vertex* v1, Vertex* v2, Vertex* v3, const Mesh* mesh);
+  Triangle(VertexStreams* vtxs, 
+    uint32_t i1, uint32_t i2, uint32_t i3, const Mesh* mesh);
+
+  inline const glm::vec3& getPosition(int k) const {
+    return vtxs->getPosition(vi[k]);
+  }
 
   BB3 getBB3() const;
+  // clip the triangle by the slab
+  BB3 getClippedBB3(int axis, float lo, float hi) const;
 
   Primitive* copy(const Mesh* mesh) const;
 
+  bool getTriangle(glm::vec3 (&pos)[3]) const;
+
+  // Moller test with edges e1 = v1-v0, e2 = v2-v0, 
+  // return false if no itsc with t >= CUSTOM_EPSILON
+  static inline bool intersectEdges(const Ray& ray, const glm::vec3& v0, 
+    const glm::vec3& e1, const glm::vec3& e2, float& t, glm::vec2& uv) {
+    glm::vec3 pvec = glm::cross(ray.d, e2);
+    float det = glm::dot(e1, pvec);
+    if(std::abs(det)<CUSTOM_EPSILON) return false; //parallel
+
+    float invDet = 1.0f/det;
+    glm::vec3 tvec = ray.o - v0;
+    float u = glm::dot(tvec, pvec)*invDet;
+    if(u<0 || u>1) return false;
+
+    glm::vec3 qvec = glm::cross(tvec, e1);
+    float v = glm::dot(ray.d, qvec)*invDet;
+    if(v<0 || u+v>1) return false;
+
+    t = glm::dot(e2, qvec)*invDet;
+    uv = {u, v};
+    return t >= CUSTOM_EPSILON;
+  }
+
   inline glm::vec3 getCenter() const {
-    return (verts[0]->position+verts[1]->position+verts[2]->position)/3.0f;
+    return (getPosition(0)+getPosition(1)+getPosition(2))/3.0f;
   }
 
   inline float getArea() const {
-    glm::vec3 v01 = verts[1]->position - verts[0]->position;
-    glm::vec3 v02 = verts[2]->position - verts[0]->position;
+    glm::vec3 v01 = getPosition(1) - getPosition(0);
+    glm::vec3 v02 = getPosition(2) - getPosition(0);
     return 0.5f*glm::length(glm::cross(v01, v02));
   }
 
@@ -87,14 +138,16 @@ public:
   // return pdf
   float getAPointOnSurface(Intersection& itsc) const;
 
-  // notice: itsc as in-able
-  void intersect(const Ray& ray, Intersection& itsc) const;
+  // notice: hit as in-able
+  void intersect(const Ray& ray, HitRecord& hit, float tMin = 0.0f) const;
 
-  // just return whether intersect or not
-  bool intersectTest(const Ray& ray) const;
+  // just return whether intersect in [tMin, tMax) or not
+  bool intersectTest(const Ray& ray, 
+    float tMin = 0.0f, float tMax = FLOAT_MAX) const;
 
   //set normal, uv, and other for itsc
   void handleItscResult(Intersection& itsc) const;
+  void handleItscGeometry(Intersection& itsc) const;
   
   // calc normal, tangent and others by position
   // normal point to right-hand 012
@@ -140,14 +193,16 @@ public:
   // return pdf
   float getAPointOnSurface(Intersection& itsc) const;
 
-  // notice: itsc as in-out variable
-  void intersect(const Ray& ray, Intersection& itsc) const;
+  // notice: hit as in-out variable
+  void intersect(const Ray& ray, HitRecord& hit, float tMin = 0.0f) const;
 
-  // just return whether intersect or not
-  bool intersectTest(const Ray& ray) const;
+  // just return whether intersect in [tMin, tMax) or not
+  bool intersectTest(const Ray& ray, 
+    float tMin = 0.0f, float tMax = FLOAT_MAX) const;
 
   //set normal, uv, and other for itsc
   void handleItscResult(Intersection& itsc) const;
+  void handleItscGeometry(Intersection& itsc) const;
 
   glm::vec3 uniSampleSphereDir() const;
 
@@ -194,13 +249,15 @@ public:
     return 1.0f;
   }
 
-  // notice: itsc as in-out variable
-  void intersect(const Ray& ray, Intersection& itsc) const{
+  // notice: hit as in-out variable
+  void intersect(const Ray& ray, HitRecord& hit, 
+    float tMin = 0.0f) const{
     std::cout<<"PointPrim::intersect is undefined"<<std::endl;
   }
 
   // just return whether intersect or not
-  bool intersectTest(const Ray& ray) const {
+  bool intersectTest(const Ray& ray, 
+    float tMin = 0.0f, float tMax = FLOAT_MAX) const {
     std::cout<<"PointPrim::intersectTest is undefined"<<std::endl;
     return false;
   }
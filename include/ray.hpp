@@ -59,4 +59,12 @@ public:
       pc.addItem(pass(t*i/pNum), col);
     }
   }
-};
\ No newline at end of file
+};
+// coherent rays traced together, the camera rays of a pixel tile
+struct RayPacket {
+  static constexpr int MaxSize = 64; // 8x8 pixels
+  Ray rays[MaxSize];
+  glm::vec2 rasterPos[MaxSize];
+  int sampleIndex[MaxSize]; // see RayGenerator::getSampleIndex
+  int size = 0;
+};
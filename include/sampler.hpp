@@ -1,65 +1,75 @@
 #pragma once
 
-#include <random>
+#include <cstdint>
+#include <cmath>
 #include <glm/glm.hpp>
 
 #include "const.hpp"
 
 #define _ThreadSampler GeneralSampler::getThreadSampler()
 
-class StratifiedSampler2D { // Stractify Sampler
+// pcg4d of Jarzynski and Olano 2020, "Hash Functions for GPU Rendering",
+// 4 random words of 4 words of key
+inline void Pcg4d(
+  uint32_t x, uint32_t y, uint32_t z, uint32_t w, uint32_t* res) {
+  x = x*1664525u+1013904223u; y = y*1664525u+1013904223u;
+  z = z*1664525u+1013904223u; w = w*1664525u+1013904223u;
+  x += y*w; y += z*x; z += x*y; w += y*z;
+  x ^= x>>16; y ^= y>>16; z ^= z>>16; w ^= w>>16;
+  x += y*w; y += z*x; z += x*y; w += y*z;
+  res[0] = x; res[1] = y; res[2] = z; res[3] = w;
+}
+
+// [0, 1) from the high 24 bits
+inline float ToUnitFloat(uint32_t u) {
+  return (u>>8)*(1.0f/(1u<<24));
+}
+
+// counter-based random numbers: the n-th number of a pixel sample is a
+// hash of (pixel, sample index, n), so a pixel sample draws the same
+// numbers whatever thread renders it and whatever is rendered before.
+// the integrators call startSample at the start of a camera path
+class GeneralSampler {
 private:
-  int stract_w;
-  float inv_w;
-  int sample_cnt = 0;
-  std::default_random_engine eng;
-  std::uniform_real_distribution<float> urd;
-  
-public:
-  StratifiedSampler2D(int w, int seed = 0): 
-    stract_w(w), inv_w(1.0f/w),
-    eng(seed), urd(0.0f, 1.0f){}
-
-  glm::vec2 get2() {
-    sample_cnt %= (stract_w*stract_w);
-    int row = sample_cnt/stract_w;
-    int col = sample_cnt%stract_w;
-    sample_cnt++;
-    return inv_w*glm::vec2(row+urd(eng), col+urd(eng));
-  }
+  uint32_t px = 0, py = 0, index = 0, dim = 0;
+  uint32_t block[4]; // the dimensions [dim&~3, dim|3]
 
-  void clear() {
-    sample_cnt = 0;
-  }
+  inline void hashBlock() {Pcg4d(px, py, index, dim>>2, block);}
 
-};
+  inline float next() {
+    if((dim&3) == 0) hashBlock();
+    return ToUnitFloat(block[(dim++)&3]);
+  }
 
-class HaltonSampler2D {
 public:
-  glm::vec2 get2(int sp_index);
-};
+  // the dimensions before are the jitter of the camera ray
+  static constexpr uint32_t CameraDims = 2;
 
-class GeneralSampler {
-private:
-  std::default_random_engine eng;
-  std::uniform_real_distribution<float> urd;
-
-
-public:
-  GeneralSampler(): eng(0), urd(0.0f, 1.0f){}
+  GeneralSampler() {hashBlock();}
 
   static GeneralSampler& getThreadSampler();
 
-  inline void resetSeed(int seed) {eng.seed(seed);}
+  inline void startSample(glm::ivec2 pixel, int sampleIndex) {
+    px = pixel.x; py = pixel.y; index = sampleIndex;
+    dim = CameraDims;
+    hashBlock();
+  }
+
+  // the first CameraDims numbers of a pixel sample
+  static inline glm::vec2 getCameraJitter(glm::ivec2 pixel, int sampleIndex) {
+    uint32_t res[4];
+    Pcg4d(pixel.x, pixel.y, sampleIndex, 0, res);
+    return {ToUnitFloat(res[0]), ToUnitFloat(res[1])};
+  }
 
-  inline glm::vec3 get3() {return {urd(eng), urd(eng), urd(eng)};}
+  inline glm::vec3 get3() {return {next(), next(), next()};}
 
-  inline glm::vec2 get2() {return {urd(eng), urd(eng)};}
+  inline glm::vec2 get2() {return {next(), next()};}
 
-  inline float get1() {return urd(eng);}
+  inline float get1() {return next();}
 
   // return r, theta, all can be treated as sinTheta, phi
-  inline glm::vec2 uniSampleDisk() {return {glm::sqrt(urd(eng)), PI2*urd(eng)};}
+  inline glm::vec2 uniSampleDisk() {return {glm::sqrt(next()), PI2*next()};}
 
   // return theta, phi
   inline glm::vec2 cosWeightHemi() {
@@ -69,20 +79,45 @@ public:
 
   // return cosTheta, phi
   inline glm::vec2 uniSampleSphere() {
-    return {1.0f - 2.0f*urd(eng), PI2*urd(eng)};
+    return {1.0f - 2.0f*next(), PI2*next()};
   }
   // return cosTheta, phi
   inline glm::vec2 uniSampleHemiSphere() {
-    return {1.0f - urd(eng), PI2*urd(eng)};
+    return {1.0f - next(), PI2*next()};
   }
 
   // return uv
   inline glm::vec2 uniSampleTriangle() {
-    float zeta1 = glm::sqrt(urd(eng));
-    return {1-zeta1, urd(eng)*zeta1};
+    float zeta1 = glm::sqrt(next());
+    return {1-zeta1, next()*zeta1};
   }
 
   inline float expSampleMedium(float sigmaT) {
-    return -std::log(urd(eng)) / sigmaT;
+    // 1-u is in (0, 1]
+    return -std::log(1.0f-next()) / sigmaT;
+  }
+};
+
+class StratifiedSampler2D { // Stractify Sampler
+private:
+  int stract_w;
+  float inv_w;
+  
+public:
+  StratifiedSampler2D(int w): stract_w(w), inv_w(1.0f/w) {}
+
+  // a jittered sample in the stratum of the sample index, the jitter is
+  // the camera dimensions of the pixel sample
+  glm::vec2 get2(int sampleIndex, glm::ivec2 pixel) const {
+    int index = sampleIndex % (stract_w*stract_w);
+    int row = index/stract_w;
+    int col = index%stract_w;
+    return inv_w*(glm::vec2(row, col) + 
+      GeneralSampler::getCameraJitter(pixel, sampleIndex));
   }
-};
\ No newline at end of file
+};
+
+class HaltonSampler2D {
+public:
+  glm::vec2 get2(int sp_index);
+};
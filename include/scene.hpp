@@ -2,34 +2,88 @@
 
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "primitive.hpp"
 #include "medium.hpp"
 #include "model.hpp"
 #include "bb3.hpp"
 #include "bvh.hpp"
+#include "wbvh.hpp"
+#include "instance.hpp"
 #include "camera.hpp"
 #include "distribution.hpp"
+#include "shadingProgram.hpp"
 
 #include "debug/pcshow.hpp"
 
+// ray of the batch queries, the hits are searched in [tMin, tMax)
+struct RayQuery {
+  Ray ray;
+  float tMin = 0.0f, tMax = FLOAT_MAX;
+};
+
+// compact hit record of the batch queries, no vertex attributes
+struct RayHit {
+  float t = FLOAT_MAX;
+  // index in Scene::getPrimitives(), -1 if no hit. when the hit is in an
+  // instance, primID is the instance and instPrimID is the prim in 
+  // InstanceGeometry::getPrims(), otherwise instPrimID is -1
+  int primID = -1, instPrimID = -1;
+  glm::vec2 uv = glm::vec2(0.0f); // barycentrics of triangles, localUV
+};
+
 class Scene {
 public:
+  enum AccelMode {
+    BinaryBVH,
+    WideBVH4, // SSE box test
+    WideBVH8 // AVX2 box test, fall back to BVH4 if not supported
+  };
+
   const EnvironmentLight* envLight = nullptr;
 private:
   std::vector<const Primitive*> primitives;
+  std::unordered_map<const Primitive*, int> primIDs; // see updatePrimIDs
+  std::vector<InstanceGeometry*> instanceGeometries;
+  std::vector<Instance*> instances;
+  // meshes of the instance geometries, they can not be lights
+  std::unordered_set<const Mesh*> instancedMeshes;
   std::vector<Light*> lights;
   std::map<const Light*, int> ltIdx;
   DiscreteDistribution1D ldistribution; // light distribution
+  MaterialCompiler materialCompiler;
   
   const Medium* globalMedium = nullptr;
   bool hasMedium = false;
 
   BB3 sceneBB3;
   BVH bvh;
+  BVH4 bvh4;
+  BVH8 bvh8;
+  AccelMode accelMode = AccelMode::BinaryBVH;
+  bool quantizedNodes = false; // wide BVH only
 
   void buildBVH();
+  void updatePrimIDs();
+  // index in primitives, -1 if not found
+  int getPrimID(const Primitive* prim) const;
+  // collapse the binary BVH if accelMode needs
+  void buildWideBVH();
+  // all the queries go through these two according to accelMode
+  void closestHit(const Ray& ray, HitRecord& hit, const Primitive* prim, 
+    float tMin = 0.0f) const;
+  bool anyHit(const Ray& ray, const Primitive* prim, 
+    float tMin = 0.0f, float tMax = FLOAT_MAX) const;
+  // see BVHParams::streamMinNodes
+  bool useStreamTraversal() const;
+  // the indices of queries[start, end) by direction octant and origin
+  void sortQueries(const RayQuery* queries, int start, int end, 
+    std::vector<std::pair<unsigned int, int>>& order) const;
   void calcLightDistribution();
+  // flatten the bxdf trees of the materials of all prims
+  void compileMaterials();
 
 public:
   Scene(): bvh(primitives) {}
@@ -42,24 +96,86 @@ public:
   void addPrimitive(const Primitive* prim);
   void addPrimitives(std::vector<const Primitive*> prims);
 
+  // instancing: the model geometry is built once and shared by all its 
+  // instances, the scene BVH becomes the top level over the instances.
+  // instances have no area to sample, so emissive models are rejected
+  // (nullptr), as are shape lights on models already instanced
+  InstanceGeometry* addInstanceGeometry(Model& model);
+  Instance* addInstance(const InstanceGeometry* geometry, 
+    const glm::mat4x4& toWorld = glm::mat4x4(1.0f));
+  // after models or instances moved: refit the BVH, and rebuild it 
+  // when the SAH cost grows more than BVHParams::maxRefitSAHGrowth.
+  // models or instances added after init are traced after a rebuild
+  void update();
+
+  // must set before init
+  inline void setBVHParams(const BVHParams& params) {bvh.setParams(params);}
+  inline void setAccelMode(AccelMode mode) {accelMode = mode;}
+  inline AccelMode getAccelMode() const {return accelMode;}
+  // 8 bits child bounds for the wide BVHs, about half of the node memory
+  inline void setQuantizedNodes(bool q) {quantizedNodes = q;}
+
   void init();
 
+  // the hit queries return only the hit record: t, localUV, prim and 
+  // instance. handleItscResult builds the itsc to shade from it with the
+  // ray, handleItscGeometry only what is needed to pass through it.
   // prim used to avoid intersect self when the scene do not have curve surface
-  Intersection intersect(const Ray& ray,
+  HitRecord intersect(const Ray& ray,
     const Primitive* prim = nullptr, float t_limit = FLOAT_MAX) const;
-  Intersection intersectDirectly(
-    const Ray& ray, const Medium* medium, glm::vec3& tr) const ;
+  // the packet rays share the BVH traversal, hits[i] is the same as
+  // intersect(packet.rays[i])
+  void intersect(const RayPacket& packet, HitRecord* hits) const;
+  // batch of incoherent rays such as the bounce rays of many paths, 
+  // they are traced interleaved to hide the memory latency.
+  // prims[i] is avoided by rays[i], prims may be nullptr
+  void intersect(const Ray* rays, int n, HitRecord* hits, 
+    const Primitive* const* prims = nullptr) const;
+  // the first hit which is not a medium bound, hitRay is the ray of the
+  // hit, it starts at the last medium bound passed
+  HitRecord intersectDirectly(const Ray& ray, const Medium* medium, 
+    glm::vec3& tr, Ray& hitRay) const;
+  // interpolate the vertex attributes of a hit of ray and bump mapping
+  void handleItscResult(const Ray& ray, const HitRecord& hit, 
+    Intersection& itsc) const;
+  // position, geoNormal and itscError of a hit of ray
+  void handleItscGeometry(const Ray& ray, const HitRecord& hit, 
+    Intersection& itsc) const;
 
   bool intersectTest(const Ray& ray, const Primitive* prim = nullptr) const;
 
+  // the bxdf of mat at the hit by the program compiled in init, or by 
+  // the tree walk of Material::getBXDF
+  float getBXDF(const Material& mat, const ShadingPoint& itsc, 
+    const Ray& ray_o, const BXDF*& bxdf) const;
+
   bool occlude(const Ray& ray, float t_limit, glm::vec3& tr,
     const Medium* medium = nullptr, const Primitive* prim_avd = nullptr) const;
+  // shadow ray, any blocker in [0, t_limit), no itsc info is calculated
   bool occlude(const Ray& ray, float t_limit, 
     const Primitive* prim_avd = nullptr) const;
   bool occlude(const Intersection& it1, const Intersection& it2, 
     Ray& testRay, float& rayLen) const;
+  // batch of shadow rays, occluded[i]: any blocker in [0, t_limits[i]).
+  // media are ignored as in occlude(ray, t_limit, prim_avd)
+  void occlude(const Ray* rays, const float* t_limits, int n, 
+    bool* occluded, const Primitive* const* prims_avd = nullptr) const;
+
+  // batch queries for tools such as baking and visibility analysis.
+  // the batch is split over threadNum threads (0: all cores), the rays
+  // of a thread are sorted so that close and parallel rays go together.
+  // no Intersection is calculated, hits[i] is the closest hit of queries[i]
+  void intersect(const RayQuery* queries, int n, RayHit* hits, 
+    int threadNum = 0) const;
+  // bit i%32 of occluded[i/32]: queries[i] has any hit, 
+  // the (n+31)/32 words are overwritten
+  void occlude(const RayQuery* queries, int n, unsigned int* occluded, 
+    int threadNum = 0) const;
 
   BB3 getWholeBound() const;
+  inline const std::vector<const Primitive*>& getPrimitives() const {
+    return primitives;
+  }
   inline const BVH& getBVH() const {return bvh;}
   inline const Medium* getGlobalMedium() const {return globalMedium;}
   inline bool hasMediumInScene() const {return hasMedium;}
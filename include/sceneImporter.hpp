@@ -11,18 +11,24 @@
 
 class Mesh;
 class Texture;
+struct MeshOptimizeStats;
 
 class SceneImporter {
 private:
   static std::string curDirectory;
-  static void processNode(const aiScene *scene, aiNode *node, std::vector<Mesh*>& meshes);
+  // stats is nullptr when the meshes are not optimized
+  static void processNode(const aiScene *scene, aiNode *node, 
+    std::vector<Mesh*>& meshes, MeshOptimizeStats* stats);
 
-  static Mesh* processMesh(const aiScene *scene, aiMesh *mesh);
+  static Mesh* processMesh(
+    const aiScene *scene, aiMesh *mesh, MeshOptimizeStats* stats);
 
   static void loadMaterialTextures(
     aiMaterial *mat, aiTextureType type, std::vector<const Texture*>& texs);
 
 public:
 
-  static bool loadSceneFromFile(const char* path, std::vector<Mesh*>& meshes);
+  // optimize: VertexMesh::optimize every mesh
+  static bool loadSceneFromFile(const char* path, std::vector<Mesh*>& meshes,
+    bool optimize = false);
 };
\ No newline at end of file
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <unordered_map>
+
+#include "bxdf.hpp"
+
+class Material;
+class ShadingProgram;
+
+// a leaf of a material tree with the nodes on its path folded in.
+// its coefficient at a hit is prob*weight times the terms, the sum of
+// coefficient*bxdf over the lobes is the bxdf of the material
+struct ShadingLobe {
+  const BXDF* bxdf;
+  float prob, weight; // constant parts: Add, FixBlender
+  int selStart, selEnd; // ShadingProgram::selTerms
+  int wStart, wEnd; // ShadingProgram::weightTerms
+  bool grouped; // in the LobeGroup of the program
+};
+
+// blend value (or 1-blend) of a Mixed node above the lobe
+struct SelectTerm {
+  int blender; // in ShadingProgram::selBlenders
+  bool complement;
+};
+
+// the non-delta lobes of a program as one bxdf: evaluate and sample_pdf
+// sum over all the lobes, sample_ev picks a lobe in proportion to its
+// coefficient times albedo and returns the sum of bxdf over the sum of
+// pdf (one-sample MIS of the lobes)
+class LobeGroup: public BXDF {
+private:
+  const ShadingProgram* program;
+
+  // the selection probabilities of the lobes, return false if all 0
+  bool getLobeProbs(
+    const ShadingPoint& itsc, const Ray& ray_o, float* coe, float* prob) const;
+
+public:
+  LobeGroup(const ShadingProgram* program, int type):
+    BXDF(BXDFClass::Group, type), program(program) {}
+
+  glm::vec3 evaluate(
+    const ShadingPoint& itsc, const Ray& ray_o, const Ray& ray_i) const;
+  glm::vec3 sample_ev(
+    const ShadingPoint& itsc, const Ray& ray_o, Ray& ray_i) const;
+  float sample_pdf(
+    const ShadingPoint& itsc, const Ray& ray_i, const Ray& ray_o) const;
+  bool needMIS(const ShadingPoint& itsc) const;
+  glm::vec3 getAlbedo(const ShadingPoint& itsc, const Ray& ray_o) const;
+};
+
+// a material tree flattened by MaterialCompiler. getBXDF picks one of
+// the delta lobes or the LobeGroup with one random number, in
+// proportion to coefficient times albedo, and returns
+// coefficient/probability (1/probability for the group)
+class ShadingProgram {
+public:
+  // more lobes or selection blenders are left to the tree walk
+  static constexpr int MaxLobes = 16;
+  static constexpr int MaxSelBlenders = 8;
+
+  const ShadingLobe* lobes;
+  int lobeNum;
+  const SelectTerm* selTerms;
+  const Blender* const* weightTerms;
+  // the blenders of the Mixed nodes, each is evaluated once per hit
+  const Blender* const* selBlenders;
+  int selBlenderNum;
+  const LobeGroup* group; // nullptr if less than 2 non-delta lobes
+  int unitNum; // the delta lobes, and the group as one
+
+  // coe[i]: coefficient of lobes[i] at the hit
+  void getCoefficients(
+    const ShadingPoint& itsc, const Ray& ray_o, float* coe) const;
+
+  float getBXDF(
+    const ShadingPoint& itsc, const Ray& ray_o, const BXDF*& bxdf) const;
+};
+
+// compiles the bxdf trees of the materials in Scene::init, the lobes of
+// all programs are in contiguous arrays. the materials with the same
+// root node share one program
+class MaterialCompiler {
+private:
+  std::vector<ShadingLobe> lobes;
+  std::vector<SelectTerm> selTerms;
+  std::vector<const Blender*> weightTerms;
+  std::vector<const Blender*> selBlenders;
+  // lobes, selBlenders offsets, fixed up to pointers at the end
+  struct Range {int lobeStart, lobeEnd, blenderStart, blenderEnd;};
+  std::vector<Range> ranges;
+  std::vector<ShadingProgram> programs;
+  std::vector<LobeGroup*> groups;
+  std::map<const BXDFNode*, int> programIDs;
+  std::unordered_map<const Material*, const ShadingProgram*> materialPrograms;
+
+  // the nodes above the current one while walking down the tree
+  struct PathTerms {
+    float prob = 1.0f, weight = 1.0f;
+    std::vector<SelectTerm> selTerms;
+    std::vector<const Blender*> weightTerms;
+  };
+  void compileNode(const BXDFNode* node, const PathTerms& path,
+    int blenderStart);
+  int compileTree(const BXDFNode* root);
+
+public:
+  MaterialCompiler() {}
+  MaterialCompiler(const MaterialCompiler&) = delete;
+  const MaterialCompiler& operator=(const MaterialCompiler&) = delete;
+  ~MaterialCompiler() {clear();}
+
+  // the materials are only keys, the compiler does not write them
+  void compile(const std::vector<const Material*>& materials);
+  void clear();
+  // nullptr for the materials not compiled and the trees over the 
+  // limits of ShadingProgram
+  inline const ShadingProgram* getProgram(const Material* material) const {
+    auto it = materialPrograms.find(material);
+    return it == materialPrograms.end() ? nullptr : it->second;
+  }
+
+  inline int getProgramNum() const {return programs.size();}
+  inline int getLobeNum() const {return lobes.size();}
+};
@@ -7,6 +7,8 @@
 #include "distribution.hpp"
 #include "utility.hpp"
 
+// the set of textures is closed, tex2D switches on the type instead
+// of a virtual call, see the end of this file
 class Texture {
 public:
   enum TexType {
@@ -20,8 +22,8 @@ protected:
 public:
   Texture(TexType type): type(type) {}
   virtual ~Texture() {}
-  virtual glm::vec3 tex2D(glm::vec2) const = 0;
-  virtual float getAverageLuminance() const = 0;
+  inline glm::vec3 tex2D(glm::vec2 uv) const;
+  inline float getAverageLuminance() const;
   inline TexType getType() const {return type;}
 };
 
@@ -35,8 +37,8 @@ public:
   SolidTexture(glm::vec3 col): Texture(TexType::Solid), col(col) {}
   SolidTexture(float col): Texture(TexType::Solid), col(col) {}
 
-  glm::vec3 tex2D(glm::vec2 uv) const override {return col;}
-  inline float getAverageLuminance() const override {return Luminance(col);}
+  inline glm::vec3 tex2D(glm::vec2 uv) const {return col;}
+  inline float getAverageLuminance() const {return Luminance(col);}
 };
 
 class ImageTexture: public Texture {
@@ -64,7 +66,7 @@ public:
     float pixelScale = 1.0f,
     InterpolateMode mode = InterpolateMode::BILINEAR);
 
-  glm::vec3 tex2D(glm::vec2 uv) const override;
+  glm::vec3 tex2D(glm::vec2 uv) const;
 
   void setUVScale(glm::vec2 scale) {
     this->scale = scale;
@@ -78,4 +80,15 @@ public:
 
   float getAverageLuminance() const;
 
-};
\ No newline at end of file
+};
+
+inline glm::vec3 Texture::tex2D(glm::vec2 uv) const {
+  if(type == Solid) return static_cast<const SolidTexture*>(this)->tex2D(uv);
+  return static_cast<const ImageTexture*>(this)->tex2D(uv);
+}
+
+inline float Texture::getAverageLuminance() const {
+  if(type == Solid) 
+    return static_cast<const SolidTexture*>(this)->getAverageLuminance();
+  return static_cast<const ImageTexture*>(this)->getAverageLuminance();
+}
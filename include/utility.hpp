@@ -2,6 +2,35 @@
 
 #include <glm/glm.hpp>
 
+#include <thread>
+#include <vector>
+
+inline unsigned int leftShift3(unsigned int x) {
+  x = (x|(x<<16)) & 0b00000011000000000000000011111111;
+  x = (x|(x<<8)) &  0b00000011000000001111000000001111;
+  x = (x|(x<<4)) &  0b00000011000011000011000011000011;
+  x = (x|(x<<2)) &  0b00001001001001001001001001001001;
+  return x;
+}
+
+// 30 bits morton code, p in [0, 1023]^3
+inline unsigned int encodeMorton3(glm::vec3 p) {
+  unsigned int res = 0;
+  res |= leftShift3((unsigned int)p.x);
+  res |= leftShift3((unsigned int)p.y)<<1;
+  res |= leftShift3((unsigned int)p.z)<<2;
+  return res;
+}
+
+// run func(0)~func(threadNum-1) on threadNum threads (one is the caller)
+template<typename Func>
+void parallelFor(int threadNum, const Func& func) {
+  std::vector<std::thread> threads;
+  for(int t = 1; t<threadNum; t++) threads.emplace_back(func, t);
+  func(0);
+  for(std::thread& th: threads) th.join();
+}
+
 inline float Luminance(glm::vec3 le) {
   return 0.299f*le.x+0.587f*le.y+0.114f*le.z;
 }
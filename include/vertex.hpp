@@ -2,6 +2,10 @@
 
 #include <glm/glm.hpp>
 
+#include <vector>
+#include <cstdint>
+#include <cmath>
+
 #include "const.hpp"
 
 class Vertex {
@@ -75,4 +79,86 @@ public:
   inline glm::vec3 toTangentSpace(glm::vec3 p) const {
     return {glm::dot(tangent, p), glm::dot(btangent, p), glm::dot(normal, p)};
   }
-};
\ No newline at end of file
+};
+
+// unit vector <-> 32 bits octahedral code, 16 bits a component.
+// the code 0 is the zero vector (also for nan), encode never gives 0 
+// otherwise
+inline uint32_t EncodeOctahedral(glm::vec3 v) {
+  float l1 = std::abs(v.x)+std::abs(v.y)+std::abs(v.z);
+  if(!(l1 > 0.0f)) return 0;
+  glm::vec2 p = glm::vec2(v.x, v.y)/l1;
+  if(v.z < 0.0f) {
+    glm::vec2 fold = 1.0f - glm::abs(glm::vec2(p.y, p.x));
+    p.x = p.x >= 0.0f ? fold.x : -fold.x;
+    p.y = p.y >= 0.0f ? fold.y : -fold.y;
+  }
+  uint32_t qx = (uint32_t)(glm::round(glm::clamp(p.x, -1.0f, 1.0f)*32767.0f)+32768.0f);
+  uint32_t qy = (uint32_t)(glm::round(glm::clamp(p.y, -1.0f, 1.0f)*32767.0f)+32768.0f);
+  return qx | qy<<16;
+}
+
+inline glm::vec3 DecodeOctahedral(uint32_t code) {
+  if(code == 0) return glm::vec3(0.0f);
+  glm::vec3 v(
+    ((int)(code&0xffff)-32768)/32767.0f, ((int)(code>>16)-32768)/32767.0f, 0.0f);
+  v.z = 1.0f - std::abs(v.x) - std::abs(v.y);
+  float t = glm::max(-v.z, 0.0f);
+  v.x += v.x >= 0.0f ? -t : t;
+  v.y += v.y >= 0.0f ? -t : t;
+  return glm::normalize(v);
+}
+
+// the vertex attributes of a mesh as SoA streams, decoded on demand.
+// positions are full floats, normals and tangents octahedral codes,
+// the bitangent is sign*cross(tangent, normal), the sign takes the
+// low bit of the y component of the tangent code, so tangent y is kept
+// at 15 bits. uvs are full or half floats
+class VertexStreams {
+private:
+  static constexpr uint32_t BSignBit = 1u<<16;
+
+  std::vector<glm::vec3> positions;
+  std::vector<uint32_t> normals;
+  std::vector<uint32_t> tangents;
+  std::vector<glm::vec2> uvs; // empty when halfUV
+  std::vector<uint32_t> halfUVs; // empty when !halfUV
+  bool halfUV = false;
+
+public:
+  inline int size() const {return positions.size();}
+  void reserve(int n);
+
+  void addVertex(const Vertex& vtx);
+  void setVertex(int i, const Vertex& vtx);
+  Vertex getVertex(int i) const;
+
+  inline const glm::vec3& getPosition(int i) const {return positions[i];}
+  inline glm::vec3 getNormal(int i) const {
+    return DecodeOctahedral(normals[i]);
+  }
+  // bsign is the sign of the bitangent to cross(tangent, normal)
+  inline glm::vec3 getTangent(int i, float& bsign) const {
+    bsign = tangents[i]&BSignBit ? -1.0f : 1.0f;
+    return DecodeOctahedral(tangents[i]&~BSignBit);
+  }
+  inline glm::vec2 getUV(int i) const {
+    return halfUV ? glm::unpackHalf2x16(halfUVs[i]) : uvs[i];
+  }
+
+  // compare all the stored attributes, used to weld vertices
+  bool lessVertex(int a, int b) const;
+  bool equalVertex(int a, int b) const;
+  // keep the vertices order[0], order[1]... in this order
+  void reorder(const std::vector<int>& order);
+
+  // half uvs are 4 bytes smaller a vertex, but only good for about 
+  // 1k texels in [0, 1], off by default
+  void setHalfUV(bool half);
+  inline bool isHalfUV() const {return halfUV;}
+
+  void transform(const glm::mat4x4& trans, const glm::mat3x3& transT_inv);
+
+  // bytes of the streams
+  std::size_t getMemory() const;
+};
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "integrator.hpp"
+#include "path.hpp"
+
+// same estimator as PathIntegrator (no medium), but the paths of a
+// render call are traced as a wavefront: the path states live in SoA
+// queues and each stage runs over the whole queue before the next one
+//   extend: the rays of all paths are intersected as one batch
+//   shade: emission and the bxdf of the hit, then the paths are sorted
+//     by bxdf so that the sampling runs material by material
+//   shadow: the light samples are tested as one batch of shadow rays
+// finished paths are replaced by new camera paths until rayGen is done.
+// scenes with medium are rendered by PathIntegrator
+class WavefrontIntegrator: public Integrator {
+private:
+  int max_bounce;
+  bool useMIS;
+  int queueSize; // paths in flight of one render call
+  PathIntegrator mediumPath;
+
+public:
+  WavefrontIntegrator(
+    int max_bounce = 12, bool useMIS = true, int queueSize = 1<<12):
+    max_bounce(max_bounce), useMIS(useMIS), queueSize(queueSize),
+    mediumPath(max_bounce, useMIS) {}
+  void render(const Scene& scene, RayGenerator* rayGen, Film& film) const;
+};
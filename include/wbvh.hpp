@@ -0,0 +1,74 @@
+#pragma once
+
+#include <vector>
+
+#include "bvh.hpp"
+
+// N children per node, child bounds stored as SoA so that all the
+// children can be tested in one SSE(N=4) or AVX2(N=8) pass
+template<int N>
+struct WideBVHNode {
+  float bMin[3][N], bMax[3][N];
+  int child[N]; // interior: node index, leaf: first prim in prims
+  int count[N]; // leaf: prims num, 0: interior, -1: empty slot
+};
+
+// compressed layout, child bounds are 8 bits grid coordinates in the
+// node bound: p = origin + q*scale, scale is a power of 2 and the
+// grid cells are rounded outward, so the boxes only grow
+template<int N>
+struct QuantizedWideBVHNode {
+  float origin[3], scale[3];
+  unsigned char qMin[3][N], qMax[3][N]; // empty slot: qMin 255, qMax 0
+  int child[N];
+  int count[N];
+};
+
+// collapsed from a built binary BVH, shares its leaf ordered prims
+template<int N>
+class WideBVH {
+private:
+  const BVH* bvh = nullptr;
+  std::vector<WideBVHNode<N>> nodes;
+  std::vector<QuantizedWideBVHNode<N>> qnodes; // only if quantized
+  bool useSIMD = false;
+  bool quantized = false;
+
+  int collapse(const BVH& bvh, int bIdx);
+  void setChild(WideBVHNode<N>& node, int slot, const BVHNode& bnode);
+  void quantize();
+
+  template<typename Node>
+  void intersect(const std::vector<Node>& nodes, const Ray& ray, 
+    HitRecord& hit, const Primitive* prim, float tMin) const;
+  template<typename Node>
+  bool intersectTest(const std::vector<Node>& nodes, const Ray& ray, 
+    const Primitive* prim, float tMin, float tMax) const;
+
+public:
+  // runtime cpu feature check for the SIMD box test of this width
+  static bool SIMDSupported();
+
+  // quantized: use QuantizedWideBVHNode, less memory but decoded per visit
+  void build(const BVH& bvh, bool quantized = false);
+
+  void intersect(const Ray& ray, HitRecord& hit, 
+    const Primitive* prim = nullptr, float tMin = 0.0f) const;
+  bool intersectTest(const Ray& ray, const Primitive* prim = nullptr, 
+    float tMin = 0.0f, float tMax = FLOAT_MAX) const;
+
+  inline bool isSIMDEnabled() const {return useSIMD;}
+  inline bool isQuantized() const {return quantized;}
+  // empty if quantized
+  inline const std::vector<WideBVHNode<N>>& getNodes() const {return nodes;}
+  inline int getNodeNum() const {
+    return quantized ? qnodes.size() : nodes.size();
+  }
+  inline size_t getNodeBytes() const {
+    return quantized ? qnodes.size()*sizeof(QuantizedWideBVHNode<N>):
+      nodes.size()*sizeof(WideBVHNode<N>);
+  }
+};
+
+using BVH4 = WideBVH<4>;
+using BVH8 = WideBVH<8>;
@@ -0,0 +1,39 @@
+#include "arena.hpp"
+
+#include <algorithm>
+
+thread_local ScratchArena threadArena;
+
+ScratchArena& ScratchArena::getThreadArena() {
+  return threadArena;
+}
+
+ScratchArena::~ScratchArena() {
+  for(Block& b: blocks) delete[] b.data;
+}
+
+// the blocks after curBlock are left by a release, they are reused in
+// order, a block too small for n is skipped until the next release
+void* ScratchArena::allocBytes(std::size_t n, std::size_t align) {
+  if(curBlock < (int)blocks.size()) {
+    std::size_t start = (offset+align-1) & ~(align-1);
+    if(start+n <= blocks[curBlock].size) {
+      offset = start+n;
+      return blocks[curBlock].data+start;
+    }
+  }
+  // new[] is aligned for any fundamental type
+  while(++curBlock < (int)blocks.size()) {
+    if(n <= blocks[curBlock].size) {
+      offset = n;
+      return blocks[curBlock].data;
+    }
+  }
+  Block b{new char[std::max(n, blockSize)], std::max(n, blockSize)};
+  heapAllocs++;
+  capacity += b.size;
+  blocks.push_back(b);
+  curBlock = blocks.size()-1;
+  offset = n;
+  return b.data;
+}
@@ -4,10 +4,11 @@
 // make sure that the first pvtx is ini_pvtx
 void SubPathGenerator::createSubPath(
     const Ray& start_ray, const Scene& scene, 
-    std::vector<PathVertex>& pathVertices, 
+    PathVertices& pathVertices, 
     TerminateState& tstate, int max_bounce) {
   
   Intersection itsc;  // surface itsc(change every bounce)
+  HitRecord hit;
   Ray ray = start_ray, sample_ray;
   glm::vec3 beta = pathVertices[0].beta;
   const Medium* inMedium = scene.getGlobalMedium();
@@ -15,22 +16,23 @@ void SubPathGenerator::createSubPath(
   bool hasMedium = scene.hasMediumInScene();
 
   for(int bounce = 0; bounce<max_bounce; bounce++) {
-    itsc = scene.intersect(ray, nullptr);
+    hit = scene.intersect(ray);
     if(inMedium)
-      beta *= inMedium->sampleNextItsc(ray, itsc);
+      beta *= inMedium->sampleNextItsc(ray, hit);
     
     // if no itsc, two possible cases:
     // no envLight, really no itsc
     // has envLight, hit the envlight
-    if(!itsc.prim) {
+    if(!hit.prim) {
       if(scene.envLight) {
         scene.envLight->genRayItsc(itsc, ray, pathVertices.back().itsc.itscVtx.position);
-        pathVertices.push_back(PathVertex(itsc, -ray.d, beta, nullptr, scene.envLight));
+        pathVertices.emplace_back(itsc, -ray.d, beta, nullptr, scene.envLight);
         tstate = TerminateState::NoBXDF;
       }
       else tstate = TerminateState::NoItsc;
       return;
     }
+    scene.handleItscResult(ray, hit, itsc);
 
     const Material& mat = itsc.prim->getMesh()->material;
     if(itsc.prim->hasSurface() && itsc.cosTheta(ray.d)>0.0f) itsc.reverseNormal();
@@ -39,7 +41,7 @@ void SubPathGenerator::createSubPath(
     if(!mat.bxdfNode) {
       if(mat.light) {
         if(!itsc.normalReverse) // make sure the light face to the surface
-        pathVertices.push_back(PathVertex(itsc, -ray.d, beta, nullptr, mat.light));
+        pathVertices.emplace_back(itsc, -ray.d, beta, nullptr, mat.light);
       }
       else 
         std::cout<<"WARNING: Detect No BXDF Material(not light)"<<std::endl;
@@ -51,7 +53,7 @@ void SubPathGenerator::createSubPath(
     ray.d = -ray.d;
 
     const BXDF* bxdf;
-    float bxdfWeight = mat.getBXDF(itsc, ray, bxdf);
+    float bxdfWeight = scene.getBXDF(mat, itsc, ray, bxdf);
     glm::vec3 nbeta = bxdfWeight * bxdf->sample_ev(itsc, ray, sample_ray);
 
     if(!_IsType(bxdf->getType(), NoSurface)){
@@ -63,10 +65,11 @@ void SubPathGenerator::createSubPath(
     // for surface, for direct light evaluate only use outside medium
     // though NoInteractive(like meidum bound) will not influence beta,
     // but it will influence the calc of pdf, so we ignore these vertex
-    if(!_HasFeature(bxdf->getType(), NoInteractive))
-      pathVertices.push_back(
-        PathVertex(itsc, ray.d, beta, bxdf, mat.light, mat.mediumOutside
-      ));
+    if(!_HasFeature(bxdf->getType(), NoInteractive)) {
+      pathVertices.emplace_back(
+        itsc, ray.d, beta, bxdf, mat.light, mat.mediumOutside);
+      pathVertices.back().bxdfWeight = bxdfWeight;
+    }
 
     if(IsBlack(nbeta)) {tstate=TerminateState::TotalBlack; return;}
     if(!sample_ray.checkDir()) {tstate=TerminateState::CalcERROR; return;}
@@ -146,7 +149,8 @@ bool connectLightAndSurfaceItsc(
   if(leCos <= 0.0f) return false;
 
   glm::vec3 le = pvtx_lt.light->evaluate(pvtx_lt.itsc, -testRay.d);
-  glm::vec3 beta = pvtx_sf.bxdf->evaluate(pvtx_sf.itsc, rayo, testRay);
+  glm::vec3 beta = pvtx_sf.bxdfWeight*
+    pvtx_sf.bxdf->evaluate(pvtx_sf.itsc, rayo, testRay);
 
   L *= leCos*le*beta;
   return true;
@@ -166,8 +170,10 @@ bool connectSurfaceAndSurfaceItsc(
   Ray rayo2{pvtx2.itsc.itscVtx.position, pvtx2.dir_o};
   Ray rayo1{pvtx1.itsc.itscVtx.position, pvtx1.dir_o};
 
-  glm::vec3 beta2 = pvtx2.bxdf->evaluate(pvtx2.itsc, rayo2, testRay2);
-  glm::vec3 beta1 = pvtx1.bxdf->evaluate(pvtx1.itsc, rayo1, testRay1);
+  glm::vec3 beta2 = pvtx2.bxdfWeight*
+    pvtx2.bxdf->evaluate(pvtx2.itsc, rayo2, testRay2);
+  glm::vec3 beta1 = pvtx1.bxdfWeight*
+    pvtx1.bxdf->evaluate(pvtx1.itsc, rayo1, testRay1);
 
   L*=beta1*beta2;
   return true;
@@ -185,7 +191,8 @@ bool connectSurfaceAndCamItsc(
   Ray testRay{pvtx_sf.itsc.itscVtx.position, conn};
   Ray rayo{pvtx_sf.itsc.itscVtx.position, pvtx_sf.dir_o};
 
-  glm::vec3 beta = pvtx_sf.bxdf->evaluate(pvtx_sf.itsc, rayo, testRay);
+  glm::vec3 beta = pvtx_sf.bxdfWeight*
+    pvtx_sf.bxdf->evaluate(pvtx_sf.itsc, rayo, testRay);
 
   L*=beta;
   return true;
@@ -204,12 +211,12 @@ float pwToPa(const PathVertex& pvtx_from, const PathVertex& pvtx_to, float pw){
 }
 
 // do not check whether start or end is valid! 
-void calcFwdPdf(std::vector<PathVertex>& pvtxs, int start, int end) {
+void calcFwdPdf(PathVertices& pvtxs, int start, int end) {
   for(int i = start; i<end; i++) {
     PathVertex& pvtx_pre = pvtxs[i-1];
     Ray rayo{pvtx_pre.itsc.itscVtx.position, pvtx_pre.dir_o};
     Ray rayi{pvtx_pre.itsc.itscVtx.position, -pvtxs[i].dir_o};
-    float pdf = pvtx_pre.bxdf->sample_pdf(pvtx_pre.itsc, rayo, rayi);
+    float pdf = pvtx_pre.bxdf->sample_pdf(pvtx_pre.itsc, rayi, rayo);
     /* NOTICE: when the bxdf is delta distribution, the sample_pdf will
       always return 0, but here we know the vertex was generated by the
       delta bxdf, so, theoretically, the pdf should be infnity (not one).
@@ -223,13 +230,13 @@ void calcFwdPdf(std::vector<PathVertex>& pvtxs, int start, int end) {
 }
 
 // do not check whether start or end is valid! 
-void calcRevPdf(std::vector<PathVertex>& pvtxs, int start, int end) {
+void calcRevPdf(PathVertices& pvtxs, int start, int end) {
   for(int i = start; i<end; i++) {
     PathVertex& pvtx_n1 = pvtxs[i+1];
     PathVertex& pvtx_n2 = pvtxs[i+2];
     Ray rayo{pvtx_n1.itsc.itscVtx.position, -pvtx_n2.dir_o};
     Ray rayi{pvtx_n1.itsc.itscVtx.position, pvtx_n1.dir_o};
-    float pdf = pvtx_n1.bxdf->sample_pdf(pvtx_n1.itsc, rayo, rayi);
+    float pdf = pvtx_n1.bxdf->sample_pdf(pvtx_n1.itsc, rayi, rayo);
     if(pdf == 0.0f) pvtxs[i].revPdf = 1e6f;
     else pvtxs[i].revPdf = pwToPa(pvtx_n1, pvtxs[i], pdf);
   }
@@ -248,13 +255,13 @@ void calcConnPdf(
   Ray rayo{p_from.itsc.itscVtx.position, p_from.dir_o};
   Ray rayi{p_from.itsc.itscVtx.position, dirToConn};
 
-  toRevPdf = p_from.bxdf->sample_pdf(p_from.itsc, rayo, rayi);
+  toRevPdf = p_from.bxdf->sample_pdf(p_from.itsc, rayi, rayo);
   toRevPdf = pwToPa(p_from, p_to, toRevPdf);
 
   Ray rayo2{p_to.itsc.itscVtx.position, -dirToConn};
   Ray rayi2{p_to.itsc.itscVtx.position, p_to.dir_o};
 
-  toPreRevPdf = p_to.bxdf->sample_pdf(p_to.itsc, rayo2, rayi2);
+  toPreRevPdf = p_to.bxdf->sample_pdf(p_to.itsc, rayi2, rayo2);
   toPreRevPdf = pwToPa(p_to, p_to_pre, toPreRevPdf);
 }
 
@@ -269,7 +276,7 @@ void calcConnPdf(
   Ray rayo{p_from.itsc.itscVtx.position, p_from.dir_o};
   Ray rayi{p_from.itsc.itscVtx.position, dirToConn};
 
-  toRevPdf = p_from.bxdf->sample_pdf(p_from.itsc, rayo, rayi);
+  toRevPdf = p_from.bxdf->sample_pdf(p_from.itsc, rayi, rayo);
   toRevPdf = pwToPa(p_from, p_to, toRevPdf);
 }
 
@@ -287,7 +294,7 @@ void calcConnPdfFromLt(
   Ray rayo2{p_to.itsc.itscVtx.position, -dirToConn};
   Ray rayi2{p_to.itsc.itscVtx.position, p_to.dir_o};
 
-  toPreRevPdf = p_to.bxdf->sample_pdf(p_to.itsc, rayo2, rayi2);
+  toPreRevPdf = p_to.bxdf->sample_pdf(p_to.itsc, rayi2, rayo2);
   toPreRevPdf = pwToPa(p_to, p_to_pre, toPreRevPdf);
 }
 
@@ -304,12 +311,12 @@ void calcConnPdfFromCam(
   Ray rayo2{p_to.itsc.itscVtx.position, -dirToConn};
   Ray rayi2{p_to.itsc.itscVtx.position, p_to.dir_o};
 
-  toPreRevPdf = p_to.bxdf->sample_pdf(p_to.itsc, rayo2, rayi2);
+  toPreRevPdf = p_to.bxdf->sample_pdf(p_to.itsc, rayi2, rayo2);
   toPreRevPdf = pwToPa(p_to, p_to_pre, toPreRevPdf);
 }
 
 // 0~end (include end)
-void calcHalfMIS(const std::vector<PathVertex>& pvtxs, 
+void calcHalfMIS(const PathVertices& pvtxs, 
   int end, float revPdf, float& res) {
   float cur = res*(revPdf / pvtxs[end].fwdPdf);
   res += cur;
@@ -321,8 +328,8 @@ void calcHalfMIS(const std::vector<PathVertex>& pvtxs,
 
 // make sure that 0~connlt and 0~conncam fwdPdf and revPdf are valid
 // connlt and conncam not 0 at the same time
-float BDPT_MIS(const std::vector<PathVertex>& pvtxs_lt, 
-  const std::vector<PathVertex>& pvtxs_cam, int connlt, int conncam) {
+float BDPT_MIS(const PathVertices& pvtxs_lt, 
+  const PathVertices& pvtxs_cam, int connlt, int conncam) {
   
   const PathVertex& pclt = pvtxs_lt[connlt];
   const PathVertex& pccm = pvtxs_cam[conncam];
@@ -366,7 +373,7 @@ float BDPT_MIS(const std::vector<PathVertex>& pvtxs_lt,
 
 // for fromCam path directly hit light, pvtxs[tidx] must have light
 float BDPT_MIS(const Scene& scene,
-  const std::vector<PathVertex>& pvtxs, int tidx) {
+  const PathVertices& pvtxs, int tidx) {
   
   const PathVertex& ltVtx = pvtxs[tidx];
   float ltRevPdf = scene.getLightPdf(ltVtx.light); // pdf for select light
@@ -396,12 +403,16 @@ void BDPTIntegrator::render(
   Ray camStartRay, ltStartRay;
   glm::vec2 camRasPos, ltRasPos;
 
-  SubPathGenerator subpathGen;
+  // the vertices are cleared but not freed between camera rays
+  ScratchScope renderScope(_ThreadArena);
+  SubPathGenerator subpathGen(_ThreadArena, max_sub_path_bounce);
 
-  std::vector<PathVertex>& psCam = subpathGen.pathVerticesCam;
-  std::vector<PathVertex>& psLt = subpathGen.pathVerticesLt;
+  PathVertices& psCam = subpathGen.pathVerticesCam;
+  PathVertices& psLt = subpathGen.pathVerticesLt;
 
   while(rayGen->genNextRay(camStartRay, camRasPos)) {
+    _ThreadSampler.startSample(
+      glm::ivec2(camRasPos), rayGen->getSampleIndex());
     if((int)camRasPos.x == 200 && (int)camRasPos.y == 545) {
       int debug = 0;
     }
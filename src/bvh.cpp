@@ -1,123 +1,1251 @@
 #include "bvh.hpp"
+#include "utility.hpp"
 
 #include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <thread>
+#include <atomic>
+#include <mutex>
 
-inline unsigned int leftShift3(unsigned int x) {
-  x = (x|(x<<16)) & 0b00000011000000000000000011111111;
-  x = (x|(x<<8)) &  0b00000011000000001111000000001111;
-  x = (x|(x<<4)) &  0b00000011000011000011000011000011;
-  x = (x|(x<<2)) &  0b00001001001001001001001001001001;
-  return x;
-}
-
-unsigned int encode(glm::vec3 p) {
-  unsigned int res = 0;
-  res |= leftShift3((unsigned int)p.x);
-  res |= leftShift3((unsigned int)p.y)<<1;
-  res |= leftShift3((unsigned int)p.z)<<2;
-  return res;
-}
-
-int BVH::buildSAHBVH(int start, int end, int deep) {
-  if(end <= start) return -1;
-  if(end - start == 1) {
-    bvhNodes.push_back({prims[start]->getBB3(), start, 1, -1, -1});
-    return bvhNodes.size() - 1;
-  }
-
-  BB3 totbb3; int nPrims = end - start;
-  for(unsigned int i = start; i<end; i++) 
-    totbb3.Union_(prims[i]->getBB3());
-    
-  if(maxDeep != -1 && deep >= maxDeep) {
-    bvhNodes.push_back({totbb3, start, nPrims, -1, -1});
-    return bvhNodes.size() - 1;
-  }
-    
-  int axis = totbb3.getMaxAxis();
-  std::sort(prims.begin()+start, prims.begin()+end, 
-    [axis](const Primitive* p1, const Primitive* p2){
-      return p1->getCenter()[axis]<p2->getCenter()[axis];});
-  float invCalc = 1.0f/(totbb3.getSurfaceArea()*nPrims);
-
-  std::vector<BB3> bb3s(end-start-1); BB3 tmp;
-  for(unsigned int i = end-1; i>=start+1; i--) {
-    tmp.Union_(prims[i]->getBB3());
-    bb3s[i-start-1] = tmp;
-  }
-  
-  BB3 lftbb3; int split = -1; float minSAH = FLOAT_MAX;
-  for(unsigned int i = start; i<end-1; i++) {
-    lftbb3.Union_(prims[i]->getBB3());
-    BB3 rgtbb3 = bb3s[i-start];
-    float sah = rgtbb3.getSurfaceArea()*invCalc*(end-i-1)+
-      lftbb3.getSurfaceArea()*invCalc*(i-start+1) + .5f;
-    if(minSAH>sah) {
-      minSAH = sah;
-      split = i;
-    }
-  }
-
-  if(nPrims>maxPrimsInNode || minSAH<1) { // interior node
-    bvhNodes.push_back({totbb3, start, nPrims, -1, -1}); 
-    int nodePos = bvhNodes.size() - 1;
-    int lft = buildSAHBVH(start, split+1, deep+1);
-    int rgt = buildSAHBVH(split+1, end, deep+1);
-    bvhNodes[nodePos].lft = lft;
-    bvhNodes[nodePos].rgt = rgt;
-    return nodePos;// to keep root nodepos 0 and make leftson be the next
+#ifdef __SSE2__
+#define YCR_SSE_LEAF
+#include <immintrin.h>
+#endif
+
+struct BVH::BuildPrim {
+  BB3 bb3;
+  glm::vec3 center;
+  int idx;
+};
+
+struct BVH::BuildNode {
+  BB3 bb3;
+  int offset, _size;
+  int axis = 0;
+  BuildNode* lft = nullptr;
+  BuildNode* rgt = nullptr;
+
+  ~BuildNode() {delete lft; delete rgt;}
+};
+
+// shared by all threads of one build, limits the threads spawned
+class BVH::BuildTask {
+private:
+  std::atomic<int> freeThreads;
+  std::atomic<int> freeRefs; // SBVH: extra references still allowed
+  std::mutex leafMutex;
+
+public:
+  // SBVH: leaves copy their references here, node offset points into it
+  std::vector<BuildPrim> leafRefs;
+  float rootArea = 0.0f;
+
+  BuildTask(int threadNum, int freeRefs = 0): 
+    freeThreads(threadNum - 1), freeRefs(freeRefs) {}
+
+  inline bool acquireThread() {
+    if(freeThreads.fetch_sub(1) > 0) return true;
+    freeThreads.fetch_add(1);
+    return false;
+  }
+  inline void releaseThread() {freeThreads.fetch_add(1);}
+
+  inline bool hasFreeRefs() const {return freeRefs.load() > 0;}
+  inline bool acquireRef() {
+    if(freeRefs.fetch_sub(1) > 0) return true;
+    freeRefs.fetch_add(1);
+    return false;
+  }
+
+  inline int addLeaf(const std::vector<BuildPrim>& refs) {
+    std::lock_guard<std::mutex> lock(leafMutex);
+    int offset = leafRefs.size();
+    leafRefs.insert(leafRefs.end(), refs.begin(), refs.end());
+    return offset;
+  }
+};
+
+// the best binned SAH split over the centers of one node
+struct BVH::ObjectSplit {
+  int axis = 0, nBuckets = 0;
+  int bucket = -1; // -1: no valid split
+  float cmin = 0.0f, bscale = 0.0f;
+  float cost = FLOAT_MAX;
+  BB3 lftbb3, rgtbb3;
+
+  inline int bucketOf(const BuildPrim& bp) const {
+    int b = (int)((bp.center[axis] - cmin)*bscale);
+    return std::min(std::max(b, 0), nBuckets - 1);
+  }
+  inline bool isLeft(const BuildPrim& bp) const {return bucketOf(bp) <= bucket;}
+};
+
+// SBVH: the node bound is cut by the plane p[axis] = pos, references 
+// straddling the plane are clipped into both children
+struct BVH::SpatialSplit {
+  int axis = 0;
+  float pos = 0.0f;
+  float cost = FLOAT_MAX;
+};
+
+namespace {
+
+int getThreadNum(const BVHParams& params) {
+  int threadNum = params.maxThreadNum > 0 ? 
+    params.maxThreadNum : std::thread::hardware_concurrency();
+  return std::max(threadNum, 1);
+}
+
+// LSD radix sort of 30 bits morton codes, stable, every pass sorts
+// each chunk's histogram in parallel then scatters in parallel
+void radixSortMorton(std::vector<unsigned int>& codes, 
+  std::vector<int>& idxs, int threadNum) {
+
+  const int bitsPerPass = 6, nBuckets = 1<<bitsPerPass;
+  const int nPasses = 30/bitsPerPass;
+  int n = codes.size();
+  threadNum = std::max(1, std::min(threadNum, n/(1<<14)));
+  int chunk = (n + threadNum - 1)/threadNum;
+
+  std::vector<unsigned int> tmpCodes(n);
+  std::vector<int> tmpIdxs(n);
+  std::vector<int> offsets(threadNum*nBuckets);
+  for(int pass = 0; pass<nPasses; pass++) {
+    int shift = pass*bitsPerPass;
+    std::vector<unsigned int>& inCodes = (pass&1) ? tmpCodes : codes;
+    std::vector<unsigned int>& outCodes = (pass&1) ? codes : tmpCodes;
+    std::vector<int>& inIdxs = (pass&1) ? tmpIdxs : idxs;
+    std::vector<int>& outIdxs = (pass&1) ? idxs : tmpIdxs;
+
+    std::fill(offsets.begin(), offsets.end(), 0);
+    parallelFor(threadNum, [&](int t) {
+      int* hist = &offsets[t*nBuckets];
+      for(int i = t*chunk; i<std::min(n, (t+1)*chunk); i++) 
+        hist[(inCodes[i]>>shift)&(nBuckets-1)]++;
+    });
+    int sum = 0;
+    for(int b = 0; b<nBuckets; b++) {
+      for(int t = 0; t<threadNum; t++) {
+        int cnt = offsets[t*nBuckets+b];
+        offsets[t*nBuckets+b] = sum;
+        sum += cnt;
+      }
+    }
+    parallelFor(threadNum, [&](int t) {
+      int* pos = &offsets[t*nBuckets];
+      for(int i = t*chunk; i<std::min(n, (t+1)*chunk); i++) {
+        int dst = pos[(inCodes[i]>>shift)&(nBuckets-1)]++;
+        outCodes[dst] = inCodes[i];
+        outIdxs[dst] = inIdxs[i];
+      }
+    });
+  }
+  if(nPasses&1) {
+    codes.swap(tmpCodes);
+    idxs.swap(tmpIdxs);
+  }
+}
+
+// the lowest bits inside a treelet, treelets are split by the higher bits
+constexpr int TreeletBits = 18;
+
+// from this deep on, the nodes with more prims than a leaf can hold are
+// split at the median. halving brings any int count of prims under
+// MaxLeafPrims in 16 levels, before the leaves forced at MaxStackDeep-1
+constexpr int MedianSplitDeep = BVHParams::MaxStackDeep - 1 - 16;
+// the LBVH levels above the treelets: morton bits over TreeletBits, or 
+// MaxStackDeep/4 SAH levels then median splits of the treelet roots
+constexpr int LBVHUpperDeep = BVHParams::MaxStackDeep/4 + (30 - TreeletBits);
+
+}
+
+void BVH::setParams(const BVHParams& params) {
+  this->params = params;
+  if(params.maxPrimsInNode > BVHParams::MaxLeafPrims) {
+    std::cout<<"Warning: maxPrimsInNode "<<params.maxPrimsInNode<<
+      " is larger than "<<BVHParams::MaxLeafPrims<<", clamped"<<std::endl;
+    this->params.maxPrimsInNode = BVHParams::MaxLeafPrims;
+  }
+}
+
+void BVH::clearBuild() {
+  bvhNodes.clear();
+  leafGroups.clear();
+  buildSAHCost = 0.0f;
+  builtPrimNum = prims.size();
+}
+
+void BVH::build() {
+  if(params.method == BVHParams::BuildMethod::LBVH) buildLBVH();
+  else if(params.method == BVHParams::BuildMethod::SBVH) buildSBVH();
+  else buildSAHBVH();
+}
+
+// primitive bounds are virtual calls, evaluate them only once
+void BVH::initBuildPrims(std::vector<BuildPrim>& bprims) const {
+  bprims.resize(prims.size());
+  for(unsigned int i = 0; i<prims.size(); i++) {
+    bprims[i].bb3 = prims[i]->getBB3();
+    bprims[i].center = bprims[i].bb3.getCenter();
+    bprims[i].idx = i;
+  }
+}
+
+void BVH::setLeafPrim(int lane, int primIdx) {
+  BVHLeafGroup& group = leafGroups[lane/BVHLeafGroup::Width];
+  int k = lane%BVHLeafGroup::Width;
+  glm::vec3 pos[3];
+  bool isTriangle = prims[primIdx]->getTriangle(pos);
+  for(int axis = 0; axis<3; axis++) {
+    group.v0[axis][k] = isTriangle ? pos[0][axis] : 0.0f;
+    group.e1[axis][k] = isTriangle ? pos[1][axis] - pos[0][axis] : 0.0f;
+    group.e2[axis][k] = isTriangle ? pos[2][axis] - pos[0][axis] : 0.0f;
+  }
+  group.id[k] = isTriangle ? primIdx : ~primIdx;
+}
+
+// the leaves point into bprims, copy the prims in that order and
+// move every leaf to the start of a group
+void BVH::finishBuild(BuildNode* root, const std::vector<BuildPrim>& bprims) {
+  bvhNodes.reserve(2*bprims.size());
+  flatten(root);
+  delete root;
+
+  const int W = BVHLeafGroup::Width;
+  int nGroup = 0;
+  for(const BVHNode& node: bvhNodes) 
+    if(node.isLeaf()) nGroup += (node._size + W-1)/W;
+  leafGroups.assign(nGroup, BVHLeafGroup()); // zero edges for unused lanes
+  int lane = 0;
+  for(BVHNode& node: bvhNodes) {
+    if(!node.isLeaf()) continue;
+    for(int i = 0; i<node._size; i++) 
+      setLeafPrim(lane + i, bprims[node.offset + i].idx);
+    node.offset = lane;
+    lane += (node._size + W-1)/W*W;
+  }
+  buildSAHCost = getSAHCost();
+}
+
+void BVH::buildSAHBVH() {
+  clearBuild();
+  if(prims.empty()) return;
+
+  std::vector<BuildPrim> bprims;
+  initBuildPrims(bprims);
+  BuildTask task(getThreadNum(params));
+  BuildNode* root = buildRecursive(task, bprims, 0, bprims.size(), 0);
+  finishBuild(root, bprims);
+}
+
+void BVH::buildLBVH() {
+  clearBuild();
+  if(prims.empty()) return;
+
+  std::vector<BuildPrim> bprims;
+  initBuildPrims(bprims);
+  int threadNum = getThreadNum(params);
+  int n = bprims.size();
+
+  // quantize the centers to 10 bits per axis in the centers bound
+  BB3 centerbb3;
+  for(const BuildPrim& bp: bprims) centerbb3.update(bp.center);
+  glm::vec3 diag = centerbb3.getDiagonal();
+  glm::vec3 scale;
+  for(int axis = 0; axis<3; axis++) 
+    scale[axis] = diag[axis] > 0.0f ? 1023.0f/diag[axis] : 0.0f;
+  std::vector<unsigned int> codes(n);
+  std::vector<int> order(n);
+  for(int i = 0; i<n; i++) {
+    glm::vec3 q = glm::clamp(
+      (bprims[i].center - centerbb3.getMin())*scale, 0.0f, 1023.0f);
+    codes[i] = encodeMorton3(q);
+    order[i] = i;
+  }
+  radixSortMorton(codes, order, threadNum);
+  std::vector<BuildPrim> sorted(n);
+  for(int i = 0; i<n; i++) sorted[i] = bprims[order[i]];
+  bprims.swap(sorted);
+
+  // prims sharing the high bits form a treelet, emitted in parallel
+  std::vector<int> treeletStart;
+  for(int i = 0; i<n; i++) {
+    if(i == 0 || (codes[i]>>TreeletBits) != (codes[i-1]>>TreeletBits))
+      treeletStart.push_back(i);
+  }
+  int nTreelet = treeletStart.size();
+  treeletStart.push_back(n);
+  std::vector<BuildNode*> roots(nTreelet);
+  std::vector<unsigned int> rootCodes(nTreelet);
+  std::atomic<int> nextTreelet(0);
+  parallelFor(std::min(threadNum, nTreelet), [&](int) {
+    int i;
+    while((i = nextTreelet.fetch_add(1)) < nTreelet) {
+      roots[i] = emitLBVH(bprims, codes, 
+        treeletStart[i], treeletStart[i+1], TreeletBits-1, 0);
+      rootCodes[i] = codes[treeletStart[i]];
+    }
+  });
+
+  BuildNode* root = params.lbvhSAHRefine ?
+    buildUpperSAH(roots, 0, nTreelet, 0):
+    buildUpperMorton(roots, rootCodes, 0, nTreelet, 29);
+  finishBuild(root, bprims);
+}
+
+// split at the first prim whose bitIndex bit is set, the sorted codes
+// make it a binary search
+BVH::BuildNode* BVH::emitLBVH(const std::vector<BuildPrim>& bprims, 
+  const std::vector<unsigned int>& codes, 
+  int start, int end, int bitIndex, int deep) const {
+
+  BuildNode* node = new BuildNode;
+  int nPrims = end - start;
+  node->offset = start;
+  node->_size = nPrims;
+  bool tooDeep = deep >= BVHParams::MaxStackDeep/2 ||
+    (params.maxDeep != -1 && deep >= params.maxDeep);
+  if(nPrims <= params.maxPrimsInNode || 
+    (tooDeep && nPrims <= BVHParams::MaxLeafPrims)) {
+    for(int i = start; i<end; i++) node->bb3.Union_(bprims[i].bb3);
+    return node;
+  }
+
+  // deep is inside the treelet, the upper levels are above it
+  bool halve = nPrims > BVHParams::MaxLeafPrims && 
+    (tooDeep || deep + LBVHUpperDeep >= MedianSplitDeep);
+  int mid = -1;
+  for(; !halve && bitIndex>=0 && mid == -1; bitIndex--) {
+    unsigned int mask = 1u<<bitIndex;
+    if((codes[start]&mask) == (codes[end-1]&mask)) continue;
+    mid = std::lower_bound(codes.begin()+start, codes.begin()+end, 
+      codes[start]|mask, [mask](unsigned int c, unsigned int v){
+        return (c&mask) < (v&mask);
+      }) - codes.begin();
+    node->axis = bitIndex%3;
+  }
+  // the rest codes are all the same, just split in the middle
+  if(mid == -1) mid = start + nPrims/2;
+
+  node->lft = emitLBVH(bprims, codes, start, mid, bitIndex, deep+1);
+  node->rgt = emitLBVH(bprims, codes, mid, end, bitIndex, deep+1);
+  node->bb3 = node->lft->bb3.Union(node->rgt->bb3);
+  return node;
+}
+
+BVH::BuildNode* BVH::buildUpperMorton(std::vector<BuildNode*>& roots, 
+  const std::vector<unsigned int>& rootCodes, 
+  int start, int end, int bitIndex) const {
+
+  if(end - start == 1) return roots[start];
+  int mid = -1;
+  BuildNode* node = new BuildNode;
+  for(; bitIndex>=TreeletBits && mid == -1; bitIndex--) {
+    unsigned int mask = 1u<<bitIndex;
+    if((rootCodes[start]&mask) == (rootCodes[end-1]&mask)) continue;
+    for(mid = start; !(rootCodes[mid]&mask); mid++);
+    node->axis = bitIndex%3;
+  }
+  node->lft = buildUpperMorton(roots, rootCodes, start, mid, bitIndex);
+  node->rgt = buildUpperMorton(roots, rootCodes, mid, end, bitIndex);
+  node->bb3 = node->lft->bb3.Union(node->rgt->bb3);
+  node->offset = node->lft->offset;
+  node->_size = node->lft->_size + node->rgt->_size;
+  return node;
+}
+
+// binned SAH over the treelet roots, they are few so no threads here
+BVH::BuildNode* BVH::buildUpperSAH(
+  std::vector<BuildNode*>& roots, int start, int end, int deep) const {
+
+  if(end - start == 1) return roots[start];
+  BB3 totbb3, centerbb3;
+  for(int i = start; i<end; i++) {
+    totbb3.Union_(roots[i]->bb3);
+    centerbb3.update(roots[i]->bb3.getCenter());
+  }
+  int axis = centerbb3.getMaxAxis();
+  float cmin = centerbb3.getMin()[axis];
+  float extent = centerbb3.getDiagonal()[axis];
+  int mid = -1;
+
+  // keep the upper part shallow, the treelets below need the stack too
+  if(extent > 0.0f && deep < BVHParams::MaxStackDeep/4) {
+    const int nb = params.bucketNum;
+    std::vector<int> counts(nb, 0);
+    std::vector<BB3> bounds(nb);
+    float bscale = nb / extent;
+    auto bucketOf = [&](const BuildNode* n) {
+      int b = (int)((n->bb3.getCenter()[axis] - cmin)*bscale);
+      return std::min(std::max(b, 0), nb - 1);
+    };
+    for(int i = start; i<end; i++) {
+      int b = bucketOf(roots[i]);
+      counts[b] += roots[i]->_size;
+      bounds[b].Union_(roots[i]->bb3);
+    }
+    int split = -1; float minSAH = FLOAT_MAX;
+    for(int s = 0; s<nb-1; s++) {
+      BB3 b0, b1; int c0 = 0, c1 = 0;
+      for(int b = 0; b<=s; b++) {b0.Union_(bounds[b]); c0 += counts[b];}
+      for(int b = s+1; b<nb; b++) {b1.Union_(bounds[b]); c1 += counts[b];}
+      if(c0 == 0 || c1 == 0) continue;
+      float sah = b0.getSurfaceArea()*c0 + b1.getSurfaceArea()*c1;
+      if(minSAH > sah) {minSAH = sah; split = s;}
+    }
+    if(split != -1) 
+      mid = std::partition(roots.begin()+start, roots.begin()+end,
+        [&](const BuildNode* n){return bucketOf(n) <= split;}) - roots.begin();
+  }
+  if(mid == -1) { // median split
+    mid = (start + end)/2;
+    std::nth_element(roots.begin()+start, roots.begin()+mid, roots.begin()+end,
+      [axis](const BuildNode* a, const BuildNode* b){
+        return a->bb3.getCenter()[axis] < b->bb3.getCenter()[axis];
+      });
+  }
+
+  BuildNode* node = new BuildNode;
+  node->axis = axis;
+  node->lft = buildUpperSAH(roots, start, mid, deep+1);
+  node->rgt = buildUpperSAH(roots, mid, end, deep+1);
+  node->bb3 = totbb3;
+  node->offset = std::min(node->lft->offset, node->rgt->offset);
+  node->_size = node->lft->_size + node->rgt->_size;
+  return node;
+}
+
+BVH::BuildNode* BVH::buildRecursive(BuildTask& task, 
+  std::vector<BuildPrim>& bprims, int start, int end, int deep) const {
+
+  BuildNode* node = new BuildNode;
+  int nPrims = end - start;
+  BB3 totbb3, centerbb3;
+  for(int i = start; i<end; i++) {
+    totbb3.Union_(bprims[i].bb3);
+    centerbb3.update(bprims[i].center);
+  }
+  node->bb3 = totbb3;
+  node->offset = start;
+  node->_size = nPrims;
+
+  // the traversal stack limits the deep even if maxDeep == -1
+  bool tooDeep = deep >= BVHParams::MaxStackDeep - 1 ||
+    (params.maxDeep != -1 && deep >= params.maxDeep);
+  if(nPrims == 1 || (tooDeep && nPrims <= BVHParams::MaxLeafPrims)) 
+    return node;
+  bool halve = nPrims > BVHParams::MaxLeafPrims && 
+    (tooDeep || deep >= MedianSplitDeep);
+
+  int axis = centerbb3.getMaxAxis();
+  int mid = -1;
+
+  if(centerbb3.getDiagonal()[axis] <= 0.0f) { 
+    // all centers coincide, SAH can not separate them
+    if(nPrims <= params.maxPrimsInNode) return node;
+    mid = start + nPrims/2;
+    axis = 0;
+  }
+  else if(!halve) {
+    ObjectSplit split = findObjectSplit(bprims, start, end, totbb3, centerbb3);
+    float leafSAH = params.intersectCost*nPrims;
+    if((split.bucket == -1 && nPrims <= BVHParams::MaxLeafPrims) || 
+      (nPrims <= params.maxPrimsInNode && split.cost >= leafSAH))
+      return node; // leaf node
+
+    if(split.bucket != -1) {
+      axis = split.axis;
+      mid = std::partition(bprims.begin()+start, bprims.begin()+end,
+        [&](const BuildPrim& bp){return split.isLeft(bp);}) - bprims.begin();
+    }
+  }
+  if(mid == -1) { // too many prims for a leaf, halve them
+    mid = start + nPrims/2;
+    std::nth_element(bprims.begin()+start, bprims.begin()+mid, 
+      bprims.begin()+end, [axis](const BuildPrim& a, const BuildPrim& b){
+        return a.center[axis] < b.center[axis];
+      });
+  }
+
+  // interior node, the two subtrees touch disjoint ranges of bprims
+  node->axis = axis;
+  if(nPrims >= params.parallelThreshold && task.acquireThread()) {
+    std::thread lftThread([&](){
+      node->lft = buildRecursive(task, bprims, start, mid, deep+1);
+    });
+    node->rgt = buildRecursive(task, bprims, mid, end, deep+1);
+    lftThread.join();
+    task.releaseThread();
+  }
+  else {
+    node->lft = buildRecursive(task, bprims, start, mid, deep+1);
+    node->rgt = buildRecursive(task, bprims, mid, end, deep+1);
+  }
+  return node;
+}
+
+// centers of bprims[start, end) must not coincide on the max axis
+BVH::ObjectSplit BVH::findObjectSplit(const std::vector<BuildPrim>& bprims, 
+  int start, int end, const BB3& totbb3, const BB3& centerbb3) const {
+
+  ObjectSplit split;
+  const int nb = params.bucketNum;
+  split.axis = centerbb3.getMaxAxis();
+  split.nBuckets = nb;
+  split.cmin = centerbb3.getMin()[split.axis];
+  split.bscale = nb / centerbb3.getDiagonal()[split.axis];
+  std::vector<int> counts(nb, 0);
+  std::vector<BB3> bounds(nb);
+  for(int i = start; i<end; i++) {
+    int b = split.bucketOf(bprims[i]);
+    counts[b]++;
+    bounds[b].Union_(bprims[i].bb3);
+  }
+
+  // sweep from right to get the right side of every split
+  std::vector<BB3> rgtBounds(nb);
+  std::vector<int> rgtCount(nb, 0);
+  BB3 tmp; int cnt = 0;
+  for(int b = nb-1; b>0; b--) {
+    tmp.Union_(bounds[b]); cnt += counts[b];
+    rgtBounds[b] = tmp;
+    rgtCount[b] = cnt;
+  }
+
+  float invArea = 1.0f/totbb3.getSurfaceArea();
+  BB3 lftbb3; int lftCount = 0;
+  for(int b = 0; b<nb-1; b++) {
+    lftbb3.Union_(bounds[b]); lftCount += counts[b];
+    if(lftCount == 0 || rgtCount[b+1] == 0) continue;
+    float sah = params.traversalCost + params.intersectCost*invArea*
+      (lftbb3.getSurfaceArea()*lftCount + 
+      rgtBounds[b+1].getSurfaceArea()*rgtCount[b+1]);
+    if(split.cost>sah) {
+      split.cost = sah;
+      split.bucket = b;
+      split.lftbb3 = lftbb3;
+      split.rgtbb3 = rgtBounds[b+1];
+    }
+  }
+  return split;
+}
+
+BB3 BVH::clipRef(const BuildPrim& ref, int axis, float lo, float hi) const {
+  return prims[ref.idx]->getClippedBB3(axis, lo, hi).Intersect(ref.bb3);
+}
+
+// bins of the node bound on every axis, a reference is clipped into 
+// every bin it spans, entries and exits count it on both ends
+BVH::SpatialSplit BVH::findSpatialSplit(
+  const std::vector<BuildPrim>& refs, const BB3& totbb3) const {
+
+  SpatialSplit split;
+  const int nb = params.bucketNum;
+  float invArea = 1.0f/totbb3.getSurfaceArea();
+  std::vector<int> entries(nb), exits(nb), rgtCount(nb);
+  std::vector<BB3> bounds(nb), rgtBounds(nb);
+  for(int axis = 0; axis<3; axis++) {
+    float lo = totbb3.getMin()[axis];
+    float extent = totbb3.getDiagonal()[axis];
+    if(extent <= 0.0f) continue;
+    float binSize = extent / nb, invBinSize = nb / extent;
+    auto binOf = [&](float x) {
+      int b = (int)((x - lo)*invBinSize);
+      return std::min(std::max(b, 0), nb - 1);
+    };
+    std::fill(entries.begin(), entries.end(), 0);
+    std::fill(exits.begin(), exits.end(), 0);
+    std::fill(bounds.begin(), bounds.end(), BB3());
+    for(const BuildPrim& ref: refs) {
+      int b0 = binOf(ref.bb3.getMin()[axis]), b1 = binOf(ref.bb3.getMax()[axis]);
+      entries[b0]++;
+      exits[b1]++;
+      if(b0 == b1) bounds[b0].Union_(ref.bb3);
+      else for(int b = b0; b<=b1; b++) 
+        bounds[b].Union_(clipRef(ref, axis, lo + b*binSize, lo + (b+1)*binSize));
+    }
+
+    BB3 tmp; int cnt = 0;
+    for(int b = nb-1; b>0; b--) {
+      tmp.Union_(bounds[b]); cnt += exits[b];
+      rgtBounds[b] = tmp;
+      rgtCount[b] = cnt;
+    }
+    BB3 lftbb3; int lftCount = 0;
+    for(int b = 0; b<nb-1; b++) {
+      lftbb3.Union_(bounds[b]); lftCount += entries[b];
+      if(lftCount == 0 || rgtCount[b+1] == 0) continue;
+      float sah = params.traversalCost + params.intersectCost*invArea*
+        (lftbb3.getSurfaceArea()*lftCount + 
+        rgtBounds[b+1].getSurfaceArea()*rgtCount[b+1]);
+      if(split.cost>sah) {
+        split.cost = sah;
+        split.axis = axis;
+        split.pos = lo + (b+1)*binSize;
+      }
+    }
+  }
+  return split;
+}
+
+void BVH::buildSBVH() {
+  clearBuild();
+  if(prims.empty()) return;
+
+  std::vector<BuildPrim> refs;
+  initBuildPrims(refs);
+  BuildTask task(getThreadNum(params), 
+    (int)(refs.size()*params.sbvhMaxRefGrowth));
+  BB3 rootbb3;
+  for(const BuildPrim& ref: refs) rootbb3.Union_(ref.bb3);
+  task.rootArea = rootbb3.getSurfaceArea();
+  BuildNode* root = buildSBVHRecursive(task, refs, 0);
+  finishBuild(root, task.leafRefs);
+}
+
+// the same as buildRecursive, but the references of every node are its own
+// vector, since a spatial split may put one reference into both children
+BVH::BuildNode* BVH::buildSBVHRecursive(BuildTask& task, 
+  std::vector<BuildPrim>& refs, int deep) const {
+
+  BuildNode* node = new BuildNode;
+  int nPrims = refs.size();
+  BB3 totbb3, centerbb3;
+  for(const BuildPrim& ref: refs) {
+    totbb3.Union_(ref.bb3);
+    centerbb3.update(ref.center);
+  }
+  node->bb3 = totbb3;
+  node->_size = nPrims;
+
+  bool tooDeep = deep >= BVHParams::MaxStackDeep - 1 ||
+    (params.maxDeep != -1 && deep >= params.maxDeep);
+  // no split is searched, the median split below
+  bool halve = nPrims > BVHParams::MaxLeafPrims && 
+    (tooDeep || deep >= MedianSplitDeep);
+  bool centerSplit = centerbb3.getDiagonal()[centerbb3.getMaxAxis()] > 0.0f;
+  ObjectSplit objSplit;
+  if(centerSplit && !halve) 
+    objSplit = findObjectSplit(refs, 0, nPrims, totbb3, centerbb3);
+
+  // spatial split only pays off when the object split children overlap
+  SpatialSplit spSplit;
+  BB3 overlap = objSplit.lftbb3.Intersect(objSplit.rgtbb3);
+  if(!tooDeep && !halve && nPrims > 1 && task.hasFreeRefs() && 
+    (objSplit.bucket == -1 || (overlap.isValid() && overlap.getSurfaceArea() > 
+    params.sbvhOverlapRatio*task.rootArea)))
+    spSplit = findSpatialSplit(refs, totbb3);
+
+  float leafSAH = params.intersectCost*nPrims;
+  float minSAH = std::min(objSplit.cost, spSplit.cost);
+  bool isLeaf = nPrims == 1 || (tooDeep && nPrims <= BVHParams::MaxLeafPrims) ||
+    (nPrims <= params.maxPrimsInNode && minSAH >= leafSAH) ||
+    (objSplit.bucket == -1 && spSplit.cost == FLOAT_MAX && 
+    nPrims <= BVHParams::MaxLeafPrims && 
+    (centerSplit || nPrims <= params.maxPrimsInNode));
+  if(isLeaf) {
+    node->offset = task.addLeaf(refs);
+    return node;
+  }
+
+  std::vector<BuildPrim> lftRefs, rgtRefs;
+  if(spSplit.cost < objSplit.cost) {
+    int axis = spSplit.axis;
+    float pos = spSplit.pos;
+    for(const BuildPrim& ref: refs) {
+      if(ref.bb3.getMax()[axis] <= pos) {lftRefs.push_back(ref); continue;}
+      if(ref.bb3.getMin()[axis] >= pos) {rgtRefs.push_back(ref); continue;}
+      BuildPrim lftRef = ref, rgtRef = ref;
+      lftRef.bb3 = clipRef(ref, axis, totbb3.getMin()[axis], pos);
+      rgtRef.bb3 = clipRef(ref, axis, pos, totbb3.getMax()[axis]);
+      lftRef.center = lftRef.bb3.getCenter();
+      rgtRef.center = rgtRef.bb3.getCenter();
+      // the clipped part may be empty though the bound straddles
+      if(!lftRef.bb3.isValid()) rgtRefs.push_back(rgtRef);
+      else if(!rgtRef.bb3.isValid()) lftRefs.push_back(lftRef);
+      else if(task.acquireRef()) {
+        lftRefs.push_back(lftRef);
+        rgtRefs.push_back(rgtRef);
+      }
+      else if(ref.center[axis] < pos) lftRefs.push_back(ref);
+      else rgtRefs.push_back(ref);
+    }
+    node->axis = axis;
+  }
+  if(lftRefs.empty() || rgtRefs.empty()) {
+    lftRefs.clear();
+    rgtRefs.clear();
+    int mid = nPrims/2;
+    if(objSplit.bucket != -1) {
+      mid = std::partition(refs.begin(), refs.end(),
+        [&](const BuildPrim& ref){return objSplit.isLeft(ref);}) - refs.begin();
+      node->axis = objSplit.axis;
+    }
+    else { // median split
+      int axis = centerbb3.getMaxAxis();
+      std::nth_element(refs.begin(), refs.begin() + mid, refs.end(),
+        [axis](const BuildPrim& a, const BuildPrim& b){
+          return a.center[axis] < b.center[axis];
+        });
+      node->axis = axis;
+    }
+    lftRefs.assign(refs.begin(), refs.begin() + mid);
+    rgtRefs.assign(refs.begin() + mid, refs.end());
+  }
+  std::vector<BuildPrim>().swap(refs); // free before going deeper
+
+  if(nPrims >= params.parallelThreshold && task.acquireThread()) {
+    std::thread lftThread([&](){
+      node->lft = buildSBVHRecursive(task, lftRefs, deep+1);
+    });
+    node->rgt = buildSBVHRecursive(task, rgtRefs, deep+1);
+    lftThread.join();
+    task.releaseThread();
   }
   else {
-    bvhNodes.push_back({totbb3, start, nPrims, -1, -1}); // leaf node
-    return bvhNodes.size() - 1;
+    node->lft = buildSBVHRecursive(task, lftRefs, deep+1);
+    node->rgt = buildSBVHRecursive(task, rgtRefs, deep+1);
+  }
+  return node;
+}
+
+// depth first, to keep root nodepos 0 and make leftson be the next
+int BVH::flatten(const BuildNode* node) {
+  int nodePos = bvhNodes.size();
+  if(!node->lft) {
+    bvhNodes.push_back({node->bb3, node->offset, 
+      (unsigned short)node->_size, 0});
+    return nodePos;
+  }
+  bvhNodes.push_back({node->bb3, -1, 0, (unsigned short)node->axis});
+  flatten(node->lft);
+  int rgtPos = flatten(node->rgt); // may reallocate bvhNodes
+  bvhNodes[nodePos].offset = rgtPos;
+  return nodePos;
+}
+
+void BVH::refitNode(int nIdx) {
+  BVHNode& node = bvhNodes[nIdx];
+  if(node.isLeaf()) {
+    node.bb3 = BB3();
+    for(int i = node.offset; i<node.offset+node._size; i++) {
+      int primIdx = BVHLeafGroup::primIdx(
+        leafGroups[i/BVHLeafGroup::Width].id[i%BVHLeafGroup::Width]);
+      setLeafPrim(i, primIdx); // triangles may have moved
+      node.bb3.Union_(prims[primIdx]->getBB3());
+    }
+  }
+  else node.bb3 = bvhNodes[nIdx+1].bb3.Union(bvhNodes[node.offset].bb3);
+}
+
+// a subtree is a continuous range of the depth first nodes, so the tree
+// is cut into subtrees refitted backward in parallel, then the upper nodes
+void BVH::refit() {
+  if(bvhNodes.empty()) return;
+  int threadNum = getThreadNum(params);
+  int nNodes = bvhNodes.size();
+  int maxSubtreeNodes = std::max(nNodes/(threadNum*4), 1);
+
+  std::vector<int> upper, subtrees, subtreeEnds;
+  std::vector<int> todo{0};
+  while(!todo.empty()) {
+    int nIdx = todo.back(); todo.pop_back();
+    int end = nIdx; // the last node of the subtree is its rightmost leaf
+    while(!bvhNodes[end].isLeaf()) end = bvhNodes[end].offset;
+    if(end + 1 - nIdx <= maxSubtreeNodes) {
+      subtrees.push_back(nIdx);
+      subtreeEnds.push_back(end + 1);
+      continue;
+    }
+    upper.push_back(nIdx);
+    todo.push_back(nIdx + 1);
+    todo.push_back(bvhNodes[nIdx].offset);
   }
+
+  int nSubtree = subtrees.size();
+  std::atomic<int> nextSubtree(0);
+  parallelFor(std::min(threadNum, nSubtree), [&](int) {
+    int i;
+    while((i = nextSubtree.fetch_add(1)) < nSubtree) {
+      for(int nIdx = subtreeEnds[i]-1; nIdx>=subtrees[i]; nIdx--) 
+        refitNode(nIdx);
+    }
+  });
+  // children are pushed after their parent
+  for(int i = upper.size()-1; i>=0; i--) refitNode(upper[i]);
 }
 
-void BVH::intersect(const Ray& ray, Intersection& itsc, 
-  int nIdx, const Primitive* prim) const{
+namespace {
+
+constexpr int LeafWidth = BVHLeafGroup::Width;
+
+// the ray broadcast once per leaf
+struct LeafRay {
+#ifdef YCR_SSE_LEAF
+  __m128 o[3], d[3];
+  LeafRay(const Ray& ray) {
+    for(int i = 0; i<3; i++) {
+      o[i] = _mm_set1_ps(ray.o[i]);
+      d[i] = _mm_set1_ps(ray.d[i]);
+    }
+  }
+#else
+  LeafRay(const Ray& ray) {}
+#endif
+};
+
+#ifdef YCR_SSE_LEAF
+// Triangle::intersectEdges for the 4 lanes, every operation is in the
+// same order so the results are the same bit by bit. return the mask
+// of lanes with t >= CUSTOM_EPSILON, NaN lanes fail the comparisons
+inline int intersectGroup(const BVHLeafGroup& g, const LeafRay& r, 
+  float* tOut, float* uOut, float* vOut) {
+  __m128 e1[3], e2[3], tvec[3];
+  for(int i = 0; i<3; i++) {
+    e1[i] = _mm_loadu_ps(g.e1[i]);
+    e2[i] = _mm_loadu_ps(g.e2[i]);
+    tvec[i] = _mm_sub_ps(r.o[i], _mm_loadu_ps(g.v0[i]));
+  }
+  #define CROSS(a, b, i, j) _mm_sub_ps(_mm_mul_ps(a[i], b[j]), _mm_mul_ps(b[i], a[j]))
+  #define DOT(a, b) _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), \
+    _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]))
+  __m128 pvec[3] = {CROSS(r.d, e2, 1, 2), CROSS(r.d, e2, 2, 0), CROSS(r.d, e2, 0, 1)};
+  __m128 det = DOT(e1, pvec);
+  __m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+  __m128 eps = _mm_set1_ps(CUSTOM_EPSILON);
+  __m128 ok = _mm_cmpge_ps(absDet, eps);
+  int mask = _mm_movemask_ps(ok);
+  if(!mask) return 0;
 
-  const BVHNode& curNode = bvhNodes[nIdx];
-  float tMin, tMax;
-  if(curNode.bb3.intersect(ray, tMin, tMax)) {
-    if(itsc.t < tMin) return;
-    if(curNode.lft == -1 && curNode.rgt == -1) { //leaf
-      for(unsigned int i=curNode.offset; i<curNode.offset+curNode._size; i++) {
-        if(prims[i] == prim) continue;
-        prims[i]->intersect(ray, itsc);
+  __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+  __m128 invDet = _mm_div_ps(one, det);
+  __m128 u = _mm_mul_ps(DOT(tvec, pvec), invDet);
+  ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+  __m128 qvec[3] = {CROSS(tvec, e1, 1, 2), CROSS(tvec, e1, 2, 0), CROSS(tvec, e1, 0, 1)};
+  __m128 v = _mm_mul_ps(DOT(r.d, qvec), invDet);
+  ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpge_ps(v, zero), 
+    _mm_cmple_ps(_mm_add_ps(u, v), one)));
+  __m128 t = _mm_mul_ps(DOT(e2, qvec), invDet);
+  ok = _mm_and_ps(ok, _mm_cmpge_ps(t, eps));
+  #undef CROSS
+  #undef DOT
+  _mm_storeu_ps(tOut, t);
+  _mm_storeu_ps(uOut, u);
+  _mm_storeu_ps(vOut, v);
+  return _mm_movemask_ps(ok);
+}
+#else
+inline int intersectGroup(const BVHLeafGroup& g, const Ray& ray, 
+  float* tOut, float* uOut, float* vOut) {
+  int mask = 0;
+  for(int k = 0; k<LeafWidth; k++) {
+    glm::vec3 v0(g.v0[0][k], g.v0[1][k], g.v0[2][k]);
+    glm::vec3 e1(g.e1[0][k], g.e1[1][k], g.e1[2][k]);
+    glm::vec3 e2(g.e2[0][k], g.e2[1][k], g.e2[2][k]);
+    glm::vec2 uv;
+    if(Triangle::intersectEdges(ray, v0, e1, e2, tOut[k], uv)) {
+      uOut[k] = uv[0]; vOut[k] = uv[1];
+      mask |= 1<<k;
+    }
+  }
+  return mask;
+}
+#endif
+
+inline int intersectGroup(const BVHLeafGroup& g, const Ray& ray, 
+  const LeafRay& r, float* t, float* u, float* v) {
+#ifdef YCR_SSE_LEAF
+  return intersectGroup(g, r, t, u, v);
+#else
+  return intersectGroup(g, ray, t, u, v);
+#endif
+}
+
+// sign bits of the ids
+inline int otherPrimMask(const BVHLeafGroup& g) {
+  int mask = 0;
+  for(int k = 0; k<LeafWidth; k++) mask |= (g.id[k] < 0)<<k;
+  return mask;
+}
+
+}
+
+// the lanes are visited in order and t must be strictly smaller, so 
+// among equal t the first lane wins as in a loop over the prims
+void BVH::intersectLeaf(const Ray& ray, HitRecord& hit, 
+  int start, int count, const Primitive* prim, float tMin) const {
+  LeafRay r(ray);
+  float t[LeafWidth], u[LeafWidth], v[LeafWidth];
+  for(int lane = start; lane<start+count; lane += LeafWidth) {
+    const BVHLeafGroup& g = leafGroups[lane/LeafWidth];
+    int valid = (1<<std::min(start+count-lane, LeafWidth)) - 1;
+    int mask = intersectGroup(g, ray, r, t, u, v) & valid;
+    int best = -1;
+    while(mask) {
+      int k = __builtin_ctz(mask);
+      mask &= mask - 1;
+      if(t[k] < tMin || t[k] >= hit.t || (best >= 0 && t[k] >= t[best])) 
+        continue;
+      if(prim && prims[g.id[k]] == prim) continue;
+      best = k;
+    }
+    if(best >= 0) 
+      hit.update(t[best], prims[g.id[best]], {u[best], v[best]});
+    int others = otherPrimMask(g) & valid;
+    while(others) {
+      int k = __builtin_ctz(others);
+      others &= others - 1;
+      if(prims[~g.id[k]] == prim) continue;
+      prims[~g.id[k]]->intersect(ray, hit, tMin);
+    }
+  }
+}
+
+bool BVH::intersectTestLeaf(const Ray& ray, int start, int count, 
+  const Primitive* prim, float tMin, float tMax) const {
+  LeafRay r(ray);
+  float t[LeafWidth], u[LeafWidth], v[LeafWidth];
+  for(int lane = start; lane<start+count; lane += LeafWidth) {
+    const BVHLeafGroup& g = leafGroups[lane/LeafWidth];
+    int valid = (1<<std::min(start+count-lane, LeafWidth)) - 1;
+    int mask = intersectGroup(g, ray, r, t, u, v) & valid;
+    while(mask) {
+      int k = __builtin_ctz(mask);
+      mask &= mask - 1;
+      if(t[k] < tMin || t[k] >= tMax) continue;
+      if(prim && prims[g.id[k]] == prim) continue;
+      return true;
+    }
+    int others = otherPrimMask(g) & valid;
+    while(others) {
+      int k = __builtin_ctz(others);
+      others &= others - 1;
+      if(prims[~g.id[k]] == prim) continue;
+      if(prims[~g.id[k]]->intersectTest(ray, tMin, tMax)) return true;
+    }
+  }
+  return false;
+}
+
+// iterative, nearer child first. invDir and the sign of the direction
+// are calculated once for the whole traversal
+void BVH::intersect(const Ray& ray, HitRecord& hit, 
+  const Primitive* prim, float tMin) const{
+
+  if(bvhNodes.empty()) return;
+  glm::vec3 invDir = 1.0f/ray.d;
+  int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+  int stack[BVHParams::MaxStackDeep];
+  int sp = 0, nIdx = 0;
+
+  while(true) {
+    const BVHNode& curNode = bvhNodes[nIdx];
+    if(curNode.bb3.intersect(ray, invDir, dirIsNeg, hit.t)) {
+      if(curNode.isLeaf()) {
+        intersectLeaf(ray, hit, curNode.offset, curNode._size, prim, tMin);
+        if(sp == 0) break;
+        nIdx = stack[--sp];
+      }
+      else if(dirIsNeg[curNode.axis]) {
+        stack[sp++] = nIdx + 1;
+        nIdx = curNode.offset;
+      }
+      else {
+        stack[sp++] = curNode.offset;
+        nIdx = nIdx + 1;
       }
     }
     else {
-      intersect(ray, itsc, curNode.lft, prim);
-      intersect(ray, itsc, curNode.rgt, prim);
+      if(sp == 0) break;
+      nIdx = stack[--sp];
     }
   }
 } 
 
-bool BVH::intersectTest(const Ray& ray, int nIdx, const Primitive* prim) const{
-  const BVHNode& curNode = bvhNodes[nIdx];
-  float tMin, tMax;
-  if(curNode.bb3.intersect(ray, tMin, tMax)) {
-    if(curNode.lft == -1 && curNode.rgt == -1) { //leaf
-      for(unsigned int i=curNode.offset; i<curNode.offset+curNode._size; i++) {
-        if(prims[i] == prim) continue;
-        if(prims[i]->intersectTest(ray)) return true;
-      } 
+namespace {
+
+// bounds of the packet origins and 1/d, a node is culled for the whole
+// packet by interval arithmetic on the slab distances. only valid if
+// every axis has finite 1/d of one sign, true for camera ray tiles
+struct PacketInterval {
+  glm::vec3 oMin, oMax, invMin, invMax;
+  bool valid = true;
+
+  PacketInterval(const Ray* rays, const glm::vec3* invDir, int n):
+    oMin(FLOAT_MAX), oMax(-FLOAT_MAX), invMin(FLOAT_MAX), invMax(-FLOAT_MAX) {
+    for(int i = 0; i<n; i++) {
+      oMin = glm::min(oMin, rays[i].o);
+      oMax = glm::max(oMax, rays[i].o);
+      invMin = glm::min(invMin, invDir[i]);
+      invMax = glm::max(invMax, invDir[i]);
+    }
+    for(int axis = 0; axis<3; axis++) {
+      if(!(invMax[axis] < FLOAT_INF && invMin[axis] > -FLOAT_INF) || 
+        (invMin[axis] < 0.0f && invMax[axis] > 0.0f)) valid = false;
+    }
+  }
+
+  // rounding is monotonic, so the corner products bound the products
+  // of every ray and the test never culls a box BB3::intersect hits
+  bool mayHit(const BB3& bb3, float tLimit) const {
+    float tMin = 0.0f, tMax = tLimit;
+    glm::vec3 pMin = bb3.getMin(), pMax = bb3.getMax();
+    for(int axis = 0; axis<3; axis++) {
+      bool neg = invMax[axis] < 0.0f;
+      float nearP = neg ? pMax[axis] : pMin[axis];
+      float farP = neg ? pMin[axis] : pMax[axis];
+      float n0 = nearP - oMax[axis], n1 = nearP - oMin[axis];
+      float f0 = farP - oMax[axis], f1 = farP - oMin[axis];
+      float t1 = std::min(std::min(n0*invMin[axis], n0*invMax[axis]), 
+        std::min(n1*invMin[axis], n1*invMax[axis]));
+      float t2 = std::max(std::max(f0*invMin[axis], f0*invMax[axis]), 
+        std::max(f1*invMin[axis], f1*invMax[axis]));
+      t2 *= 1.0f + 2.0f*_Gamma(3);
+      if(t1 > tMin) tMin = t1;
+      if(t2 < tMax) tMax = t2;
+    }
+    return tMin <= tMax;
+  }
+};
+
+}
+
+// depth first with the first active ray: the rays before it missed an
+// ancestor, so they miss the node too. the node is culled by the packet
+// interval first, then the first ray that hits it decides the order of
+// the children
+void BVH::intersectPacket(
+  const Ray* rays, int n, HitRecord* hits) const {
+
+  if(bvhNodes.empty() || n <= 0) return;
+  if(n > RayPacket::MaxSize) {
+    intersectPacket(rays, RayPacket::MaxSize, hits);
+    intersectPacket(rays + RayPacket::MaxSize, 
+      n - RayPacket::MaxSize, hits + RayPacket::MaxSize);
+    return;
+  }
+  glm::vec3 invDir[RayPacket::MaxSize];
+  int dirIsNeg[RayPacket::MaxSize][3];
+  float packetT = 0.0f; // the largest hit.t of the packet
+  for(int i = 0; i<n; i++) {
+    invDir[i] = 1.0f/rays[i].d;
+    for(int axis = 0; axis<3; axis++) dirIsNeg[i][axis] = invDir[i][axis] < 0;
+    packetT = std::max(packetT, hits[i].t);
+  }
+  PacketInterval interval(rays, invDir, n);
+
+  struct StackItem {int node, first;};
+  StackItem stack[BVHParams::MaxStackDeep];
+  int sp = 0;
+  StackItem cur = {0, 0};
+
+  while(true) {
+    const BVHNode& curNode = bvhNodes[cur.node];
+    int first = n;
+    if(!interval.valid || interval.mayHit(curNode.bb3, packetT)) {
+      for(first = cur.first; first<n; first++) {
+        if(curNode.bb3.intersect(rays[first], invDir[first], 
+          dirIsNeg[first], hits[first].t)) break;
+      }
+    }
+    if(first < n && curNode.isLeaf()) {
+      intersectLeaf(rays[first], hits[first], 
+        curNode.offset, curNode._size, nullptr);
+      for(int i = first+1; i<n; i++) {
+        if(!curNode.bb3.intersect(rays[i], invDir[i], dirIsNeg[i], hits[i].t)) 
+          continue;
+        intersectLeaf(rays[i], hits[i], curNode.offset, curNode._size, nullptr);
+      }
+      packetT = 0.0f;
+      for(int i = 0; i<n; i++) packetT = std::max(packetT, hits[i].t);
+    }
+    else if(first < n) {
+      int rgt = curNode.offset, lft = cur.node + 1;
+      bool rgtFirst = dirIsNeg[first][curNode.axis];
+      stack[sp++] = {rgtFirst ? lft : rgt, first};
+      cur = {rgtFirst ? rgt : lft, first};
+      continue;
+    }
+    if(sp == 0) break;
+    cur = stack[--sp];
+  }
+}
+
+namespace {
+
+// a ray in flight of the stream traversal
+struct StreamRay {
+  int idx; // in the batch, -1 if the slot is free
+  int node, sp;
+  bool leafPending; // node is a hit leaf, its prims are being prefetched
+  glm::vec3 invDir;
+  int dirIsNeg[3];
+  int stack[BVHParams::MaxStackDeep];
+
+  void start(int i, const Ray& ray) {
+    idx = i; node = 0; sp = 0;
+    leafPending = false;
+    invDir = 1.0f/ray.d;
+    for(int axis = 0; axis<3; axis++) dirIsNeg[axis] = invDir[axis] < 0;
+  }
+  inline bool pop() {
+    if(sp == 0) return false;
+    node = stack[--sp];
+    return true;
+  }
+};
+
+inline void prefetch(const void* p) {__builtin_prefetch(p);}
+
+}
+
+// one step of a ray is one node, the data of the step after it is
+// prefetched while the other rays do their steps
+template<bool AnyHit>
+void BVH::traverseStream(const Ray* rays, int n, HitRecord* hits, 
+  const float* tMaxs, bool* anyHits, const Primitive* const* prims) const {
+
+  if(AnyHit) for(int i = 0; i<n; i++) anyHits[i] = false;
+  if(bvhNodes.empty() || n <= 0) return;
+  StreamRay ctx[StreamWidth];
+  int nextRay = 0, active = 0;
+  for(int c = 0; c<StreamWidth; c++) {
+    ctx[c].idx = -1;
+    if(nextRay < n) {
+      ctx[c].start(nextRay, rays[nextRay]);
+      nextRay++; active++;
+    }
+  }
+
+  for(int c = 0; active > 0; c = (c+1)%StreamWidth) {
+    StreamRay& cur = ctx[c];
+    if(cur.idx < 0) continue;
+    // the slice works on locals, the context is only written back
+    const int idx = cur.idx;
+    const Ray& ray = rays[idx];
+    const Primitive* prim = prims ? prims[idx] : nullptr;
+    const glm::vec3 invDir = cur.invDir;
+    int nIdx = cur.node, sp = cur.sp;
+    bool leafPending = cur.leafPending, alive = true;
+    // the first child is the next node and is likely in cache already, 
+    // so the ray only yields when it jumps
+    while(true) {
+      const BVHNode& node = bvhNodes[nIdx];
+      if(leafPending) {
+        leafPending = false;
+        if(AnyHit) {
+          if(intersectTestLeaf(ray, node.offset, node._size, 
+            prim, 0.0f, tMaxs[idx])) {
+            anyHits[idx] = true;
+            alive = false;
+            break;
+          }
+        }
+        else intersectLeaf(ray, hits[idx], node.offset, node._size, prim);
+        if(sp == 0) {alive = false; break;}
+        nIdx = cur.stack[--sp];
+        break;
+      }
+      float tLimit = AnyHit ? tMaxs[idx] : hits[idx].t;
+      if(!node.bb3.intersect(ray, invDir, cur.dirIsNeg, tLimit)) {
+        if(sp == 0) {alive = false; break;}
+        nIdx = cur.stack[--sp];
+        break;
+      }
+      if(node.isLeaf()) {
+        const char* group = 
+          (const char*)&leafGroups[node.offset/BVHLeafGroup::Width];
+        for(unsigned int b = 0; b<sizeof(BVHLeafGroup); b += 64) 
+          prefetch(group + b);
+        leafPending = true;
+        break;
+      }
+      if(cur.dirIsNeg[node.axis]) {
+        cur.stack[sp++] = nIdx + 1;
+        nIdx = node.offset;
+        break;
+      }
+      cur.stack[sp++] = node.offset;
+      nIdx = nIdx + 1;
+    }
+
+    if(!alive) {
+      cur.idx = -1;
+      active--;
+      if(nextRay == n) continue;
+      cur.start(nextRay, rays[nextRay]);
+      nextRay++; active++;
+      prefetch(&bvhNodes[0]);
+      continue;
+    }
+    cur.node = nIdx;
+    cur.sp = sp;
+    cur.leafPending = leafPending;
+    if(!leafPending) prefetch(&bvhNodes[nIdx]);
+  }
+}
+
+void BVH::intersectStream(const Ray* rays, int n, HitRecord* hits, 
+  const Primitive* const* prims) const {
+  traverseStream<false>(rays, n, hits, nullptr, nullptr, prims);
+}
+
+void BVH::intersectTestStream(const Ray* rays, int n, const float* tMaxs, 
+  bool* hits, const Primitive* const* prims) const {
+  traverseStream<true>(rays, n, nullptr, tMaxs, hits, prims);
+}
+
+bool BVH::intersectTest(const Ray& ray, const Primitive* prim, 
+  float tMin, float tMax) const{
+
+  if(bvhNodes.empty()) return false;
+  glm::vec3 invDir = 1.0f/ray.d;
+  int dirIsNeg[3] = {invDir.x < 0, invDir.y < 0, invDir.z < 0};
+  int stack[BVHParams::MaxStackDeep];
+  int sp = 0, nIdx = 0;
+
+  while(true) {
+    const BVHNode& curNode = bvhNodes[nIdx];
+    if(curNode.bb3.intersect(ray, invDir, dirIsNeg, tMax)) {
+      if(curNode.isLeaf()) {
+        if(intersectTestLeaf(ray, curNode.offset, curNode._size, 
+          prim, tMin, tMax)) return true;
+        if(sp == 0) break;
+        nIdx = stack[--sp];
+      }
+      else if(dirIsNeg[curNode.axis]) {
+        stack[sp++] = nIdx + 1;
+        nIdx = curNode.offset;
+      }
+      else {
+        stack[sp++] = curNode.offset;
+        nIdx = nIdx + 1;
+      }
+    }
+    else {
+      if(sp == 0) break;
+      nIdx = stack[--sp];
     }
-    else return intersectTest(ray, curNode.lft, prim) || 
-                intersectTest(ray, curNode.rgt, prim);
   }
   return false;
 }
 
 void BVH::generatePointCloud(PCShower& pc) {
-  int nPrim = prims.size();
-  for(BVHNode& node: bvhNodes) {
+  int nPrim = 0;
+  for(const BVHNode& node: bvhNodes) if(node.isLeaf()) nPrim += node._size;
+  // children are always behind their parent, so count prims backward
+  std::vector<int> subtreePrims(bvhNodes.size());
+  for(int i = bvhNodes.size()-1; i>=0; i--) {
+    const BVHNode& node = bvhNodes[i];
+    subtreePrims[i] = node.isLeaf() ? 
+      node._size : subtreePrims[i+1] + subtreePrims[node.offset];
+  }
+  for(unsigned int i = 0; i<bvhNodes.size(); i++) {
     glm::vec3 cs[8];
-    node.bb3.get8Cornor(cs);
-    float col = powf(1.0f*node._size/nPrim, 0.4f);
+    bvhNodes[i].bb3.get8Cornor(cs);
+    float col = powf(1.0f*subtreePrims[i]/nPrim, 0.4f);
     for(int i=0; i<8; i++)
       pc.addItem(cs[i], glm::vec3(col));
   }
@@ -132,21 +1260,21 @@ bool BVH::occlude(const Intersection& it1, const Intersection& it2,
   glm::vec3 dir = it2.itscVtx.position - it1.itscVtx.position;
   rayLen = glm::length(dir);
   testRay.d = glm::normalize(dir);
-  Intersection itsc;
-  itsc.t = rayLen;
-  //intersect(testRay, itsc, 0, it1.prim); 
-  intersect(testRay, itsc, 0, it2.prim); 
-
-  // for debug
-  if(itsc.prim && itsc.t < 1e-4f) {
-    //std::cout<<"Detect very near itsc"<<std::endl;
-  }
-
-  if(itsc.prim) return true;
-  //if(itsc.prim && itsc.prim != it2.prim) return true;
-  return false;
+  return intersectTest(testRay, it2.prim, 0.0f, rayLen);
 }
 
 BB3 BVH::getWholeBound() const{
   return bvhNodes[0].bb3;
-} 
+}
+
+float BVH::getSAHCost() const {
+  if(bvhNodes.empty()) return 0.0f;
+  float cost = 0.0f;
+  float invArea = 1.0f/bvhNodes[0].bb3.getSurfaceArea();
+  for(const BVHNode& node: bvhNodes) {
+    float prob = node.bb3.getSurfaceArea()*invArea;
+    if(node.isLeaf()) cost += prob*params.intersectCost*node._size;
+    else cost += prob*params.traversalCost;
+  }
+  return cost;
+}
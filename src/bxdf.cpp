@@ -1,14 +1,17 @@
 #include "bxdf.hpp"
 #include "sampler.hpp"
+#include "shadingProgram.hpp"
+
+#include <iostream>
 
 glm::vec3 LambertianReflection::evaluate(
-  const Intersection& itsc, const Ray& ray_o, const Ray& ray_i) const {
+  const ShadingPoint& itsc, const Ray& ray_o, const Ray& ray_i) const {
   float cosTheta = glm::max(0.0f, itsc.itscVtx.cosTheta(ray_i.d));
   return cosTheta * INV_PI*texture->tex2D(itsc.itscVtx.uv);
 }
 
 glm::vec3 LambertianReflection::sample_ev(
-  const Intersection& itsc, const Ray& ray_o, Ray& ray_i) const {
+  const ShadingPoint& itsc, const Ray& ray_o, Ray& ray_i) const {
   glm::vec2 dir_i = _ThreadSampler.uniSampleDisk();
   glm::vec3 tanp(
     dir_i.x*glm::cos(dir_i.y), 
@@ -20,19 +23,19 @@ glm::vec3 LambertianReflection::sample_ev(
 }
 
 float LambertianReflection::sample_pdf(
-  const Intersection& itsc, const Ray& ray_i, const Ray& ray_o) const {
+  const ShadingPoint& itsc, const Ray& ray_i, const Ray& ray_o) const {
   return INV_PI*glm::max(0.0f, itsc.itscVtx.cosTheta(ray_i.d));
 }
 
 glm::vec3 PerfectSpecular::sample_ev(
-  const Intersection& itsc, const Ray& ray_o, Ray& ray_i) const {
+  const ShadingPoint& itsc, const Ray& ray_o, Ray& ray_i) const {
   ray_i.o = itsc.itscVtx.position;
   ray_i.d = Reflect(ray_o.d, itsc.itscVtx.normal);
   return absorb->tex2D(itsc.itscVtx.uv);
 }
 
 glm::vec3 PerfectTransimission::sample_ev(
-  const Intersection& itsc, const Ray& ray_o, Ray& ray_i) const {
+  const ShadingPoint& itsc, const Ray& ray_o, Ray& ray_i) const {
   ray_i.o = itsc.itscVtx.position;
   float cIOR = itsc.normalReverse?1.0f/IOR:IOR;
   bool res = Refract(ray_o.d, itsc.itscVtx.normal, cIOR, ray_i.d);
@@ -53,23 +56,48 @@ float normalDistribution(float normalTangent2, float alpha) {
   float tmp = alpha*normalCos2*(1+normalTangent2/(alpha*alpha));
   return 1.0f / (PI*tmp*tmp);
 }
-void sampleNormal(float alpha, float& phi, float& tan2Theta) {
-  phi = PI2*_ThreadSampler.get1();
-  float u2 = _ThreadSampler.get1();
-  tan2Theta = u2*alpha*alpha/(1-u2);
+// visible normal of the view direction w in tangent space (w.z > 0),
+// Heitz 2018, "Sampling the GGX Distribution of Visible Normals".
+// pdf(wh) = G1(w)*max(0, dot(w, wh))*D(wh)/cos(w)
+glm::vec3 sampleVisibleNormal(glm::vec3 w, float alpha) {
+  // to the hemisphere configuration
+  glm::vec3 vh = glm::normalize(glm::vec3(alpha*w.x, alpha*w.y, w.z));
+  float lensq = vh.x*vh.x+vh.y*vh.y;
+  glm::vec3 t1 = lensq > 0.0f ? 
+    glm::vec3(-vh.y, vh.x, 0.0f)/glm::sqrt(lensq) : glm::vec3(1.0f, 0.0f, 0.0f);
+  glm::vec3 t2 = glm::cross(vh, t1);
+  // disk point, warped to the projected area of the hemisphere
+  float r = glm::sqrt(_ThreadSampler.get1());
+  float phi = PI2*_ThreadSampler.get1();
+  float p1 = r*glm::cos(phi), p2 = r*glm::sin(phi);
+  float s = 0.5f*(1.0f+vh.z);
+  p2 = (1.0f-s)*glm::sqrt(glm::max(0.0f, 1.0f-p1*p1)) + s*p2;
+  glm::vec3 nh = p1*t1 + p2*t2 + 
+    glm::sqrt(glm::max(0.0f, 1.0f-p1*p1-p2*p2))*vh;
+  // back to the ellipsoid configuration
+  return glm::normalize(
+    glm::vec3(alpha*nh.x, alpha*nh.y, glm::max(1e-6f, nh.z)));
 }
 float maskShadow(float tan2Theta, float alpha) {
   return 0.5f*(-1+glm::sqrt(1+alpha*alpha*tan2Theta));
 }
+// the half vector of a refraction, on the side of normal. 
+// cIOR is the relative IOR of the side of ray_i, see Refract
+inline glm::vec3 refractHalfVector(
+  const ShadingPoint& itsc, glm::vec3 dir_o, glm::vec3 dir_i, float cIOR) {
+  glm::vec3 wh = glm::normalize(dir_i*cIOR+dir_o);
+  return itsc.itscVtx.cosTheta(wh) < 0.0f ? -wh : wh;
+}
 /********************************************************/
 
 glm::vec3 GGXReflection::evaluate(
-  const Intersection& itsc, const Ray& ray_o, const Ray& ray_i) const {
+  const ShadingPoint& itsc, const Ray& ray_o, const Ray& ray_i) const {
   float alpha = roughnessToAlpha(roughness->tex2D(itsc.itscVtx.uv).x);
   float tan2ThetaI = glm::max(0.0f, itsc.itscVtx.tan2Theta(ray_i.d));
   float tan2ThetaO = glm::max(0.0f, itsc.itscVtx.tan2Theta(ray_o.d));
   float G = 1.0f/(1.0f+maskShadow(tan2ThetaI, alpha)+maskShadow(tan2ThetaO, alpha));
   glm::vec3 wh = glm::normalize(ray_i.d+ray_o.d);
+  if(itsc.itscVtx.cosTheta(wh) <= 0.0f) return glm::vec3(0.0f);
   float tan2ThetaWh = glm::max(0.0f, itsc.itscVtx.tan2Theta(wh));
   float normalDistr = normalDistribution(tan2ThetaWh, alpha);
   float cosThetaO = itsc.itscVtx.cosTheta(ray_o.d);
@@ -77,23 +105,18 @@ glm::vec3 GGXReflection::evaluate(
   return normalDistr*G/(4.0f*cosThetaO)*albedo->tex2D(itsc.itscVtx.uv);
 }
 
-// !!we sample D(wh), and must transform it to wi(pdf from half angle to solid angle)
-// pdf(wh) = D(wh)*cos(wh)
-// pdf(wo) = pdf(wh) / (4cos(wh, wi))
-// brdf*cos(wi)/pdf = D(wh)*G*Fr/(4cos(i,n)*cos(o,n)) * cos(i,n) /(D(wh)cos(wh,n)/4cos(wh, wi))
-// == G*Fr*cos(wh,i)/(cos(wh,n)*cos(o,n))
+// we sample the visible normals of wo, 
+// pdf(wh) = G1(wo)*D(wh)*cos(wh, wo)/cos(wo, n)
+// pdf(wi) = pdf(wh) / (4cos(wh, wo)) = G1(wo)*D(wh)/(4cos(wo, n))
+// brdf*cos(wi)/pdf = D(wh)*G*Fr/(4cos(o,n)) / (G1(wo)*D(wh)/(4cos(o,n)))
+// == G*Fr/G1(wo)
 glm::vec3 GGXReflection::sample_ev(
-  const Intersection& itsc, const Ray& ray_o, Ray& ray_i) const {
-  float phi, tan2Theta;
+  const ShadingPoint& itsc, const Ray& ray_o, Ray& ray_i) const {
+  float cosThetaO = itsc.itscVtx.cosTheta(ray_o.d);
+  if(cosThetaO <= 0.0f) return glm::vec3(0.0f);
   float alpha = roughnessToAlpha(roughness->tex2D(itsc.itscVtx.uv).x);
-  sampleNormal(alpha, phi, tan2Theta);
-  float cos2Theta = 1.0f/(1.0f+tan2Theta);
-  float sinTheta = glm::sqrt(glm::max(0.0f, 1.0f - cos2Theta));
-  glm::vec3 tanp(
-    sinTheta*glm::cos(phi), 
-    sinTheta*glm::sin(phi),
-    glm::sqrt(cos2Theta));
-  glm::vec3 wh = itsc.toWorldSpace(tanp);
+  glm::vec3 wh = itsc.toWorldSpace(sampleVisibleNormal(
+    itsc.itscVtx.toTangentSpace(ray_o.d), alpha));
   glm::vec3 refl = Reflect(ray_o.d, wh);
   ray_i.o = itsc.itscVtx.position;
   ray_i.d = refl;
@@ -101,95 +124,90 @@ glm::vec3 GGXReflection::sample_ev(
   if(itsc.cosTheta(refl) <= 0.0f) return glm::vec3(0.0f);
   float tan2ThetaI = glm::max(0.0f, itsc.itscVtx.tan2Theta(ray_i.d));
   float tan2ThetaO = glm::max(0.0f, itsc.itscVtx.tan2Theta(ray_o.d));
-  float G = 1.0f/(1.0f+maskShadow(tan2ThetaI, alpha)+maskShadow(tan2ThetaO, alpha));
-  float cosThetaO = itsc.itscVtx.cosTheta(ray_o.d);
-  float cosWh = itsc.itscVtx.cosTheta(wh);
-  float cosWhI = glm::max(0.0f, glm::dot(ray_i.d, wh));
-  if(cosThetaO <= 0.0f || cosWh <= 0.0f) return glm::vec3(0.0f);
-  return G*cosWhI/(cosThetaO*cosWh)*albedo->tex2D(itsc.itscVtx.uv); 
+  float lambdaO = maskShadow(tan2ThetaO, alpha);
+  float G = 1.0f/(1.0f+maskShadow(tan2ThetaI, alpha)+lambdaO);
+  return G*(1.0f+lambdaO)*albedo->tex2D(itsc.itscVtx.uv); 
 }
 
-// pdf(wh) = D(wh)*cos(wh)
-// pdf(wo) = pdf(wh) / (4cos(wh, wi))
+// pdf(wi) = G1(wo)*D(wh)/(4cos(wo, n))
 float GGXReflection::sample_pdf(
-  const Intersection& itsc, const Ray& ray_i, const Ray& ray_o) const {
-  float alpha = roughnessToAlpha(roughness->tex2D(itsc.itscVtx.uv).x);
+  const ShadingPoint& itsc, const Ray& ray_i, const Ray& ray_o) const {
+  float cosThetaO = itsc.itscVtx.cosTheta(ray_o.d);
+  if(cosThetaO <= 0.0f) return 0.0f;
   glm::vec3 wh = glm::normalize(ray_i.d+ray_o.d);
+  if(itsc.itscVtx.cosTheta(wh) <= 0.0f) return 0.0f;
+  float alpha = roughnessToAlpha(roughness->tex2D(itsc.itscVtx.uv).x);
   float tan2ThetaWh = glm::max(0.0f, itsc.itscVtx.tan2Theta(wh));
+  float tan2ThetaO = glm::max(0.0f, itsc.itscVtx.tan2Theta(ray_o.d));
   float normalDistr = normalDistribution(tan2ThetaWh, alpha);
-  float cosWh = itsc.itscVtx.cosTheta(wh);
-  float cosWhI = glm::dot(ray_i.d, wh);
-  if(cosWhI <= 0.0f) return 0.0f;
-  return normalDistr*cosWh/(4.0f*cosWhI);
+  return normalDistr/(4.0f*cosThetaO*(1.0f+maskShadow(tan2ThetaO, alpha)));
 }
 
 glm::vec3 GGXTransimission::evaluate(
-  const Intersection& itsc, const Ray& ray_o, const Ray& ray_i) const {
+  const ShadingPoint& itsc, const Ray& ray_o, const Ray& ray_i) const {
   float alpha = roughnessToAlpha(roughness->tex2D(itsc.itscVtx.uv).x);
   float tan2ThetaI = glm::max(0.0f, itsc.itscVtx.tan2Theta(ray_i.d));
   float tan2ThetaO = glm::max(0.0f, itsc.itscVtx.tan2Theta(ray_o.d));
   float G = 1.0f/(1.0f+maskShadow(tan2ThetaI, alpha)+maskShadow(tan2ThetaO, alpha));
   float cIOR = itsc.normalReverse?1.0f/IOR:IOR;
-  glm::vec3 wh = glm::normalize(ray_i.d*cIOR+ray_o.d);
+  glm::vec3 wh = refractHalfVector(itsc, ray_o.d, ray_i.d, cIOR);
   float tan2ThetaWh = glm::max(0.0f, itsc.itscVtx.tan2Theta(wh));
   float normalDistr = normalDistribution(tan2ThetaWh, alpha);
   float cosThetaO = itsc.itscVtx.cosTheta(ray_o.d);
   if(cosThetaO <= 0.0f) return glm::vec3(0.0f);
   float cosWoWh = glm::dot(ray_o.d, wh);
   float cosWiWh = glm::dot(ray_i.d, wh);
+  // wo and wi are on the two sides of the microfacet
+  if(cosWoWh <= 0.0f || cosWiWh >= 0.0f) return glm::vec3(0.0f);
   float tmp = cIOR*cosWiWh+cosWoWh;
   if(tmp == 0.0f) return glm::vec3(0.0f);
   float dwhdwo = cosWiWh*cosWoWh/(cosThetaO*tmp*tmp);
   return cIOR*cIOR*normalDistr*G*glm::abs(dwhdwo)*albedo->tex2D(itsc.itscVtx.uv);
 }
 
+// pdf(wi) = pdf(wh) * dwh/dwi, dwh/dwi = cIOR^2*|cos(wh, wi)|/tmp^2
+// btdf*cos(wi)/pdf == G/G1(wo), the same as GGXReflection
 glm::vec3 GGXTransimission::sample_ev(
-  const Intersection& itsc, const Ray& ray_o, Ray& ray_i) const {
-  float phi, tan2Theta;
+  const ShadingPoint& itsc, const Ray& ray_o, Ray& ray_i) const {
+  float cosThetaO = itsc.itscVtx.cosTheta(ray_o.d);
+  if(cosThetaO <= 0.0f) return glm::vec3(0.0f);
   float alpha = roughnessToAlpha(roughness->tex2D(itsc.itscVtx.uv).x);
-  sampleNormal(alpha, phi, tan2Theta);
-  float cos2Theta = 1.0f/(1.0f+tan2Theta);
-  float sinTheta = glm::sqrt(glm::max(0.0f, 1.0f - cos2Theta));
-  glm::vec3 tanp(
-    sinTheta*glm::cos(phi), 
-    sinTheta*glm::sin(phi),
-    glm::sqrt(cos2Theta));
-  glm::vec3 wh = itsc.toWorldSpace(tanp);
+  glm::vec3 wh = itsc.toWorldSpace(sampleVisibleNormal(
+    itsc.itscVtx.toTangentSpace(ray_o.d), alpha));
   float cIOR = itsc.normalReverse?1.0f/IOR:IOR;
   glm::vec3 refr; 
   if(!Refract(ray_o.d, wh, cIOR, refr)) return glm::vec3(0.0f);
   ray_i.o = itsc.itscVtx.position;
   ray_i.d = refr;
-  glm::vec3 test = glm::normalize(ray_o.d+ray_i.d*cIOR); //
-  float cosWhO = glm::dot(wh, ray_o.d);
-  float cosWhII = glm::dot(wh, ray_i.d);
   // do not point outside surface, compare with geoNormal
   if(itsc.cosTheta(refr) > 0.0f) return glm::vec3(0.0f);
   float tan2ThetaI = glm::max(0.0f, itsc.itscVtx.tan2Theta(ray_i.d));
   float tan2ThetaO = glm::max(0.0f, itsc.itscVtx.tan2Theta(ray_o.d));
-  float G = 1.0f/(1.0f+maskShadow(tan2ThetaI, alpha)+maskShadow(tan2ThetaO, alpha));
-  float cosThetaO = itsc.itscVtx.cosTheta(ray_o.d);
-  float cosWh = itsc.itscVtx.cosTheta(wh);
-  float cosWhI = glm::abs(glm::dot(ray_i.d, wh));
-  if(cosThetaO <= 0.0f || cosWh <= 0.0f) return glm::vec3(0.0f);
-  return G*cosWhI/(cosThetaO*cosWh)*albedo->tex2D(itsc.itscVtx.uv); 
+  float lambdaO = maskShadow(tan2ThetaO, alpha);
+  float G = 1.0f/(1.0f+maskShadow(tan2ThetaI, alpha)+lambdaO);
+  return G*(1.0f+lambdaO)*albedo->tex2D(itsc.itscVtx.uv); 
 }
 
-// pdf(wh) = D(wh)*cos(wh)
-// pdf(wo) = pdf(wh) / (4cos(wh, wi))
+// pdf(wh) = G1(wo)*D(wh)*cos(wh, wo)/cos(wo, n)
+// pdf(wi) = pdf(wh) * cIOR^2*|cos(wh, wi)|/tmp^2
 float GGXTransimission::sample_pdf(
-  const Intersection& itsc, const Ray& ray_i, const Ray& ray_o) const {
+  const ShadingPoint& itsc, const Ray& ray_i, const Ray& ray_o) const {
+  float cosThetaO = itsc.itscVtx.cosTheta(ray_o.d);
+  if(cosThetaO <= 0.0f) return 0.0f;
   float alpha = roughnessToAlpha(roughness->tex2D(itsc.itscVtx.uv).x);
   float cIOR = itsc.normalReverse?1.0f/IOR:IOR;
-  glm::vec3 wh = glm::normalize(ray_i.d*cIOR+ray_o.d);
-  float tan2ThetaWh = glm::max(0.0f, itsc.itscVtx.tan2Theta(wh));
-  float normalDistr = normalDistribution(tan2ThetaWh, alpha);
-  float cosWh = itsc.itscVtx.cosTheta(wh);
+  glm::vec3 wh = refractHalfVector(itsc, ray_o.d, ray_i.d, cIOR);
   float cosWhI = glm::dot(ray_i.d, wh);
   float cosWhO = glm::dot(ray_o.d, wh);
+  if(cosWhO <= 0.0f || cosWhI >= 0.0f) return 0.0f;
   float tmp = cIOR*cosWhI+cosWhO;
   if(tmp == 0.0f) return 0.0f;
-  return cIOR*cIOR* normalDistr*glm::abs(cosWh*cosWhO)/(tmp*tmp);//
+  float tan2ThetaWh = glm::max(0.0f, itsc.itscVtx.tan2Theta(wh));
+  float tan2ThetaO = glm::max(0.0f, itsc.itscVtx.tan2Theta(ray_o.d));
+  float normalDistr = normalDistribution(tan2ThetaWh, alpha);
+  float pdfWh = normalDistr*cosWhO/
+    (cosThetaO*(1.0f+maskShadow(tan2ThetaO, alpha)));
+  return pdfWh*cIOR*cIOR*glm::abs(cosWhI)/(tmp*tmp);
 }
 
 inline float HenyeyPhase::samplePhaseCosTheta() const { //
@@ -204,7 +222,7 @@ inline float HenyeyPhase::samplePhaseCosTheta() const { //
 }
 
 glm::vec3 HenyeyPhase::sample_ev(
-  const Intersection& itsc, const Ray& ray_o, Ray& ray_i) const {
+  const ShadingPoint& itsc, const Ray& ray_o, Ray& ray_i) const {
   float cosTheta = samplePhaseCosTheta();
   float sinTheta = glm::sqrt(1.0f - glm::min(1.0f, cosTheta*cosTheta));
   float phi = _ThreadSampler.get1()*PI2;
@@ -221,6 +239,71 @@ glm::vec3 HenyeyPhase::sample_ev(
 }
 
 float HenyeyPhase::sample_pdf(
-  const Intersection& itsc, const Ray& ray_i, const Ray& ray_o) const {
+  const ShadingPoint& itsc, const Ray& ray_i, const Ray& ray_o) const {
   return evaluate(itsc, ray_i, ray_o).x;
 }
+
+/************************BXDF Dispatch******************************/
+
+#define _BXDFDispatch(func, ...) \
+  switch(bxdfClass) { \
+    case Lambertian: return static_cast<const LambertianReflection*>(this)-> \
+      func(__VA_ARGS__); \
+    case PureTrans: return static_cast<const PureTransmission*>(this)-> \
+      func(__VA_ARGS__); \
+    case Specular: return static_cast<const PerfectSpecular*>(this)-> \
+      func(__VA_ARGS__); \
+    case SpecularTrans: return static_cast<const PerfectTransimission*>(this)-> \
+      func(__VA_ARGS__); \
+    case GGXRefl: return static_cast<const GGXReflection*>(this)-> \
+      func(__VA_ARGS__); \
+    case GGXTrans: return static_cast<const GGXTransimission*>(this)-> \
+      func(__VA_ARGS__); \
+    case Henyey: return static_cast<const HenyeyPhase*>(this)-> \
+      func(__VA_ARGS__); \
+    case Group: return static_cast<const LobeGroup*>(this)-> \
+      func(__VA_ARGS__); \
+    default: break; \
+  }
+
+glm::vec3 BXDF::evaluate(
+  const ShadingPoint& itsc, const Ray& ray_o, const Ray& ray_i) const {
+  _BXDFDispatch(evaluate, itsc, ray_o, ray_i)
+  std::cout<<"BSSRDF::evaluate is undefined"<<std::endl;
+  return glm::vec3(0.0f);
+}
+
+glm::vec3 BXDF::sample_ev(
+  const ShadingPoint& itsc, const Ray& ray_o, Ray& ray_i) const {
+  _BXDFDispatch(sample_ev, itsc, ray_o, ray_i)
+  std::cout<<"BSSRDF::sample_ev is undefined"<<std::endl;
+  return glm::vec3(0.0f);
+}
+
+float BXDF::sample_pdf(
+  const ShadingPoint& itsc, const Ray& ray_i, const Ray& ray_o) const {
+  _BXDFDispatch(sample_pdf, itsc, ray_i, ray_o)
+  std::cout<<"BSSRDF::sample_pdf is undefined"<<std::endl;
+  return 0.0f;
+}
+
+glm::vec3 BXDF::getAlbedo(const ShadingPoint& itsc, const Ray& ray_o) const {
+  _BXDFDispatch(getAlbedo, itsc, ray_o)
+  return glm::vec3(0.0f);
+}
+
+#undef _BXDFDispatch
+
+bool BXDF::needMIS(const ShadingPoint& itsc) const {
+  switch(bxdfClass) {
+    case GGXRefl: 
+      return static_cast<const GGXReflection*>(this)->needMIS(itsc);
+    case GGXTrans: 
+      return static_cast<const GGXTransimission*>(this)->needMIS(itsc);
+    case Henyey: 
+      return static_cast<const HenyeyPhase*>(this)->needMIS(itsc);
+    case Group: 
+      return static_cast<const LobeGroup*>(this)->needMIS(itsc);
+    default: return false;
+  }
+}
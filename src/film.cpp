@@ -1,5 +1,6 @@
 #include "film.hpp"
 #include "utility.hpp"
+#include "arena.hpp"
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb/stb_image_write.h"
@@ -63,7 +64,9 @@ void Film::addSplat(glm::vec3 L, glm::vec2 center, bool sumMode) {
 
 void Film::generateImage(const char* filename) const {
   glm::vec3 pix(0.0f);
-  unsigned char* output = new unsigned char[totPix*3];
+  // snapshots are taken repeatedly, reuse the scratch memory
+  ScratchScope scope(_ThreadArena);
+  unsigned char* output = _ThreadArena.alloc<unsigned char>(totPix*3);
   for(int i=0; i<totPix; i++) {
     if(pWeights[i] > 0.0f) pix = pixels[i] / pWeights[i];
     else pix = glm::vec3(0.0f);
@@ -76,7 +79,6 @@ void Film::generateImage(const char* filename) const {
     output[i*3+2] = (unsigned char)(pix.z);
   }
   stbi_write_jpg(filename, resolutionX, resolutionY, 3, output, 100);
-  delete output;
 }
 
 void Film::generateImage(unsigned char* imgMat) const {
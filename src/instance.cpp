@@ -0,0 +1,111 @@
+#include "instance.hpp"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <iostream>
+
+InstanceGeometry::InstanceGeometry(Model& model, const BVHParams& params):
+  bvh(prims, params) {
+  model.toPrimitives(prims);
+  for(int i = 0; i<(int)prims.size(); i++) primIDs[prims[i]] = i;
+  bvh.build();
+}
+
+Instance::Instance(const InstanceGeometry* geometry,
+  const glm::mat4x4& toWorld):
+  Primitive(nullptr), geometry(geometry), toWorld(toWorld) {
+  updateTransform();
+}
+
+void Instance::updateTransform() {
+  toObject = glm::inverse(toWorld);
+  normalToWorld = glm::transpose(glm::inverse(glm::mat3x3(toWorld)));
+
+  worldBB3 = BB3();
+  if(geometry->getPrims().empty()) return;
+  glm::vec3 cs[8];
+  geometry->getBVH().getWholeBound().get8Cornor(cs);
+  for(int i = 0; i<8; i++)
+    worldBB3.update(toWorld*glm::vec4(cs[i], 1.0f));
+}
+
+Ray Instance::toObjectRay(const Ray& ray, float& scale) const {
+  Ray objRay(toObject*glm::vec4(ray.o, 1.0f), glm::mat3x3(toObject)*ray.d);
+  scale = glm::length(objRay.d);
+  objRay.d /= scale;
+  return objRay;
+}
+
+Primitive* Instance::copy(const Mesh* mesh) const {
+  return new Instance(geometry, toWorld);
+}
+
+void Instance::translate(glm::vec3 trans) {
+  setTransform(glm::translate(glm::mat4x4(1.0f), trans)*toWorld);
+}
+
+void Instance::scale(glm::vec3 scl) {
+  setTransform(glm::scale(glm::mat4x4(1.0f), scl)*toWorld);
+}
+
+void Instance::rotate(glm::vec3 axis, float angle) {
+  setTransform(
+    glm::rotate(glm::mat4x4(1.0f), glm::radians(angle), axis)*toWorld);
+}
+
+void Instance::setTransform(const glm::mat4x4& trans) {
+  toWorld = trans;
+  updateTransform();
+}
+
+float Instance::getAPointOnSurface(Intersection& itsc) const {
+  std::cout<<"Instance::getAPointOnSurface is undefined"<<std::endl;
+  return 0.0f;
+}
+
+// t along the normalized object ray is scale times the world t
+void Instance::intersect(const Ray& ray, HitRecord& hit, 
+  float tMin) const {
+  float scale;
+  Ray objRay = toObjectRay(ray, scale);
+  float tWorld = hit.t, tObject = tWorld*scale;
+  hit.t = tObject;
+  geometry->getBVH().intersect(objRay, hit, nullptr, tMin*scale);
+  if(hit.t < tObject) {
+    hit.t /= scale;
+    hit.instance = this;
+  }
+  else hit.t = tWorld;
+}
+
+bool Instance::intersectTest(const Ray& ray, float tMin, float tMax) const {
+  float scale;
+  Ray objRay = toObjectRay(ray, scale);
+  return geometry->getBVH().intersectTest(
+    objRay, nullptr, tMin*scale, tMax*scale);
+}
+
+void Instance::handleItscResult(Intersection& itsc) const {
+  Vertex& vtx = itsc.itscVtx;
+  vtx.normal = glm::normalize(normalToWorld*vtx.normal);
+  vtx.tangent = glm::normalize(normalToWorld*vtx.tangent);
+  vtx.btangent = glm::normalize(normalToWorld*vtx.btangent);
+  handleItscGeometry(itsc);
+}
+
+// the error bound follows the transform of a point with rounding error
+void Instance::handleItscGeometry(Intersection& itsc) const {
+  glm::vec3 pObject = itsc.itscVtx.position;
+  itsc.itscVtx.position = toWorld*glm::vec4(pObject, 1.0f);
+  itsc.geoNormal = glm::normalize(normalToWorld*itsc.geoNormal);
+
+  glm::mat3x3 absM;
+  for(int i = 0; i<3; i++) absM[i] = glm::abs(glm::vec3(toWorld[i]));
+  itsc.itscError = absM*itsc.itscError + _Gamma(3)*
+    (absM*glm::abs(pObject) + glm::abs(glm::vec3(toWorld[3])));
+}
+
+void Instance::genPrimPointCloud(PCShower& pc, glm::vec3 col) const {
+  for(const Primitive* p: geometry->getPrims())
+    pc.addItem(toWorld*glm::vec4(p->getCenter(), 1.0f), col);
+}
@@ -2,7 +2,8 @@
 #include "scene.hpp"
 #include "sampler.hpp"
 
-ShapeLight::ShapeLight(const Texture* ltMp, Model& shape): lightMap(ltMp), model(shape) {
+ShapeLight::ShapeLight(const Texture* ltMp, Model& shape): 
+  Light(LightType::Shape), lightMap(ltMp), model(shape) {
     model.setLightForAllMeshes(this);
 }
 
@@ -65,10 +66,11 @@ float DirectionalLight::selectProbality(const Scene& scene) {
   return 0.25f*PI*sceneDiameter*sceneDiameter* Luminance(le);
 }
 
-EnvironmentLight::EnvironmentLight(const Texture* tex): environment(tex) {
+EnvironmentLight::EnvironmentLight(const Texture* tex): 
+  Light(LightType::Environment), environment(tex) {
   if(tex->getType() == Texture::TexType::Image) {
     isSolid = false;
-    const ImageTexture* imt = dynamic_cast<const ImageTexture*>(environment);
+    const ImageTexture* imt = static_cast<const ImageTexture*>(environment);
     avgLuminance = imt->generateDistribution2D(dd2d);
   }
   else if(tex->getType() == Texture::TexType::Solid) {
@@ -93,7 +95,7 @@ float EnvironmentLight::selectProbality(const Scene& scene) {
 }
 
 glm::vec3 EnvironmentLight::evaluate(
-  const Intersection& itsc, glm::vec3 dir) const {
+  const ShadingPoint& itsc, glm::vec3 dir) const {
 
   if(isSolid) return environment->tex2D({0,0});
   dir = -dir;
@@ -136,7 +138,7 @@ float EnvironmentLight::getItscOnLight(Intersection& itsc, glm::vec3 evaP) const
   }
 }
 
-float EnvironmentLight::getItscPdf(const Intersection& itsc, const Ray& rayToLight) const{
+float EnvironmentLight::getItscPdf(const ShadingPoint& itsc, const Ray& rayToLight) const{
   if(isSolid) return 1.0f/(PI4*sceneDiameter*sceneDiameter);
   float theta = glm::acos(glm::clamp(rayToLight.d.y, -1.0f, 1.0f)); // world up
   float phi = std::atan2(rayToLight.d.z, rayToLight.d.x);
@@ -155,4 +157,41 @@ void EnvironmentLight::genRayItsc(
   itsc.itscVtx.position = evaP + rayToLight.d*sceneDiameter;
   itsc.itscVtx.normal = -rayToLight.d;
   itsc.prim = nullptr;
-}
\ No newline at end of file
+}
+
+/************************Light Dispatch******************************/
+
+#define _LightDispatch(func, ...) \
+  switch(type) { \
+    case Shape: return static_cast<const ShapeLight*>(this)-> \
+      func(__VA_ARGS__); \
+    case Point: return static_cast<const PointLight*>(this)-> \
+      func(__VA_ARGS__); \
+    case Directional: return static_cast<const DirectionalLight*>(this)-> \
+      func(__VA_ARGS__); \
+    default: return static_cast<const EnvironmentLight*>(this)-> \
+      func(__VA_ARGS__); \
+  }
+
+float Light::getItscOnLight(Intersection& itsc, glm::vec3 evaP) const {
+  _LightDispatch(getItscOnLight, itsc, evaP)
+}
+
+float Light::getItscPdf(const ShadingPoint& itsc, const Ray& rayToLight) const {
+  _LightDispatch(getItscPdf, itsc, rayToLight)
+}
+
+glm::vec3 Light::evaluate(const ShadingPoint& itsc, glm::vec3 dir) const {
+  _LightDispatch(evaluate, itsc, dir)
+}
+
+void Light::genRay(
+  Intersection& itsc, Ray& ray, float& pdf_A, float& pdf_D) const {
+  _LightDispatch(genRay, itsc, ray, pdf_A, pdf_D)
+}
+
+float Light::getRayPdf(const ShadingPoint& itsc, glm::vec3 dir) const {
+  _LightDispatch(getRayPdf, itsc, dir)
+}
+
+#undef _LightDispatch
@@ -6,14 +6,26 @@
 #include "texture.hpp"
 #include "bxdf.hpp"
 #include "bxdfc.hpp"
+#include "shadingProgram.hpp"
+
+float BXDFNode::getBXDF(
+  const ShadingPoint& itsc, const Ray& ray_o, const BXDF*& bxdf) const {
+  switch(nodeType) {
+    case Leaf: 
+      bxdf = static_cast<const BXDF*>(this);
+      return 1.0f;
+    case Weighted: 
+      return static_cast<const WeightedBXDF*>(this)->getBXDF(itsc, ray_o, bxdf);
+    case Mixed: 
+      return static_cast<const MixedBXDF*>(this)->getBXDF(itsc, ray_o, bxdf);
+    default: 
+      return static_cast<const AddBXDF*>(this)->getBXDF(itsc, ray_o, bxdf);
+  }
+}
 
 float Material::getBXDF(
-  const Intersection& itsc, const Ray& ray_o, const BXDF*& bxdfNode) const {
-  const BXDFNode* tnode;
-  float weight = this->bxdfNode->getBXDF(itsc, ray_o, tnode);
-  // we always promiss a bxdf is the leaf node
-  bxdfNode = dynamic_cast<const BXDF*>(tnode);
-  return weight;
+  const ShadingPoint& itsc, const Ray& ray_o, const BXDF*& bxdf) const {
+  return bxdfNode->getBXDF(itsc, ray_o, bxdf);
 }
 
 void Material::bumpMapping(Intersection& itsc) const {
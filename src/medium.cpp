@@ -29,12 +29,15 @@ void Medium::addToScene(Scene& scene, bool noBXDF) {
   scene.addModel(*bound);
 }
 
-glm::vec3 Medium::sampleNextItsc(const Ray& ray, Intersection& itsc) const{
+// a particle hit has no surface, Scene::handleItscResult gives it a 
+// frame with only the position
+glm::vec3 Medium::sampleNextItsc(const Ray& ray, HitRecord& hit) const{
   float t = _ThreadSampler.expSampleMedium(sigmaT);
-  if(t < itsc.t) {
-    itsc.itscVtx.position = ray.pass(t);
-    itsc.prim = particle;
-    itsc.t = t;
+  if(t < hit.t) {
+    hit.t = t;
+    hit.localUV = glm::vec2(0.0f);
+    hit.prim = particle;
+    hit.instance = nullptr;
   }
-  return tr(itsc.t);
+  return tr(hit.t);
 }
\ No newline at end of file
@@ -1,11 +1,26 @@
 #include "mesh.hpp"
 #include "primitive.hpp"
+#include "utility.hpp"
 
 #include <glm/gtc/matrix_transform.hpp>
 
-VertexMesh::~VertexMesh() {
-  for(Vertex* v : vertices) 
-    delete v;
+#include <algorithm>
+#include <array>
+#include <iostream>
+
+void MeshOptimizeStats::add(const MeshOptimizeStats& other) {
+  verticesBefore += other.verticesBefore;
+  verticesAfter += other.verticesAfter;
+  facesBefore += other.facesBefore;
+  facesAfter += other.facesAfter;
+  degenerateFaces += other.degenerateFaces;
+  duplicateFaces += other.duplicateFaces;
+}
+
+void MeshOptimizeStats::print(const char* title) const {
+  std::cout<<title<<": vertices "<<verticesBefore<<" -> "<<verticesAfter<<
+    ", faces "<<facesBefore<<" -> "<<facesAfter<<" ("<<degenerateFaces<<
+    " degenerate, "<<duplicateFaces<<" duplicate)"<<std::endl;
 }
 
 // will copy vertex data but will share light and bxdf
@@ -18,16 +33,13 @@ Mesh* VertexMesh::copy() const {
 
   mesh->material = material;
 
-  for(Vertex* v : vertices) 
-    mesh->vertices.push_back(new Vertex(*v));
+  mesh->vertices = vertices;
   return mesh;
 }
 
 void VertexMesh::transform(glm::mat4x4 trans) {
   glm::mat3x3 nTrans = glm::transpose(glm::inverse(glm::mat3x3(trans)));
-  for(Vertex* vtx: vertices){
-    vtx->transform(trans, nTrans);
-  }
+  vertices.transform(trans, nTrans);
 }
 
 void VertexMesh::translate(glm::vec3 move) {
@@ -46,28 +58,117 @@ void VertexMesh::rotate(glm::vec3 axis, float angle) {
   transform(trans);
 };
 
-// need to release ptr explicitly
+// the triangles are not reallocated later, so the pointers stay valid
 void VertexMesh::toPrimitives(std::vector<const Primitive*>& vp) {
-  for(unsigned int i=0; i<indices.size(); i+=3) {
-    int i1 = indices[i], i2 = indices[i+1], i3 = indices[i+2];
-    Triangle* prim = 
-      new Triangle(vertices[i1], vertices[i2], vertices[i3], this);
-    if(needInitVertex) prim->autoCalcParams();
-    vp.push_back(prim);
+  if(triangles.empty()) {
+    triangles.reserve(indices.size()/3);
+    for(unsigned int i=0; i<indices.size(); i+=3) {
+      int i1 = indices[i], i2 = indices[i+1], i3 = indices[i+2];
+      triangles.emplace_back(&vertices, i1, i2, i3, this);
+      if(needInitVertex) triangles.back().autoCalcParams();
+    }
   }
+  for(const Triangle& tri: triangles) vp.push_back(&tri);
+}
+
+MeshOptimizeStats VertexMesh::optimize() {
+  MeshOptimizeStats stats;
+  stats.verticesBefore = stats.verticesAfter = vertices.size();
+  stats.facesBefore = stats.facesAfter = indices.size()/3;
+  if(!triangles.empty()) {
+    std::cout<<"WARNING: VertexMesh::optimize after toPrimitives, "
+      "the mesh is not changed"<<std::endl;
+    return stats;
+  }
+
+  // weld: sort the vertices, equal ones map to the first of their run
+  int nv = vertices.size();
+  std::vector<int> sorted(nv), weld(nv);
+  for(int i = 0; i<nv; i++) sorted[i] = i;
+  std::sort(sorted.begin(), sorted.end(), [this](int a, int b) {
+    return vertices.lessVertex(a, b);
+  });
+  for(int i = 0; i<nv; i++) {
+    if(i > 0 && vertices.equalVertex(sorted[i-1], sorted[i]))
+      weld[sorted[i]] = weld[sorted[i-1]];
+    else weld[sorted[i]] = sorted[i];
+  }
+
+  // faces: a collapsed or (nearly) zero area face is degenerate, 
+  // the same indices with the same winding are duplicate
+  std::vector<std::array<uint32_t, 3>> faces;
+  faces.reserve(indices.size()/3);
+  for(unsigned int i = 0; i+2<indices.size(); i+=3) {
+    std::array<uint32_t, 3> f = 
+      {(uint32_t)weld[indices[i]], (uint32_t)weld[indices[i+1]], 
+      (uint32_t)weld[indices[i+2]]};
+    glm::vec3 e1 = vertices.getPosition(f[1]) - vertices.getPosition(f[0]);
+    glm::vec3 e2 = vertices.getPosition(f[2]) - vertices.getPosition(f[0]);
+    float crossLen = glm::length(glm::cross(e1, e2));
+    if(f[0] == f[1] || f[1] == f[2] || f[0] == f[2] || 
+      !(crossLen > 1e-6f*glm::length(e1)*glm::length(e2))) {
+      stats.degenerateFaces++;
+      continue;
+    }
+    // rotate the smallest index first, keeps the winding
+    std::rotate(f.begin(), std::min_element(f.begin(), f.end()), f.end());
+    faces.push_back(f);
+  }
+  std::vector<std::array<uint32_t, 3>> uniqueFaces(faces);
+  std::sort(uniqueFaces.begin(), uniqueFaces.end());
+  uniqueFaces.erase(
+    std::unique(uniqueFaces.begin(), uniqueFaces.end()), uniqueFaces.end());
+  stats.duplicateFaces = faces.size() - uniqueFaces.size();
+  faces.swap(uniqueFaces);
+
+  // morton order of the face centers, quantized like the LBVH build
+  std::vector<glm::vec3> centers(faces.size());
+  BB3 centerbb3;
+  for(unsigned int i = 0; i<faces.size(); i++) {
+    centers[i] = (vertices.getPosition(faces[i][0]) + 
+      vertices.getPosition(faces[i][1]) + 
+      vertices.getPosition(faces[i][2]))/3.0f;
+    centerbb3.update(centers[i]);
+  }
+  glm::vec3 diag = centerbb3.getDiagonal();
+  glm::vec3 scale;
+  for(int axis = 0; axis<3; axis++) 
+    scale[axis] = diag[axis] > 0.0f ? 1023.0f/diag[axis] : 0.0f;
+  std::vector<std::pair<unsigned int, int>> order(faces.size());
+  for(unsigned int i = 0; i<faces.size(); i++) {
+    glm::vec3 q = glm::clamp(
+      (centers[i] - centerbb3.getMin())*scale, 0.0f, 1023.0f);
+    order[i] = {encodeMorton3(q), i};
+  }
+  std::sort(order.begin(), order.end());
+
+  // vertices by first use of the ordered faces
+  std::vector<int> newIdx(nv, -1), vtxOrder;
+  indices.clear();
+  for(const auto& o: order) {
+    for(uint32_t v: faces[o.second]) {
+      if(newIdx[v] < 0) {
+        newIdx[v] = vtxOrder.size();
+        vtxOrder.push_back(v);
+      }
+      indices.push_back(newIdx[v]);
+    }
+  }
+  vertices.reorder(vtxOrder);
+
+  stats.verticesAfter = vertices.size();
+  stats.facesAfter = indices.size()/3;
+  return stats;
 }
 
 VertexMesh* VertexMesh::CreateTriangle(glm::vec3 pos[3]) {
   VertexMesh* mesh = new VertexMesh;
-  Vertex* vtx = new Vertex(pos[0]);
-  vtx->uv = {0, 0};
-  mesh->vertices.push_back(vtx);
-  vtx = new Vertex(pos[1]);
-  vtx->uv = {1, 0};
-  mesh->vertices.push_back(vtx);
-  vtx = new Vertex(pos[2]);
-  vtx->uv = {0, 1};
-  mesh->vertices.push_back(vtx);
+  glm::vec2 uvs[3] = {{0, 0}, {1, 0}, {0, 1}};
+  for(int i = 0; i<3; i++) {
+    Vertex vtx(pos[i]);
+    vtx.uv = uvs[i];
+    mesh->vertices.addVertex(vtx);
+  }
   mesh->indices = {0,1,2};
   mesh->needInitVertex = true;
   return mesh;
@@ -75,18 +176,12 @@ VertexMesh* VertexMesh::CreateTriangle(glm::vec3 pos[3]) {
 
 VertexMesh* VertexMesh::CreateRectangle(glm::vec3 pos[4]) {
   VertexMesh* mesh = new VertexMesh;
-  Vertex* vtx = new Vertex(pos[0]);
-  vtx->uv = {0, 0};
-  mesh->vertices.push_back(vtx);
-  vtx = new Vertex(pos[1]);
-  vtx->uv = {1, 0};
-  mesh->vertices.push_back(vtx);
-  vtx = new Vertex(pos[2]);
-  vtx->uv = {1, 1};
-  mesh->vertices.push_back(vtx);
-  vtx = new Vertex(pos[3]);
-  vtx->uv = {0, 1};
-  mesh->vertices.push_back(vtx);
+  glm::vec2 uvs[4] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+  for(int i = 0; i<4; i++) {
+    Vertex vtx(pos[i]);
+    vtx.uv = uvs[i];
+    mesh->vertices.addVertex(vtx);
+  }
   mesh->indices = {0,1,2,0,2,3};
   mesh->needInitVertex = true;
   return mesh;
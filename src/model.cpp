@@ -11,8 +11,9 @@
 
 #include <iostream>
 
-Model::Model(const char* filename) {
-  isInvalidModel = SceneImporter::loadSceneFromFile(filename, meshes);
+Model::Model(const char* filename, bool optimizeMeshes) {
+  isInvalidModel = 
+    SceneImporter::loadSceneFromFile(filename, meshes, optimizeMeshes);
 }
 
 Model::Model(Mesh* mesh) {
@@ -41,7 +42,7 @@ Model* Model::copy() {
   return model;
 }
 
-// need to release ptr explicitly
+// the prims are owned by the meshes
 void Model::toPrimitives(std::vector<const Primitive*>& vp) const {
   for(Mesh* mesh : meshes)
     mesh->toPrimitives(vp);
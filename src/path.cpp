@@ -1,12 +1,13 @@
 #include "path.hpp"
 #include "medium.hpp"
 #include "utility.hpp"
+#include "arena.hpp"
 
 using BType = BXDF::BXDFNature;
 
 void estimateDirectLightByLi(
   const Scene& scene,  const DiscreteDistribution1D& ldd1d,
-  const Intersection itsc, const BXDF* bxdf, const Medium* inMedium,
+  const ShadingPoint& itsc, const BXDF* bxdf, const Medium* inMedium,
   const Ray& rayo, glm::vec3& L, bool needMIS) {
 
   Ray rayToLight;
@@ -55,7 +56,7 @@ void estimateDirectLightByLi(
 
 void estimateDirectLightByBXDF(
   const Scene& scene, const DiscreteDistribution1D& ldd1d,
-  const Intersection itsc, const BXDF* bxdf, const Medium* inMedium,
+  const ShadingPoint& itsc, const BXDF* bxdf, const Medium* inMedium,
   const Ray& rayo, glm::vec3& L, bool needMIS) {
 
   Ray rayToLight;
@@ -64,12 +65,15 @@ void estimateDirectLightByBXDF(
   glm::vec3 beta = bxdf->sample_ev(itsc, rayo, rayToLight);
   if(IsBlack(beta)) return;
 
-  Intersection itsc_sp = scene.intersectDirectly(rayToLight, inMedium, tr);
+  Ray hitRay;
+  HitRecord hit = scene.intersectDirectly(rayToLight, inMedium, tr, hitRay);
 
+  Intersection itsc_sp;
   const Light* lt = nullptr; 
-  if(itsc_sp.prim) {
-    lt = itsc_sp.prim->getMesh()->material.light;
+  if(hit.prim) {
+    lt = hit.prim->getMesh()->material.light;
     if(lt) {
+      scene.handleItscResult(hitRay, hit, itsc_sp);
       if(itsc_sp.normalReverse) return;
       L = tr*beta*lt->evaluate(itsc_sp, -rayToLight.d);
     }
@@ -98,7 +102,7 @@ void estimateDirectLightByBXDF(
 // rayToLight.o is at pre itsc.position and rayToLight.d point to light
 inline float estimateDirectLightByBXDF(
   const Scene& scene, const DiscreteDistribution1D& ldd1d,
-  const Intersection& itsc_lt, const Intersection& itsc_sf,
+  const ShadingPoint& itsc_lt, const ShadingPoint& itsc_sf,
   const Ray& ray_o, const Ray& rayToLight, 
   const BXDF* bxdf, const Light* lt) {
 
@@ -107,7 +111,7 @@ inline float estimateDirectLightByBXDF(
 
   float lpdf_A = scene.getLightPdf(ldd1d, lt)*lt->getItscPdf(itsc_lt, rayToLight);
   float lpdf_S = PaToPw(lpdf_A, len2, cosTheta);
-  float sample_pdfw = bxdf->sample_pdf(itsc_sf, ray_o, rayToLight);
+  float sample_pdfw = bxdf->sample_pdf(itsc_sf, rayToLight, ray_o);
   return PowerHeuristicWeight(sample_pdfw, lpdf_S);
 }
 
@@ -121,101 +125,118 @@ void PathIntegrator::render(
 void PathIntegrator::render_no_medium(
   const Scene& scene, RayGenerator* rayGen, Film& film) const {
   
-  Ray startRay; glm::vec2 rasPos;
-  
-  while(rayGen->genNextRay(startRay, rasPos)) {
-    glm::vec3 beta(1.0f), L(0.0f);
+  RayPacket packet;
+  HitRecord primary[RayPacket::MaxSize];
+  ScratchArena& arena = _ThreadArena;
+
+  // camera rays are traced as packets, then each path goes on alone
+  while(rayGen->genNextPacket(packet)) {
+    scene.intersect(packet, primary);
+    for(int k = 0; k<packet.size; k++) {
+      const Ray& startRay = packet.rays[k];
+      const glm::vec2& rasPos = packet.rasterPos[k];
+      _ThreadSampler.startSample(glm::ivec2(rasPos), packet.sampleIndex[k]);
+      glm::vec3 beta(1.0f), L(0.0f);
     
-    Ray ray_cur = startRay, ray_lst;
-    DiscreteDistribution1D ldd1d;
-    Intersection itsc_cur, itsc_lst;
-
-    const BXDF* bxdf = nullptr; 
-    bool needMIS = false;
-    int lastBType = BType::DELTA;
-    float sample_pdfw;
-
-    for(int bounce = 0; bounce<max_bounce; bounce++) {
-      itsc_cur = scene.intersect(ray_cur, nullptr);
+      Ray ray_cur = startRay, ray_lst;
+      ScratchScope sampleScope(arena);
+      DiscreteDistribution1D ldd1d(arena);
+      // the itsc of this and the last bounce, swapped instead of copied
+      Intersection itscs[2];
+      HitRecord hit;
+
+      const BXDF* bxdf = nullptr; 
+      bool needMIS = false;
+      int lastBType = BType::DELTA;
+      float sample_pdfw;
+
+      for(int bounce = 0; bounce<max_bounce; bounce++) {
+        Intersection& itsc_cur = itscs[bounce&1];
+        const Intersection& itsc_lst = itscs[(bounce&1)^1];
+        if(bounce > 0) hit = scene.intersect(ray_cur);
+        const HitRecord& hit_cur = bounce == 0 ? primary[k] : hit;
       
-      if(!itsc_cur.prim) {
-        if(scene.envLight && _HasFeature(lastBType, DELTA)) {
-          L += scene.envLight->evaluate(itsc_cur, -ray_cur.d)*beta;
-        }
+        if(!hit_cur.prim) {
+          if(scene.envLight && _HasFeature(lastBType, DELTA)) {
+            L += scene.envLight->evaluate(itsc_cur, -ray_cur.d)*beta;
+          }
         
-        if(scene.envLight && needMIS && _Connectable(lastBType)) {
-          Intersection itsc_lt;
-          scene.envLight->genRayItsc(itsc_lt, ray_cur, ray_cur.o);
-          float mis = estimateDirectLightByBXDF(
-            scene, ldd1d, itsc_lt, itsc_lst, ray_lst, ray_cur, bxdf, scene.envLight);
-          L += mis*scene.envLight->evaluate(itsc_lt, -ray_cur.d)*beta;
+          if(scene.envLight && needMIS && _Connectable(lastBType)) {
+            Intersection itsc_lt;
+            scene.envLight->genRayItsc(itsc_lt, ray_cur, ray_cur.o);
+            float mis = estimateDirectLightByBXDF(
+              scene, ldd1d, itsc_lt, itsc_lst, ray_lst, ray_cur, bxdf, scene.envLight);
+            L += mis*scene.envLight->evaluate(itsc_lt, -ray_cur.d)*beta;
+          }
+          break;
         }
-        break;
-      }
 
-      const Material& mat = itsc_cur.prim->getMesh()->material;
-      if(itsc_cur.prim->hasSurface() && itsc_cur.cosTheta(ray_cur.d)>0.0f) 
-        itsc_cur.reverseNormal();
+        scene.handleItscResult(ray_cur, hit_cur, itsc_cur);
+        const Material& mat = itsc_cur.prim->getMesh()->material;
+        if(itsc_cur.prim->hasSurface() && itsc_cur.cosTheta(ray_cur.d)>0.0f) 
+          itsc_cur.reverseNormal();
 
-      if(mat.light) {
-        if(!itsc_cur.normalReverse && _HasFeature(lastBType, DELTA)) {
-          L += mat.light->evaluate(itsc_cur, -ray_cur.d)*beta;
-        }
+        if(mat.light) {
+          if(!itsc_cur.normalReverse && _HasFeature(lastBType, DELTA)) {
+            L += mat.light->evaluate(itsc_cur, -ray_cur.d)*beta;
+          }
         
-        if(!itsc_cur.normalReverse && needMIS && _Connectable(lastBType)) {
-          float mis = estimateDirectLightByBXDF(
-            scene, ldd1d, itsc_cur, itsc_lst, ray_lst, ray_cur, bxdf, mat.light);
-          L += mis*mat.light->evaluate(itsc_cur, -ray_cur.d)*beta;
-        }
+          if(!itsc_cur.normalReverse && needMIS && _Connectable(lastBType)) {
+            float mis = estimateDirectLightByBXDF(
+              scene, ldd1d, itsc_cur, itsc_lst, ray_lst, ray_cur, bxdf, mat.light);
+            L += mis*mat.light->evaluate(itsc_cur, -ray_cur.d)*beta;
+          }
         
-        if(!mat.bxdfNode) break;
-      }
-      if(!mat.bxdfNode) {
-        std::cout<<"WARNING: Detect No BXDF Material(not light)"<<std::endl;
-        break;
-      }
-
-      ray_cur.o = itsc_cur.itscVtx.position; 
-      ray_cur.d = -ray_cur.d;
-
-      float bxdfWeight = mat.getBXDF(itsc_cur, ray_cur, bxdf); // bxdf update here
-      Ray sampleRay;
-      glm::vec3 nBeta = bxdfWeight * bxdf->sample_ev(itsc_cur, ray_cur, sampleRay);
+          if(!mat.bxdfNode) break;
+        }
+        if(!mat.bxdfNode) {
+          std::cout<<"WARNING: Detect No BXDF Material(not light)"<<std::endl;
+          break;
+        }
 
-      if(IsBlack(nBeta)) break;
-      if(!sampleRay.checkDir()) break;
+        ray_cur.o = itsc_cur.itscVtx.position; 
+        ray_cur.d = -ray_cur.d;
 
-      lastBType = bxdf->getType();
+        // bxdf update here
+        float bxdfWeight = scene.getBXDF(mat, itsc_cur, ray_cur, bxdf);
+        Ray sampleRay;
+        glm::vec3 nBeta = bxdfWeight * bxdf->sample_ev(itsc_cur, ray_cur, sampleRay);
 
-      if(!_IsType(lastBType, NoSurface)){
-        itsc_cur.maxErrorOffset(sampleRay.d, sampleRay.o);
-        itsc_cur.itscVtx.position = sampleRay.o;
-      }
+        if(IsBlack(nBeta)) break;
+        if(!sampleRay.checkDir()) break;
 
-      /**********estimate direct light and useMIS*************/
-      if(_Connectable(lastBType)) {
-        glm::vec3 light_L;
-        needMIS = useMIS && bxdf->needMIS(itsc_cur);
+        lastBType = bxdf->getType();
 
-        scene.getPositionLightDD1D(itsc_cur.itscVtx.position, ldd1d);
-        estimateDirectLightByLi(
-          scene, ldd1d, itsc_cur, bxdf, mat.mediumOutside, ray_cur, light_L, needMIS);
-        CheckRadiance(light_L, rasPos);
-        L += beta*light_L;
+        if(!_IsType(lastBType, NoSurface)){
+          itsc_cur.maxErrorOffset(sampleRay.d, sampleRay.o);
+          itsc_cur.itscVtx.position = sampleRay.o;
+        }
 
-        if(needMIS) {//
-          sample_pdfw = bxdf->sample_pdf(itsc_cur, ray_cur, sampleRay);
+        /**********estimate direct light and useMIS*************/
+        if(_Connectable(lastBType)) {
+          glm::vec3 light_L;
+          needMIS = useMIS && bxdf->needMIS(itsc_cur);
+
+          scene.getPositionLightDD1D(itsc_cur.itscVtx.position, ldd1d);
+          estimateDirectLightByLi(
+            scene, ldd1d, itsc_cur, bxdf, mat.mediumOutside, ray_cur, light_L, needMIS);
+          light_L *= bxdfWeight;
+          CheckRadiance(light_L, rasPos);
+          L += beta*light_L;
+
+          if(needMIS) {//
+            sample_pdfw = bxdf->sample_pdf(itsc_cur, sampleRay, ray_cur);
+          }
         }
-      }
-      /********************************************/
+        /********************************************/
       
-      beta *= nBeta;
-      ray_lst = ray_cur;
-      ray_cur = sampleRay;
-      itsc_lst = itsc_cur;
+        beta *= nBeta;
+        ray_lst = ray_cur;
+        ray_cur = sampleRay;
+      }
+      CheckRadiance(L, rasPos);
+      film.addSplat(L, rasPos);
     }
-    CheckRadiance(L, rasPos);
-    film.addSplat(L, rasPos);
   }
 }
 
@@ -223,94 +244,111 @@ void PathIntegrator::render_no_medium(
 void PathIntegrator::render_with_medium(
   const Scene& scene, RayGenerator* rayGen, Film& film) const {
   
-  Ray startRay; glm::vec2 rasPos;
-
-  while(rayGen->genNextRay(startRay, rasPos)) {
-
-    glm::vec3 beta(1.0f), L(0.0f);
-    Intersection itsc;
-    Ray ray = startRay, sampleRay;
-
-    int lastBType = BType::DELTA;
-    DiscreteDistribution1D ldd1d;
-
-    const BXDF* bxdf = nullptr; 
-    const Medium* inMedium = scene.getGlobalMedium();
-
-    for(int bounce = 0; bounce<max_bounce; bounce++) {
-      // bounce_cnt ++;
-      // if(bounce_cnt == 4134921) {
-      //   int debug = 2;
-      // }
-
-      itsc = scene.intersect(ray, nullptr);
-      if(inMedium)
-        beta *= inMedium->sampleNextItsc(ray, itsc);
-
-      if(!itsc.prim) {
-        if(scene.envLight && _HasFeature(lastBType, DELTA)) {
-          L += scene.envLight->evaluate(itsc, -ray.d)*beta;
+  RayPacket packet;
+  HitRecord primary[RayPacket::MaxSize];
+  ScratchArena& arena = _ThreadArena;
+
+  while(rayGen->genNextPacket(packet)) {
+    scene.intersect(packet, primary);
+    for(int k = 0; k<packet.size; k++) {
+      const Ray& startRay = packet.rays[k];
+      const glm::vec2& rasPos = packet.rasterPos[k];
+      _ThreadSampler.startSample(glm::ivec2(rasPos), packet.sampleIndex[k]);
+
+      glm::vec3 beta(1.0f), L(0.0f);
+      Intersection itsc;
+      HitRecord next;
+      Ray ray = startRay, sampleRay;
+
+      int lastBType = BType::DELTA;
+      ScratchScope sampleScope(arena);
+      DiscreteDistribution1D ldd1d(arena);
+
+      const BXDF* bxdf = nullptr; 
+      const Medium* inMedium = scene.getGlobalMedium();
+
+      for(int bounce = 0; bounce<max_bounce; bounce++) {
+        // bounce_cnt ++;
+        // if(bounce_cnt == 4134921) {
+        //   int debug = 2;
+        // }
+
+        // the first hit is the one of the packet, the medium may move it
+        HitRecord& hit = bounce == 0 ? primary[k] : next;
+        if(bounce > 0) hit = scene.intersect(ray);
+        if(inMedium)
+          beta *= inMedium->sampleNextItsc(ray, hit);
+
+        if(!hit.prim) {
+          if(scene.envLight && _HasFeature(lastBType, DELTA)) {
+            L += scene.envLight->evaluate(itsc, -ray.d)*beta;
+          }
+          break;
         }
-        break;
-      }
 
-      const Material& mat = itsc.prim->getMesh()->material;
-      if(itsc.prim->hasSurface() && itsc.cosTheta(ray.d)>0.0f) itsc.reverseNormal();
+        // after the medium, a surface hit behind a scattering is not built
+        scene.handleItscResult(ray, hit, itsc);
+        const Material& mat = itsc.prim->getMesh()->material;
+        if(itsc.prim->hasSurface() && itsc.cosTheta(ray.d)>0.0f) itsc.reverseNormal();
 
-      if(mat.light) {
-        if(!itsc.normalReverse && _HasFeature(lastBType, DELTA)) {
-          L += mat.light->evaluate(itsc, -ray.d)*beta;
+        if(mat.light) {
+          if(!itsc.normalReverse && _HasFeature(lastBType, DELTA)) {
+            L += mat.light->evaluate(itsc, -ray.d)*beta;
+          }
+          if(!mat.bxdfNode) break;
+        }
+        if(!mat.bxdfNode) {
+          std::cout<<"WARNING: Detect No BXDF Material(not light)"<<std::endl;
+          break;
         }
-        if(!mat.bxdfNode) break;
-      }
-      if(!mat.bxdfNode) {
-        std::cout<<"WARNING: Detect No BXDF Material(not light)"<<std::endl;
-        break;
-      }
 
-      ray.o = itsc.itscVtx.position; 
-      ray.d = -ray.d;
+        ray.o = itsc.itscVtx.position; 
+        ray.d = -ray.d;
 
-      float bxdfWeight = mat.getBXDF(itsc, ray, bxdf); // bxdf update here
-      glm::vec3 nBeta = bxdfWeight * bxdf->sample_ev(itsc, ray, sampleRay);
+        // bxdf update here
+        float bxdfWeight = scene.getBXDF(mat, itsc, ray, bxdf);
+        glm::vec3 nBeta = bxdfWeight * bxdf->sample_ev(itsc, ray, sampleRay);
 
-      if(IsBlack(nBeta)) break;
-      if(!sampleRay.checkDir()) break;
+        if(IsBlack(nBeta)) break;
+        if(!sampleRay.checkDir()) break;
 
-      lastBType = bxdf->getType();
+        lastBType = bxdf->getType();
 
-      if(!_IsType(lastBType, NoSurface)){
-        itsc.maxErrorOffset(sampleRay.d, sampleRay.o);
-        itsc.itscVtx.position = sampleRay.o;
-      }
+        if(!_IsType(lastBType, NoSurface)){
+          itsc.maxErrorOffset(sampleRay.d, sampleRay.o);
+          itsc.itscVtx.position = sampleRay.o;
+        }
 
-      /**********estimate direct light and useMIS*************/
-      if(_Connectable(lastBType)) {
-        glm::vec3 light_L;
-        bool needMIS = useMIS && bxdf->needMIS(itsc);
-
-        scene.getPositionLightDD1D(itsc.itscVtx.position, ldd1d);
-        estimateDirectLightByLi(
-          scene, ldd1d, itsc, bxdf, mat.mediumOutside, ray, light_L, needMIS);
-        CheckRadiance(light_L, rasPos);
-        L += beta*light_L;
-
-        if(needMIS) {
-          glm::vec3 BXDF_L;
-          estimateDirectLightByBXDF(
-            scene, ldd1d, itsc, bxdf, mat.mediumOutside, ray, BXDF_L, useMIS);
-          CheckRadiance(BXDF_L, rasPos);
-          L += beta*BXDF_L;
+        /**********estimate direct light and useMIS*************/
+        if(_Connectable(lastBType)) {
+          glm::vec3 light_L;
+          bool needMIS = useMIS && bxdf->needMIS(itsc);
+
+          scene.getPositionLightDD1D(itsc.itscVtx.position, ldd1d);
+          estimateDirectLightByLi(
+            scene, ldd1d, itsc, bxdf, mat.mediumOutside, ray, light_L, needMIS);
+          light_L *= bxdfWeight;
+          CheckRadiance(light_L, rasPos);
+          L += beta*light_L;
+
+          if(needMIS) {
+            glm::vec3 BXDF_L;
+            estimateDirectLightByBXDF(
+              scene, ldd1d, itsc, bxdf, mat.mediumOutside, ray, BXDF_L, useMIS);
+            BXDF_L *= bxdfWeight;
+            CheckRadiance(BXDF_L, rasPos);
+            L += beta*BXDF_L;
+          }
         }
-      }
-      /********************************************/
+        /********************************************/
       
-      beta *= nBeta;
-      ray = sampleRay;
-      if(!_IsType(lastBType, NoSurface)) 
-        inMedium = itsc.isRayToInside(ray)? mat.mediumInside:mat.mediumOutside;
+        beta *= nBeta;
+        ray = sampleRay;
+        if(!_IsType(lastBType, NoSurface)) 
+          inMedium = itsc.isRayToInside(ray)? mat.mediumInside:mat.mediumOutside;
+      }
+      CheckRadiance(L, rasPos);
+      film.addSplat(L, rasPos);
     }
-    CheckRadiance(L, rasPos);
-    film.addSplat(L, rasPos);
   }
 }
\ No newline at end of file
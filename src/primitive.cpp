@@ -10,20 +10,36 @@
 
 /**********************Triangle******************************/
 
-Triangle::Triangle(Vertex* v1, Vertex* v2, Vertex* v3, const Mesh* mesh) {
-  verts[0] = v1;
-  verts[1] = v2;
-  verts[2] = v3;
+Triangle::Triangle(VertexStreams* vtxs, 
+  uint32_t i1, uint32_t i2, uint32_t i3, const Mesh* mesh): vtxs(vtxs) {
+  vi[0] = i1;
+  vi[1] = i2;
+  vi[2] = i3;
   this->mesh = mesh;
-  glm::vec3 v1v2 = v2->position - v1->position;
-  glm::vec3 v1v3 = v3->position - v1->position;
-  geoNormal = glm::normalize(glm::cross(v1v2, v1v3));
 }
 
 BB3 Triangle::getBB3() const{
-  BB3 bb3(verts[0]->position);
-  bb3.update(verts[1]->position);
-  bb3.update(verts[2]->position);
+  BB3 bb3(getPosition(0));
+  bb3.update(getPosition(1));
+  bb3.update(getPosition(2));
+  return bb3;
+}
+
+// the vertices in the slab and the points where edges cross the planes
+BB3 Triangle::getClippedBB3(int axis, float lo, float hi) const {
+  BB3 bb3;
+  for(int i = 0; i<3; i++) {
+    glm::vec3 p0 = getPosition(i), p1 = getPosition((i+1)%3);
+    float a0 = p0[axis], a1 = p1[axis];
+    if(a0 >= lo && a0 <= hi) bb3.update(p0);
+    for(float plane: {lo, hi}) {
+      if((a0 < plane && a1 > plane) || (a0 > plane && a1 < plane)) {
+        glm::vec3 p = p0 + (plane - a0)/(a1 - a0)*(p1 - p0);
+        p[axis] = plane;
+        bb3.update(p);
+      }
+    }
+  }
   return bb3;
 }
 
@@ -33,7 +49,7 @@ Primitive* Triangle::copy(const Mesh* _mesh) const {
   "Triangle copy should based on Vertex not Primitive, "
   "if this method called, you may put triangle to CustomMesh"
   <<std::endl;
-  Primitive* prim = new Triangle(verts[0], verts[1], verts[2], _mesh);
+  Primitive* prim = new Triangle(vtxs, vi[0], vi[1], vi[2], _mesh);
   return prim;
 }
 
@@ -44,104 +60,97 @@ float Triangle::getAPointOnSurface(Intersection& itsc) const {
   return 1.0f/getArea();
 }
 
+bool Triangle::getTriangle(glm::vec3 (&pos)[3]) const {
+  for(int i = 0; i<3; i++) pos[i] = getPosition(i);
+  return true;
+}
+
 // Triangle::intersect will set localUV, because it's easier
 // to calc params from localUV
-void Triangle::intersect(const Ray& ray, Intersection& itsc) const { //Mollor method
-  glm::vec3 v0v1 = verts[1]->position - verts[0]->position;
-  glm::vec3 v0v2 = verts[2]->position - verts[0]->position;
-  glm::vec3 pvec = glm::cross(ray.d, v0v2);
-  float det = glm::dot(v0v1, pvec);
-  if(std::abs(det)<CUSTOM_EPSILON) return; //parallel
+void Triangle::intersect(const Ray& ray, HitRecord& hit, 
+  float tMin) const { //Mollor method
+  glm::vec3 v0v1 = getPosition(1) - getPosition(0);
+  glm::vec3 v0v2 = getPosition(2) - getPosition(0);
+  float t; glm::vec2 uv;
   //if(det<0) the triangle do not face to ray
   // TODO: if the material not transmission, than return false;
-
-  float invDet = 1.0f/det;
-  glm::vec3 tvec = ray.o - verts[0]->position;
-  float u = glm::dot(tvec, pvec)*invDet;
-  if(u<0 || u>1) return;
-
-  glm::vec3 qvec = glm::cross(tvec, v0v1);
-  float v = glm::dot(ray.d, qvec)*invDet;
-  if(v<0 || u+v>1) return;
-
-  float t = glm::dot(v0v2, qvec)*invDet;
-  if(t<CUSTOM_EPSILON) return;
-  
-  itsc.updateItscInfo(t, this, {u, v});
+  if(intersectEdges(ray, getPosition(0), v0v1, v0v2, t, uv) && t >= tMin)
+    hit.update(t, this, uv);
 }
 
-bool Triangle::intersectTest(const Ray& ray) const{
-  glm::vec3 v0v1 = verts[1]->position - verts[0]->position;
-  glm::vec3 v0v2 = verts[2]->position - verts[0]->position;
-  glm::vec3 pvec = glm::cross(ray.d, v0v2);
-  float det = glm::dot(v0v1, pvec);
-  if(std::abs(det)<CUSTOM_EPSILON) return false; 
-
-  float invDet = 1.0f/det;
-  glm::vec3 tvec = ray.o - verts[0]->position;
-  float u = glm::dot(tvec, pvec)*invDet;
-  if(u<0 || u>1) return false;
-
-  glm::vec3 qvec = glm::cross(tvec, v0v1);
-  float v = glm::dot(ray.d, qvec)*invDet;
-  if(v<0 || v>1) return false;
-
-  float t = glm::dot(v0v2, qvec)*invDet;
-  if(t<CUSTOM_EPSILON) return false;
-
-  return true;
+bool Triangle::intersectTest(const Ray& ray, float tMin, float tMax) const{
+  glm::vec3 v0v1 = getPosition(1) - getPosition(0);
+  glm::vec3 v0v2 = getPosition(2) - getPosition(0);
+  float t; glm::vec2 uv;
+  return intersectEdges(ray, getPosition(0), v0v1, v0v2, t, uv) && 
+    t >= tMin && t < tMax;
 }
 
-//set normal, uv, and other for itsc from localUV
+//set normal, uv, and other for itsc from localUV, 
+// the attributes are decoded here
 void Triangle::handleItscResult(Intersection& itsc) const{ // for triangle
   float u = itsc.localUV[0], v = itsc.localUV[1], w = 1-u-v;
-  #define BLEND(var) (w*verts[0]->var + u*verts[1]->var + v*verts[2]->var)
+  // the bitangent sign is the one of vertex 0, a face does not mix them
+  float bsign, bsign1, bsign2;
   
   // notice: normal/tangent interpolation need to be normalized!
-  itsc.itscVtx.normal = glm::normalize(BLEND(normal));
-  glm::vec3 blend_tan = BLEND(tangent);
+  itsc.itscVtx.normal = glm::normalize(w*vtxs->getNormal(vi[0]) + 
+    u*vtxs->getNormal(vi[1]) + v*vtxs->getNormal(vi[2]));
+  glm::vec3 blend_tan = w*vtxs->getTangent(vi[0], bsign) + 
+    u*vtxs->getTangent(vi[1], bsign1) + v*vtxs->getTangent(vi[2], bsign2);
   if(IsBlack(blend_tan)) {// if no tangent, must no btangent
     getXYAxis(itsc.itscVtx.normal, itsc.itscVtx.tangent, itsc.itscVtx.btangent);
     itsc.itscVtx.uv = glm::vec2(0.0f);
   }
   else {
     itsc.itscVtx.tangent = glm::normalize(blend_tan);
-    itsc.itscVtx.btangent = glm::cross(itsc.itscVtx.tangent, itsc.itscVtx.normal);
-    itsc.itscVtx.uv = BLEND(uv); // real uv for map
+    itsc.itscVtx.btangent = 
+      bsign*glm::cross(itsc.itscVtx.tangent, itsc.itscVtx.normal);
+    itsc.itscVtx.uv = w*vtxs->getUV(vi[0]) + 
+      u*vtxs->getUV(vi[1]) + v*vtxs->getUV(vi[2]); // real uv for map
   }
-  itsc.itscVtx.position = BLEND(position);
-  #undef BLEND
+  handleItscGeometry(itsc);
+}
+
+// geoNormal is the real normal for the triangle surface, itsc.normal is
+// always the interpolated normal or even bump mapping normal. it is taken
+// from the current positions, the mesh may be moved after the build
+void Triangle::handleItscGeometry(Intersection& itsc) const {
+  const glm::vec3& p0 = getPosition(0);
+  const glm::vec3& p1 = getPosition(1);
+  const glm::vec3& p2 = getPosition(2);
+  float u = itsc.localUV[0], v = itsc.localUV[1], w = 1-u-v;
+  itsc.itscVtx.position = w*p0 + u*p1 + v*p2;
 
   // we assume that u,v,w, normal are all exact(ignore their numerical error)
   // we just make sure no self-intersection happen
   // error = |up1|G3+|vp|2G3+|wp|3G2, NOTICE error must use abs() !!!
-  itsc.itscError = _Gamma(3)*
-    (w*glm::abs(verts[0]->position)+u*glm::abs(verts[1]->position))+
-    _Gamma(2)*v*glm::abs(verts[0]->position);
-  itsc.geoNormal = geoNormal;
+  itsc.itscError = _Gamma(3)*(w*glm::abs(p0)+u*glm::abs(p1))+
+    _Gamma(2)*v*glm::abs(p0);
+  itsc.geoNormal = glm::normalize(glm::cross(p1 - p0, p2 - p0));
 }
 
 void Triangle::autoCalcParams(bool reverseNormal) { 
-  glm::vec3 v01 = verts[1]->position - verts[0]->position;
-  glm::vec3 v02 = verts[2]->position - verts[0]->position;
+  glm::vec3 v01 = getPosition(1) - getPosition(0);
+  glm::vec3 v02 = getPosition(2) - getPosition(0);
   glm::vec3 normal = glm::normalize(glm::cross(v01, v02));
   if(reverseNormal) normal = -normal;
   v01 = glm::normalize(v01);
   glm::vec3 btan = glm::cross(v01, normal);
 
-  #define SET_PROP(p, v) verts[0]->p = v; verts[1]->p = v; verts[2]->p = v;
-
-  SET_PROP(normal, normal)
-  SET_PROP(tangent, v01)
-  SET_PROP(btangent, btan)
-  
-  #undef SET_PROP
+  for(int k = 0; k<3; k++) {
+    Vertex vtx = vtxs->getVertex(vi[k]);
+    vtx.normal = normal;
+    vtx.tangent = v01;
+    vtx.btangent = btan;
+    vtxs->setVertex(vi[k], vtx);
+  }
 }
 
 void Triangle::genPrimPointCloud(PCShower& pc, glm::vec3 col) const {
   glm::vec2 uv = _ThreadSampler.uniSampleTriangle();
-  glm::vec3 pos = uv.x*verts[0]->position+
-    uv.y*verts[1]->position+(1.0f-uv.x-uv.y)*verts[2]->position;
+  glm::vec3 pos = uv.x*getPosition(0)+
+    uv.y*getPosition(1)+(1.0f-uv.x-uv.y)*getPosition(2);
   pc.addItem(pos, col);
 }
 
@@ -209,10 +218,11 @@ float Sphere::getAPointOnSurface(Intersection& itsc) const {
   return 1.0f/getArea();
 }
 
-// notice: itsc as in-out variable
-// Sphere::intersect set itsc.position directly
-// because its easier to calc normal and other params from pos
-void Sphere::intersect(const Ray& ray, Intersection& itsc) const {
+// notice: hit as in-out variable
+// Sphere::intersect only sets t, the position on the ray is set by 
+// Intersection::setHit, because its easier to calc normal and other 
+// params from pos
+void Sphere::intersect(const Ray& ray, HitRecord& hit, float tMin) const {
   glm::vec3 so = ray.o - this->center;
   // t*t+b*t+c = 0
   float b = 2.0f*glm::dot(ray.d, so);
@@ -221,21 +231,23 @@ void Sphere::intersect(const Ray& ray, Intersection& itsc) const {
   if(delta2 < 0) return;
   float delta = glm::sqrt(delta2);
   float t1 = 0.5f*(-b+delta), t2 = 0.5f*(-b-delta);
-  if(t1 < CUSTOM_EPSILON) return;
-  if(t2 < CUSTOM_EPSILON) itsc.updateItscInfo(t1, this, ray);
-  else itsc.updateItscInfo(t2, this, ray);
+  tMin = std::max(tMin, CUSTOM_EPSILON);
+  if(t1 < tMin) return;
+  if(t2 < tMin) hit.update(t1, this);
+  else hit.update(t2, this);
 }
 
-// just return whether intersect or not
-bool Sphere::intersectTest(const Ray& ray) const{
+// any of the two hits in [tMin, tMax)
+bool Sphere::intersectTest(const Ray& ray, float tMin, float tMax) const{
   glm::vec3 so = ray.o - this->center;
-  float b = glm::dot(ray.d, so);
+  float b = 2.0f*glm::dot(ray.d, so);
   float c = so.x*so.x+so.y*so.y+so.z*so.z - this->radius*this->radius;
   float delta2 = b*b - 4*c;
   if(delta2 < 0) return false;
-  float t1 = 0.5f*(-b+glm::sqrt(delta2));;
-  if(t1 < CUSTOM_EPSILON) return false;
-  return true;
+  float delta = glm::sqrt(delta2);
+  float t1 = 0.5f*(-b+delta), t2 = 0.5f*(-b-delta);
+  tMin = std::max(tMin, CUSTOM_EPSILON);
+  return (t2 >= tMin && t2 < tMax) || (t1 >= tMin && t1 < tMax);
 }
 
 //set normal, uv, and other for itsc from itsc.position
@@ -245,6 +257,15 @@ void Sphere::handleItscResult(Intersection& itsc) const{
   calcItscInfoFromNormal(itsc, normal);
 }
 
+// the same position, geoNormal and error as calcItscInfoFromNormal
+void Sphere::handleItscGeometry(Intersection& itsc) const{
+  glm::vec3 normal = glm::normalize(itsc.itscVtx.position - this->center);
+  itsc.geoNormal = normal;
+  itsc.itscVtx.position = center+radius*normal;
+  itsc.itscError = _Gamma(1)*glm::abs(center)+
+    _Gamma(5)*radius*glm::abs(normal);
+}
+
 void Sphere::genPrimPointCloud(PCShower& pc, glm::vec3 col) const{
   pc.addItem(uniSampleSphereDir()*radius+center, col);
 }
@@ -1,18 +1,49 @@
 #include "scene.hpp"
+#include "utility.hpp"
 #include "debug/analyse.hpp"
 #include <iostream>
+#include <algorithm>
+#include <unordered_set>
 
+// the other prims are owned by their meshes
 Scene::~Scene() {
-  for(const Primitive* p: primitives)
-    delete p;
+  for(Instance* instance: instances)
+    delete instance;
+  for(InstanceGeometry* geometry: instanceGeometries)
+    delete geometry;
 }
 
 void Scene::init() {
   std::cout<<"Build BVH"<<std::endl;
   buildBVH();
-  std::cout<<"Build BVH complete"<<std::endl;
+  std::cout<<"Build BVH complete, "<<bvh.getNodes().size()<<" nodes, "
+    "SAH cost: "<<bvh.getSAHCost()<<std::endl;
   if(lights.size()>0) calcLightDistribution();
   else std::cout<<"Warning: No Lights!"<<std::endl;
+  compileMaterials();
+}
+
+void Scene::compileMaterials() {
+  std::vector<const Material*> materials;
+  std::unordered_set<const Mesh*> meshes;
+  auto addMesh = [&](const Primitive* prim) {
+    const Mesh* mesh = prim->getMesh();
+    if(mesh && meshes.insert(mesh).second) 
+      materials.push_back(&mesh->material);
+  };
+  for(const Primitive* prim: primitives) addMesh(prim);
+  for(const InstanceGeometry* geometry: instanceGeometries)
+    for(const Primitive* prim: geometry->getPrims()) addMesh(prim);
+  materialCompiler.compile(materials);
+  std::cout<<"Compile materials: "<<materialCompiler.getProgramNum()<<
+    " programs, "<<materialCompiler.getLobeNum()<<" lobes"<<std::endl;
+}
+
+float Scene::getBXDF(const Material& mat, const ShadingPoint& itsc, 
+  const Ray& ray_o, const BXDF*& bxdf) const {
+  const ShadingProgram* program = materialCompiler.getProgram(&mat);
+  if(program) return program->getBXDF(itsc, ray_o, bxdf);
+  return mat.getBXDF(itsc, ray_o, bxdf);
 }
 
 void Scene::addModel(Model& model) {
@@ -21,6 +52,18 @@ void Scene::addModel(Model& model) {
 }
 
 void Scene::addLight(Light* light) {
+  if(light->getType() == Light::Shape) {
+    Model& model = static_cast<ShapeLight*>(light)->getModel();
+    std::vector<const Primitive*> vp;
+    model.toPrimitives(vp);
+    for(const Primitive* prim: vp) {
+      if(!instancedMeshes.count(prim->getMesh())) continue;
+      std::cout<<"Warning: shape light on instance geometry is not "
+        "supported, skipped"<<std::endl;
+      model.setLightForAllMeshes(nullptr);
+      return;
+    }
+  }
   light->addToScene(*this);
   ltIdx[light] = lights.size();
   lights.push_back(light);
@@ -44,8 +87,104 @@ void Scene::addPrimitives(std::vector<const Primitive*> prims) {
   primitives.insert(primitives.end(), prims.begin(), prims.end());
 }
 
+InstanceGeometry* Scene::addInstanceGeometry(Model& model) {
+  std::vector<const Primitive*> vp;
+  model.toPrimitives(vp);
+  for(const Primitive* prim: vp) {
+    if(!prim->getMesh() || !prim->getMesh()->material.light) continue;
+    std::cout<<"Warning: emissive model can not be instanced, "
+      "add it with a shape light"<<std::endl;
+    return nullptr;
+  }
+  model.setMediumForAllMeshes(globalMedium, false);
+  InstanceGeometry* geometry = new InstanceGeometry(model, bvh.getParams());
+  instanceGeometries.push_back(geometry);
+  for(const Primitive* prim: geometry->getPrims()) 
+    if(prim->getMesh()) instancedMeshes.insert(prim->getMesh());
+  return geometry;
+}
+
+Instance* Scene::addInstance(
+  const InstanceGeometry* geometry, const glm::mat4x4& toWorld) {
+  if(!geometry) return nullptr;
+  Instance* instance = new Instance(geometry, toWorld);
+  instances.push_back(instance);
+  primitives.push_back(instance);
+  return instance;
+}
+
+// refit only keeps the prims of the last build, the ones added after it
+// need a rebuild. so does an empty build, it has no cost to compare with
+void Scene::update() {
+  updatePrimIDs();
+  if((int)primitives.size() != bvh.getBuiltPrimNum() || 
+    bvh.getBuildSAHCost() <= 0.0f) bvh.build();
+  else {
+    bvh.refit();
+    float growth = bvh.getSAHCost()/bvh.getBuildSAHCost();
+    if(growth > bvh.getParams().maxRefitSAHGrowth) {
+      std::cout<<"Refit SAH cost grows "<<growth<<"x, rebuild BVH"<<std::endl;
+      bvh.build();
+    }
+  }
+  buildWideBVH();
+}
+
 void Scene::buildBVH() {
-  bvh.buildSAHBVH(0, primitives.size(), 0);
+  updatePrimIDs();
+  bvh.build();
+  buildWideBVH();
+}
+
+// the prims and instances added after init are only traced after 
+// update, which rebuilds the BVH for them, so the ids are refreshed 
+// with the BVH
+void Scene::updatePrimIDs() {
+  primIDs.clear();
+  for(int i = 0; i<(int)primitives.size(); i++) primIDs[primitives[i]] = i;
+}
+
+int Scene::getPrimID(const Primitive* prim) const {
+  auto it = primIDs.find(prim);
+  return it == primIDs.end() ? -1 : it->second;
+}
+
+void Scene::buildWideBVH() {
+  if(accelMode == AccelMode::WideBVH8 && !BVH8::SIMDSupported()) {
+    std::cout<<"Warning: AVX2 is not supported, use BVH4 instead"<<std::endl;
+    accelMode = AccelMode::WideBVH4;
+  }
+  if(accelMode == AccelMode::WideBVH4) {
+    bvh4.build(bvh, quantizedNodes);
+    std::cout<<"Collapse to BVH4, "<<bvh4.getNodeNum()<<" nodes, "
+      <<bvh4.getNodeBytes()/1024<<" KB"<<(quantizedNodes?" quantized":"")
+      <<", SIMD: "<<(bvh4.isSIMDEnabled()?"on":"off")<<std::endl;
+  }
+  if(accelMode == AccelMode::WideBVH8) {
+    bvh8.build(bvh, quantizedNodes);
+    std::cout<<"Collapse to BVH8, "<<bvh8.getNodeNum()<<" nodes, "
+      <<bvh8.getNodeBytes()/1024<<" KB"<<(quantizedNodes?" quantized":"")
+      <<std::endl;
+  }
+}
+
+void Scene::closestHit(const Ray& ray, HitRecord& hit, 
+  const Primitive* prim, float tMin) const {
+  switch(accelMode) {
+    case AccelMode::WideBVH4: bvh4.intersect(ray, hit, prim, tMin); break;
+    case AccelMode::WideBVH8: bvh8.intersect(ray, hit, prim, tMin); break;
+    default: bvh.intersect(ray, hit, prim, tMin);
+  }
+}
+
+bool Scene::anyHit(const Ray& ray, const Primitive* prim, 
+  float tMin, float tMax) const {
+
+  switch(accelMode) {
+    case AccelMode::WideBVH4: return bvh4.intersectTest(ray, prim, tMin, tMax);
+    case AccelMode::WideBVH8: return bvh8.intersectTest(ray, prim, tMin, tMax);
+    default: return bvh.intersectTest(ray, prim, tMin, tMax);
+  }
 }
 
 void Scene::calcLightDistribution() {
@@ -70,7 +209,8 @@ float Scene::sampleALight(const Light*& light) const{
 float Scene::dynamicSampleALight(const Light*& light, glm::vec3 evap) const{
   if(lights.size() == 1) {light = lights[0]; return 1.0f;}
   Intersection litsc; glm::vec3 dir, L;
-  DiscreteDistribution1D dd1d(lights.size());
+  ScratchScope scope(_ThreadArena);
+  DiscreteDistribution1D dd1d(_ThreadArena, lights.size());
   for(unsigned int i = 0; i<lights.size(); i++) {
     float pdf = lights[i]->getItscOnLight(litsc, evap);
     dir = evap - litsc.itscVtx.position;
@@ -101,7 +241,7 @@ void Scene::getPositionLightDD1D(
   glm::vec3 evap, DiscreteDistribution1D& dd1d) const{
   if(lights.size() == 1) return; // special judge lightnum=1
   Intersection litsc; glm::vec3 dir, L;
-  dd1d = DiscreteDistribution1D(lights.size());
+  dd1d.reset(lights.size());
   for(unsigned int i = 0; i<lights.size(); i++) {
     float pdf = lights[i]->getItscOnLight(litsc, evap);
     dir = evap - litsc.itscVtx.position;
@@ -128,57 +268,194 @@ BB3 Scene::getWholeBound() const{
   return bvh.getWholeBound();
 }
 
-Intersection Scene::intersect(
+HitRecord Scene::intersect(
   const Ray& ray, const Primitive* prim, float t_limit) const {
   //__StartTimeAnalyse__("itsc_sub")
-  Intersection itsc;
-  itsc.t = t_limit;
-  bvh.intersect(ray, itsc, 0, prim);
-  if(itsc.prim != nullptr) {
-    itsc.prim->handleItscResult(itsc);
-    itsc.prim->getMesh()->material.bumpMapping(itsc);
-  }
+  HitRecord hit(t_limit);
+  closestHit(ray, hit, prim);
   //__EndTimeAnalyse__
-  return itsc;
+  return hit;
+}
+
+namespace {
+
+// the prims of an instance are handled in object space
+inline void setHit(const Ray& ray, const HitRecord& hit, Intersection& itsc) {
+  glm::vec3 position = ray.pass(hit.t);
+  if(hit.instance) position = hit.instance->toObjectPoint(position);
+  itsc.setHit(hit, position);
+}
+
+}
+
+void Scene::handleItscResult(const Ray& ray, const HitRecord& hit, 
+  Intersection& itsc) const {
+  setHit(ray, hit, itsc);
+  itsc.prim->handleItscResult(itsc);
+  if(itsc.instance) itsc.instance->handleItscResult(itsc);
+  itsc.prim->getMesh()->material.bumpMapping(itsc);
+}
+
+void Scene::handleItscGeometry(const Ray& ray, const HitRecord& hit, 
+  Intersection& itsc) const {
+  setHit(ray, hit, itsc);
+  itsc.prim->handleItscGeometry(itsc);
+  if(itsc.instance) itsc.instance->handleItscGeometry(itsc);
+}
+
+// the wide BVHs are collapsed from bvh, so the packet can always use it
+void Scene::intersect(const RayPacket& packet, HitRecord* hits) const {
+  for(int i = 0; i<packet.size; i++) hits[i] = HitRecord();
+  bvh.intersectPacket(packet.rays, packet.size, hits);
+}
+
+bool Scene::useStreamTraversal() const {
+  return accelMode == AccelMode::BinaryBVH && 
+    (int)bvh.getNodes().size() >= bvh.getParams().streamMinNodes;
+}
+
+void Scene::intersect(const Ray* rays, int n, HitRecord* hits, 
+  const Primitive* const* prims) const {
+  for(int i = 0; i<n; i++) hits[i] = HitRecord();
+  if(useStreamTraversal()) bvh.intersectStream(rays, n, hits, prims);
+  else {
+    for(int i = 0; i<n; i++) 
+      closestHit(rays[i], hits[i], prims ? prims[i] : nullptr);
+  }
+}
+
+void Scene::occlude(const Ray* rays, const float* t_limits, int n, 
+  bool* occluded, const Primitive* const* prims_avd) const {
+  if(useStreamTraversal()) {
+    bvh.intersectTestStream(rays, n, t_limits, occluded, prims_avd);
+    return;
+  }
+  for(int i = 0; i<n; i++) 
+    occluded[i] = anyHit(rays[i], prims_avd ? prims_avd[i] : nullptr, 
+      0.0f, t_limits[i]);
+}
+
+namespace {
+
+// a thread of a batch query takes at least this many rays
+constexpr int MinBatchPerThread = 1<<12;
+
+int getBatchThreadNum(int n, int threadNum) {
+  if(threadNum <= 0) threadNum = std::thread::hardware_concurrency();
+  return std::max(1, std::min(threadNum, n/MinBatchPerThread));
+}
+
+// chunk of each thread, a multiple of 32 for the occlusion bits
+int getBatchChunk(int n, int threadNum) {
+  return ((n + threadNum - 1)/threadNum + 31) & ~31;
+}
+
+}
+
+// the key is the direction octant in the 3 high bits, then the morton 
+// code of the origin in the scene bound. an empty scene has no bound,
+// the queries keep their order and all miss
+void Scene::sortQueries(const RayQuery* queries, int start, int end,
+  std::vector<std::pair<unsigned int, int>>& order) const {
+  order.resize(end - start);
+  if(bvh.getNodes().empty()) {
+    for(int i = start; i<end; i++) order[i - start] = {0, i};
+    return;
+  }
+  BB3 bound = bvh.getWholeBound();
+  glm::vec3 diag = bound.getDiagonal(), scale;
+  for(int axis = 0; axis<3; axis++) 
+    scale[axis] = diag[axis] > 0.0f ? 1023.0f/diag[axis] : 0.0f;
+  for(int i = start; i<end; i++) {
+    const Ray& ray = queries[i].ray;
+    glm::vec3 q = glm::clamp((ray.o - bound.getMin())*scale, 0.0f, 1023.0f);
+    unsigned int octant = (ray.d.x < 0) | (ray.d.y < 0)<<1 | (ray.d.z < 0)<<2;
+    order[i - start] = {octant<<29 | encodeMorton3(q)>>1, i};
+  }
+  std::sort(order.begin(), order.end());
+}
+
+void Scene::intersect(const RayQuery* queries, int n, RayHit* hits, 
+  int threadNum) const {
+  threadNum = getBatchThreadNum(n, threadNum);
+  int chunk = getBatchChunk(n, threadNum);
+  parallelFor(threadNum, [&](int t) {
+    int start = std::min(n, t*chunk), end = std::min(n, start+chunk);
+    std::vector<std::pair<unsigned int, int>> order;
+    sortQueries(queries, start, end, order);
+    for(const auto& o: order) {
+      const RayQuery& query = queries[o.second];
+      RayHit& hit = hits[o.second];
+      HitRecord rec(query.tMax);
+      closestHit(query.ray, rec, nullptr, query.tMin);
+      if(!rec.prim) {hit = RayHit(); continue;}
+      hit.t = rec.t;
+      hit.uv = rec.localUV;
+      if(rec.instance) {
+        hit.primID = getPrimID(rec.instance);
+        hit.instPrimID = rec.instance->getGeometry()->getPrimID(rec.prim);
+      }
+      else {
+        hit.primID = getPrimID(rec.prim);
+        hit.instPrimID = -1;
+      }
+    }
+  });
+}
+
+void Scene::occlude(const RayQuery* queries, int n, unsigned int* occluded, 
+  int threadNum) const {
+  threadNum = getBatchThreadNum(n, threadNum);
+  int chunk = getBatchChunk(n, threadNum);
+  parallelFor(threadNum, [&](int t) {
+    int start = std::min(n, t*chunk), end = std::min(n, start+chunk);
+    for(int w = start/32; w<(end+31)/32; w++) occluded[w] = 0;
+    std::vector<std::pair<unsigned int, int>> order;
+    sortQueries(queries, start, end, order);
+    for(const auto& o: order) {
+      const RayQuery& query = queries[o.second];
+      if(anyHit(query.ray, nullptr, query.tMin, query.tMax)) 
+        occluded[o.second/32] |= 1u<<(o.second%32);
+    }
+  });
 }
 
 // For volume BXDF direct light test, ignore medium bounds
-Intersection Scene::intersectDirectly(
-  const Ray& ray, const Medium* medium, glm::vec3& tr) const {
+HitRecord Scene::intersectDirectly(const Ray& ray, const Medium* medium, 
+  glm::vec3& tr, Ray& hitRay) const {
 
   tr = glm::vec3(1.0f);
-  Intersection itsc;
-  Ray testRay = ray;
+  HitRecord hit;
+  Intersection itsc; // of the medium bounds
+  hitRay = ray;
   for(int bounce = 0; bounce < 24; bounce++) { 
-    itsc = intersect(testRay, nullptr);
-    if(medium) tr*=medium->tr(itsc.t);
+    hit = intersect(hitRay);
+    if(medium) tr*=medium->tr(hit.t);
 
-    if(!itsc.prim) return itsc;
-    const Mesh* mesh = itsc.prim->getMesh();
+    if(!hit.prim) return hit;
+    const Mesh* mesh = hit.prim->getMesh();
 
     if(mesh->purpose == Mesh::MeshPurpose::MediumBound) {
-      testRay.o = itsc.itscVtx.position;
-      itsc.maxErrorOffset(testRay.d, testRay.o);
-      if(itsc.cosTheta(testRay.d) < 0) medium = mesh->material.mediumInside;
+      handleItscGeometry(hitRay, hit, itsc);
+      hitRay.o = itsc.itscVtx.position;
+      itsc.maxErrorOffset(hitRay.d, hitRay.o);
+      if(itsc.cosTheta(hitRay.d) < 0) medium = mesh->material.mediumInside;
       else medium = mesh->material.mediumOutside;
     }
-    else return itsc;
+    else return hit;
   }
   std::cout<<"Scene::intersectDirectly: Lots of test, "
     "may caused bu complex model or numerical error"<<std::endl;
-  return itsc;
+  return hit;
 }
 
 bool Scene::intersectTest(const Ray& ray, const Primitive* prim) const {
-  return bvh.intersectTest(ray, 0, prim);
+  return anyHit(ray, prim);
 }
 
 // no volume direct test
 bool Scene::occlude(const Ray& ray, float t_limit, const Primitive* prim_avd) const {
-  Intersection itsc;
-  itsc.t = t_limit;
-  bvh.intersect(ray, itsc, 0, prim_avd);
-  return itsc.prim;
+  return anyHit(ray, prim_avd, 0.0f, t_limit);
 }
 
 // For volume direct light test
@@ -187,18 +464,22 @@ bool Scene::occlude(const Ray& ray, float t_limit, glm::vec3& tr,
   const Medium* medium, const Primitive* prim_avd) const {
 
   tr = glm::vec3(1.0f);
-  Intersection itsc;
   Ray testRay = ray;
   for(int bounce = 0; bounce < 24; bounce++) { // limit test times
-    itsc = intersect(testRay, nullptr, t_limit);
-    if(medium) tr*=medium->tr(itsc.t);
+    // medium bounds must be passed in order, so this is a closest hit, 
+    // but only the medium bounds need the itsc info
+    HitRecord hit(t_limit);
+    closestHit(testRay, hit, nullptr);
+    if(medium) tr*=medium->tr(hit.t);
     // if no itsc, it can only be caused by numerical error
     // when this case, the light have itsc in fact
-    if(!itsc.prim || itsc.prim == prim_avd) return false;
-    const Mesh* mesh = itsc.prim->getMesh();
+    if(!hit.prim || hit.prim == prim_avd) return false;
+    const Mesh* mesh = hit.prim->getMesh();
     if(mesh->purpose == Mesh::MeshPurpose::MediumBound) {
+      Intersection itsc;
+      handleItscGeometry(testRay, hit, itsc);
       // TODO: MediumBound's medium is not right
-      t_limit -= itsc.t;
+      t_limit -= hit.t;
       testRay.o = itsc.itscVtx.position;
       itsc.maxErrorOffset(testRay.d, testRay.o);
       if(itsc.cosTheta(testRay.d) < 0) medium = mesh->material.mediumInside;
@@ -211,7 +492,12 @@ bool Scene::occlude(const Ray& ray, float t_limit, glm::vec3& tr,
   return true;
 }
 
+// same as BVH::occlude, but through the selected acceleration
 bool Scene::occlude(const Intersection& it1, const Intersection& it2, 
   Ray& testRay, float& rayLen) const {
-    return bvh.occlude(it1, it2, testRay, rayLen);
+  testRay.o = it1.itscVtx.position;
+  glm::vec3 dir = it2.itscVtx.position - it1.itscVtx.position;
+  rayLen = glm::length(dir);
+  testRay.d = glm::normalize(dir);
+  return anyHit(testRay, it2.prim, 0.0f, rayLen);
 }
\ No newline at end of file
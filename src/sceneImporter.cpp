@@ -10,7 +10,8 @@
 
 std::string SceneImporter::curDirectory = std::string();
 
-bool SceneImporter::loadSceneFromFile(const char* path, std::vector<Mesh*>& meshes) {
+bool SceneImporter::loadSceneFromFile(
+  const char* path, std::vector<Mesh*>& meshes, bool optimize) {
   Assimp::Importer importer;
   const aiScene* scene = importer.ReadFile(
     path, 
@@ -25,34 +26,38 @@ bool SceneImporter::loadSceneFromFile(const char* path, std::vector<Mesh*>& mesh
   std::string strFilename(path);
   curDirectory = strFilename.substr(0, strFilename.find_last_of('/'));
 
-  processNode(scene, scene->mRootNode, meshes);
+  MeshOptimizeStats stats;
+  processNode(scene, scene->mRootNode, meshes, optimize ? &stats : nullptr);
   std::cout<<"Load model: "<<path<<" successfully!"<<std::endl;
+  if(optimize) stats.print("Mesh optimization");
   return true;
 }
 
 
 void SceneImporter::processNode(
-  const aiScene *scene, aiNode *node, std::vector<Mesh*>& meshes){
+  const aiScene *scene, aiNode *node, std::vector<Mesh*>& meshes,
+  MeshOptimizeStats* stats){
 
   for(unsigned int i = 0; i < node->mNumMeshes; i++){
     aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-    meshes.push_back(processMesh(scene, mesh));
+    meshes.push_back(processMesh(scene, mesh, stats));
   }
   for(unsigned int i = 0; i < node->mNumChildren; i++){
-      processNode(scene, node->mChildren[i], meshes);
+      processNode(scene, node->mChildren[i], meshes, stats);
   }
 }
 
-Mesh* SceneImporter::processMesh(const aiScene *scene, aiMesh *mesh) {
+Mesh* SceneImporter::processMesh(
+  const aiScene *scene, aiMesh *mesh, MeshOptimizeStats* stats) {
   // data to fill
   VertexMesh* modelMesh = new VertexMesh;
-  Vertex* vertices = new Vertex[mesh->mNumVertices];
-  modelMesh->vertices.resize(mesh->mNumVertices);
+  modelMesh->vertices.reserve(mesh->mNumVertices);
 
   glm::vec3 vector; glm::vec2 vec;
   // walk through each of the mesh's vertices
   for(unsigned int i = 0; i < mesh->mNumVertices; i++) {
-    Vertex* vertex = &vertices[i];
+    Vertex vtx;
+    Vertex* vertex = &vtx;
     
     // positions
     vector.x = mesh->mVertices[i].x;
@@ -92,13 +97,14 @@ Mesh* SceneImporter::processMesh(const aiScene *scene, aiMesh *mesh) {
         vertex->btangent = glm::normalize(vector);
     }
       
-    modelMesh->vertices[i] = vertex;
+    modelMesh->vertices.addVertex(vtx);
   }
   for(unsigned int i = 0; i < mesh->mNumFaces; i++) {
     aiFace face = mesh->mFaces[i];
     for(unsigned int j = 0; j < face.mNumIndices; j++)
       modelMesh->indices.push_back(face.mIndices[j]);        
   }
+  if(stats) stats->add(modelMesh->optimize());
   aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];    
   MaterialInfo minfo; aiColor3D IOR;
   loadMaterialTextures(material, aiTextureType_DIFFUSE, minfo.diffuse);
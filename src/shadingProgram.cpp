@@ -0,0 +1,335 @@
+#include "shadingProgram.hpp"
+
+#include "material.hpp"
+#include "bxdf.hpp"
+#include "blender.hpp"
+#include "sampler.hpp"
+
+#include <algorithm>
+
+namespace {
+
+// a reflection lobe only scatters to the side of the normal, a
+// transmission lobe only to the other side
+inline bool isLobeSide(
+  const BXDF* bxdf, const ShadingPoint& itsc, const Ray& ray_i) {
+  int type = bxdf->getType();
+  if(_IsType(type, REFLECT)) return itsc.cosTheta(ray_i.d) >= 0.0f;
+  if(_IsType(type, TRANSMISSION)) return itsc.cosTheta(ray_i.d) <= 0.0f;
+  return true;
+}
+
+inline float lobeAlbedo(
+  const BXDF* bxdf, const ShadingPoint& itsc, const Ray& ray_o) {
+  return Luminance(bxdf->getAlbedo(itsc, ray_o));
+}
+
+}
+
+void ShadingProgram::getCoefficients(
+  const ShadingPoint& itsc, const Ray& ray_o, float* coe) const {
+  float blend[MaxSelBlenders];
+  for(int k = 0; k<selBlenderNum; k++)
+    blend[k] = glm::clamp(
+      selBlenders[k]->getBlendVal(itsc, ray_o), 0.0f, 1.0f);
+  for(int i = 0; i<lobeNum; i++) {
+    const ShadingLobe& lobe = lobes[i];
+    float c = lobe.prob*lobe.weight;
+    for(int k = lobe.selStart; k<lobe.selEnd; k++) {
+      const SelectTerm& term = selTerms[k];
+      c *= term.complement ? 1.0f-blend[term.blender]:blend[term.blender];
+    }
+    for(int k = lobe.wStart; k<lobe.wEnd; k++)
+      c *= weightTerms[k]->getBlendVal(itsc, ray_o);
+    coe[i] = c;
+  }
+}
+
+float ShadingProgram::getBXDF(
+  const ShadingPoint& itsc, const Ray& ray_o, const BXDF*& bxdf) const {
+  if(lobeNum == 1) {
+    float weight = lobes[0].weight;
+    for(int k = lobes[0].wStart; k<lobes[0].wEnd; k++)
+      weight *= weightTerms[k]->getBlendVal(itsc, ray_o);
+    bxdf = lobes[0].bxdf;
+    return weight;
+  }
+  if(unitNum == 1) {
+    bxdf = group;
+    return 1.0f;
+  }
+
+  float coe[MaxLobes], albedo[MaxLobes];
+  getCoefficients(itsc, ray_o, coe);
+  float groupAlbedo = 0.0f, totAlbedo = 0.0f;
+  for(int i = 0; i<lobeNum; i++) {
+    albedo[i] = coe[i] > 0.0f ? 
+      coe[i]*lobeAlbedo(lobes[i].bxdf, itsc, ray_o) : 0.0f;
+    if(lobes[i].grouped) groupAlbedo += albedo[i];
+    totAlbedo += albedo[i];
+  }
+  if(totAlbedo <= 0.0f) {
+    bxdf = group ? group : lobes[0].bxdf;
+    return 0.0f;
+  }
+
+  float u = _ThreadSampler.get1()*totAlbedo;
+  if(u < groupAlbedo) {
+    bxdf = group;
+    return totAlbedo/groupAlbedo;
+  }
+  u -= groupAlbedo;
+  // a lobe of zero albedo is never picked
+  int last = -1;
+  for(int i = 0; i<lobeNum; i++) {
+    if(lobes[i].grouped || albedo[i] <= 0.0f) continue;
+    last = i;
+    if(u < albedo[i]) break;
+    u -= albedo[i];
+  }
+  bxdf = lobes[last].bxdf;
+  return coe[last]*totAlbedo/albedo[last];
+}
+
+/************************LobeGroup******************************/
+
+bool LobeGroup::getLobeProbs(
+  const ShadingPoint& itsc, const Ray& ray_o, float* coe, float* prob) const {
+  program->getCoefficients(itsc, ray_o, coe);
+  float sum = 0.0f;
+  for(int i = 0; i<program->lobeNum; i++) {
+    const ShadingLobe& lobe = program->lobes[i];
+    prob[i] = lobe.grouped && coe[i] > 0.0f ? 
+      coe[i]*lobeAlbedo(lobe.bxdf, itsc, ray_o) : 0.0f;
+    sum += prob[i];
+  }
+  if(sum <= 0.0f) return false;
+  for(int i = 0; i<program->lobeNum; i++) prob[i] /= sum;
+  return true;
+}
+
+glm::vec3 LobeGroup::evaluate(
+  const ShadingPoint& itsc, const Ray& ray_o, const Ray& ray_i) const {
+  float coe[ShadingProgram::MaxLobes];
+  program->getCoefficients(itsc, ray_o, coe);
+  glm::vec3 f(0.0f);
+  for(int i = 0; i<program->lobeNum; i++) {
+    const ShadingLobe& lobe = program->lobes[i];
+    if(lobe.grouped && coe[i] != 0.0f && isLobeSide(lobe.bxdf, itsc, ray_i))
+      f += coe[i]*lobe.bxdf->evaluate(itsc, ray_o, ray_i);
+  }
+  return f;
+}
+
+glm::vec3 LobeGroup::sample_ev(
+  const ShadingPoint& itsc, const Ray& ray_o, Ray& ray_i) const {
+  float coe[ShadingProgram::MaxLobes], prob[ShadingProgram::MaxLobes];
+  if(!getLobeProbs(itsc, ray_o, coe, prob)) return glm::vec3(0.0f);
+
+  float u = _ThreadSampler.get1();
+  int last = -1;
+  for(int i = 0; i<program->lobeNum; i++) {
+    if(prob[i] <= 0.0f) continue;
+    last = i;
+    if(u < prob[i]) break;
+    u -= prob[i];
+  }
+  if(IsBlack(program->lobes[last].bxdf->sample_ev(itsc, ray_o, ray_i)))
+    return glm::vec3(0.0f);
+
+  glm::vec3 f(0.0f);
+  float pdf = 0.0f;
+  for(int i = 0; i<program->lobeNum; i++) {
+    const ShadingLobe& lobe = program->lobes[i];
+    if(prob[i] <= 0.0f || !isLobeSide(lobe.bxdf, itsc, ray_i)) continue;
+    f += coe[i]*lobe.bxdf->evaluate(itsc, ray_o, ray_i);
+    pdf += prob[i]*lobe.bxdf->sample_pdf(itsc, ray_i, ray_o);
+  }
+  if(pdf <= 0.0f) return glm::vec3(0.0f);
+  return f/pdf;
+}
+
+float LobeGroup::sample_pdf(
+  const ShadingPoint& itsc, const Ray& ray_i, const Ray& ray_o) const {
+  float coe[ShadingProgram::MaxLobes], prob[ShadingProgram::MaxLobes];
+  if(!getLobeProbs(itsc, ray_o, coe, prob)) return 0.0f;
+  float pdf = 0.0f;
+  for(int i = 0; i<program->lobeNum; i++) {
+    const ShadingLobe& lobe = program->lobes[i];
+    if(prob[i] > 0.0f && isLobeSide(lobe.bxdf, itsc, ray_i))
+      pdf += prob[i]*lobe.bxdf->sample_pdf(itsc, ray_i, ray_o);
+  }
+  return pdf;
+}
+
+bool LobeGroup::needMIS(const ShadingPoint& itsc) const {
+  for(int i = 0; i<program->lobeNum; i++)
+    if(program->lobes[i].grouped && program->lobes[i].bxdf->needMIS(itsc))
+      return true;
+  return false;
+}
+
+glm::vec3 LobeGroup::getAlbedo(
+  const ShadingPoint& itsc, const Ray& ray_o) const {
+  float coe[ShadingProgram::MaxLobes];
+  program->getCoefficients(itsc, ray_o, coe);
+  glm::vec3 albedo(0.0f);
+  for(int i = 0; i<program->lobeNum; i++)
+    if(program->lobes[i].grouped)
+      albedo += coe[i]*program->lobes[i].bxdf->getAlbedo(itsc, ray_o);
+  return albedo;
+}
+
+/************************MaterialCompiler******************************/
+
+void MaterialCompiler::clear() {
+  for(LobeGroup* group: groups) delete group;
+  groups.clear();
+  lobes.clear();
+  selTerms.clear();
+  weightTerms.clear();
+  selBlenders.clear();
+  ranges.clear();
+  programs.clear();
+  programIDs.clear();
+  materialPrograms.clear();
+}
+
+// the probability of a Mixed child is the clamped blend value, which is
+// the same as 'get1() < blend' of MixedBXDF::getBXDF
+void MaterialCompiler::compileNode(
+  const BXDFNode* node, const PathTerms& path, int blenderStart) {
+  switch(node->getNodeType()) {
+    case BXDFNode::Leaf: {
+      if(path.prob <= 0.0f) return;
+      ShadingLobe lobe;
+      lobe.bxdf = static_cast<const BXDF*>(node);
+      lobe.prob = path.prob;
+      lobe.weight = path.weight;
+      lobe.grouped = false;
+      lobe.selStart = selTerms.size();
+      selTerms.insert(
+        selTerms.end(), path.selTerms.begin(), path.selTerms.end());
+      lobe.selEnd = selTerms.size();
+      lobe.wStart = weightTerms.size();
+      weightTerms.insert(
+        weightTerms.end(), path.weightTerms.begin(), path.weightTerms.end());
+      lobe.wEnd = weightTerms.size();
+      lobes.push_back(lobe);
+      break;
+    }
+    case BXDFNode::Weighted: {
+      const WeightedBXDF* wnode = static_cast<const WeightedBXDF*>(node);
+      const Blender* blender = wnode->getBlender();
+      PathTerms child = path;
+      if(blender->getType() == Blender::Fix)
+        child.weight *= static_cast<const FixBlender*>(blender)->getBlendCoe();
+      else child.weightTerms.push_back(blender);
+      compileNode(wnode->getChild(), child, blenderStart);
+      break;
+    }
+    case BXDFNode::Mixed: {
+      const MixedBXDF* mnode = static_cast<const MixedBXDF*>(node);
+      const Blender* blender = mnode->getBlender();
+      PathTerms child1 = path, child2 = path;
+      if(blender->getType() == Blender::Fix) {
+        float blend = glm::clamp(
+          static_cast<const FixBlender*>(blender)->getBlendCoe(), 0.0f, 1.0f);
+        child1.prob *= blend;
+        child2.prob *= 1.0f-blend;
+      }
+      else {
+        auto it = std::find(
+          selBlenders.begin()+blenderStart, selBlenders.end(), blender);
+        int idx = it - (selBlenders.begin()+blenderStart);
+        if(it == selBlenders.end()) selBlenders.push_back(blender);
+        child1.selTerms.push_back({idx, false});
+        child2.selTerms.push_back({idx, true});
+      }
+      compileNode(mnode->getChild(0), child1, blenderStart);
+      compileNode(mnode->getChild(1), child2, blenderStart);
+      break;
+    }
+    default: {
+      const AddBXDF* anode = static_cast<const AddBXDF*>(node);
+      PathTerms child = path;
+      child.prob *= 0.5f;
+      child.weight *= 2.0f;
+      compileNode(anode->getChild(0), child, blenderStart);
+      compileNode(anode->getChild(1), child, blenderStart);
+      break;
+    }
+  }
+}
+
+int MaterialCompiler::compileTree(const BXDFNode* root) {
+  auto it = programIDs.find(root);
+  if(it != programIDs.end()) return it->second;
+
+  Range range;
+  range.lobeStart = lobes.size();
+  range.blenderStart = selBlenders.size();
+  int selStart = selTerms.size(), wStart = weightTerms.size();
+  compileNode(root, PathTerms(), range.blenderStart);
+  range.lobeEnd = lobes.size();
+  range.blenderEnd = selBlenders.size();
+
+  int lobeNum = range.lobeEnd - range.lobeStart;
+  int blenderNum = range.blenderEnd - range.blenderStart;
+  if(lobeNum == 0 || lobeNum > ShadingProgram::MaxLobes ||
+    blenderNum > ShadingProgram::MaxSelBlenders) {
+    lobes.resize(range.lobeStart);
+    selBlenders.resize(range.blenderStart);
+    selTerms.resize(selStart);
+    weightTerms.resize(wStart);
+    return programIDs[root] = -1;
+  }
+
+  // the lobes of a surface which are not delta go to the group
+  int groupNum = 0;
+  for(int i = range.lobeStart; i<range.lobeEnd; i++) {
+    int type = lobes[i].bxdf->getType();
+    lobes[i].grouped = (type & BXDF::RTBoth) && _Connectable(type);
+    groupNum += lobes[i].grouped;
+  }
+  if(groupNum < 2)
+    for(int i = range.lobeStart; i<range.lobeEnd; i++) 
+      lobes[i].grouped = false;
+  ranges.push_back(range);
+  return programIDs[root] = ranges.size()-1;
+}
+
+void MaterialCompiler::compile(const std::vector<const Material*>& materials) {
+  clear();
+  std::vector<int> ids(materials.size(), -1);
+  for(unsigned int i = 0; i<materials.size(); i++)
+    if(materials[i]->bxdfNode) ids[i] = compileTree(materials[i]->bxdfNode);
+
+  // the arrays do not grow any more
+  for(const Range& range: ranges) {
+    ShadingProgram program;
+    program.lobes = lobes.data()+range.lobeStart;
+    program.lobeNum = range.lobeEnd - range.lobeStart;
+    program.selTerms = selTerms.data();
+    program.weightTerms = weightTerms.data();
+    program.selBlenders = selBlenders.data()+range.blenderStart;
+    program.selBlenderNum = range.blenderEnd - range.blenderStart;
+    program.group = nullptr;
+    program.unitNum = program.lobeNum;
+    programs.push_back(program);
+  }
+  for(ShadingProgram& program: programs) {
+    int type = 0, groupNum = 0;
+    for(int i = 0; i<program.lobeNum; i++) {
+      if(!program.lobes[i].grouped) continue;
+      type |= program.lobes[i].bxdf->getType();
+      groupNum++;
+    }
+    if(groupNum == 0) continue;
+    groups.push_back(new LobeGroup(&program, type));
+    program.group = groups.back();
+    program.unitNum = program.lobeNum - groupNum + 1;
+  }
+  for(unsigned int i = 0; i<materials.size(); i++)
+    if(ids[i] >= 0) materialPrograms[materials[i]] = &programs[ids[i]];
+}
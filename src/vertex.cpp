@@ -0,0 +1,112 @@
+#include "vertex.hpp"
+
+#include <cstring>
+#include <tuple>
+
+void VertexStreams::reserve(int n) {
+  positions.reserve(n);
+  normals.reserve(n);
+  tangents.reserve(n);
+  if(halfUV) halfUVs.reserve(n);
+  else uvs.reserve(n);
+}
+
+void VertexStreams::addVertex(const Vertex& vtx) {
+  positions.emplace_back();
+  normals.emplace_back();
+  tangents.emplace_back();
+  if(halfUV) halfUVs.emplace_back();
+  else uvs.emplace_back();
+  setVertex(positions.size()-1, vtx);
+}
+
+void VertexStreams::setVertex(int i, const Vertex& vtx) {
+  positions[i] = vtx.position;
+  normals[i] = EncodeOctahedral(vtx.normal);
+  bool bneg = glm::dot(
+    glm::cross(vtx.tangent, vtx.normal), vtx.btangent) < 0.0f;
+  tangents[i] = (EncodeOctahedral(vtx.tangent)&~BSignBit) | 
+    (bneg ? BSignBit : 0);
+  if(halfUV) halfUVs[i] = glm::packHalf2x16(vtx.uv);
+  else uvs[i] = vtx.uv;
+}
+
+Vertex VertexStreams::getVertex(int i) const {
+  Vertex vtx(positions[i]);
+  float bsign;
+  vtx.uv = getUV(i);
+  vtx.normal = getNormal(i);
+  vtx.tangent = getTangent(i, bsign);
+  vtx.btangent = bsign*glm::cross(vtx.tangent, vtx.normal);
+  return vtx;
+}
+
+namespace {
+
+// the bits of the attributes, +0 and -0 are different vertices
+inline std::tuple<uint32_t, uint32_t, uint32_t, uint32_t, uint32_t, 
+  uint32_t, uint32_t> attributeBits(
+  const glm::vec3& p, uint32_t n, uint32_t t, const glm::vec2& uv) {
+  uint32_t b[5];
+  std::memcpy(b, &p.x, 4); std::memcpy(b+1, &p.y, 4); 
+  std::memcpy(b+2, &p.z, 4);
+  std::memcpy(b+3, &uv.x, 4); std::memcpy(b+4, &uv.y, 4);
+  return std::make_tuple(b[0], b[1], b[2], n, t, b[3], b[4]);
+}
+
+}
+
+bool VertexStreams::lessVertex(int a, int b) const {
+  return attributeBits(positions[a], normals[a], tangents[a], getUV(a)) < 
+    attributeBits(positions[b], normals[b], tangents[b], getUV(b));
+}
+
+bool VertexStreams::equalVertex(int a, int b) const {
+  return attributeBits(positions[a], normals[a], tangents[a], getUV(a)) == 
+    attributeBits(positions[b], normals[b], tangents[b], getUV(b));
+}
+
+void VertexStreams::reorder(const std::vector<int>& order) {
+  #define REORDER(stream) if(!stream.empty()) {\
+    decltype(stream) res(order.size());\
+    for(unsigned int i = 0; i<order.size(); i++) res[i] = stream[order[i]];\
+    stream.swap(res);}
+  REORDER(positions)
+  REORDER(normals)
+  REORDER(tangents)
+  REORDER(uvs)
+  REORDER(halfUVs)
+  #undef REORDER
+}
+
+void VertexStreams::setHalfUV(bool half) {
+  if(half == halfUV) return;
+  if(half) {
+    halfUVs.resize(uvs.size());
+    for(unsigned int i = 0; i<uvs.size(); i++) 
+      halfUVs[i] = glm::packHalf2x16(uvs[i]);
+    std::vector<glm::vec2>().swap(uvs);
+  }
+  else {
+    uvs.resize(halfUVs.size());
+    for(unsigned int i = 0; i<halfUVs.size(); i++) 
+      uvs[i] = glm::unpackHalf2x16(halfUVs[i]);
+    std::vector<uint32_t>().swap(halfUVs);
+  }
+  halfUV = half;
+}
+
+void VertexStreams::transform(
+  const glm::mat4x4& trans, const glm::mat3x3& transT_inv) {
+  for(int i = 0; i<size(); i++) {
+    Vertex vtx = getVertex(i);
+    vtx.transform(trans, transT_inv);
+    setVertex(i, vtx);
+  }
+}
+
+std::size_t VertexStreams::getMemory() const {
+  return positions.size()*sizeof(glm::vec3) + 
+    (normals.size()+tangents.size()+halfUVs.size())*sizeof(uint32_t) + 
+    uvs.size()*sizeof(glm::vec2);
+}
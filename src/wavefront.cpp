@@ -0,0 +1,286 @@
+#include "wavefront.hpp"
+#include "utility.hpp"
+#include "arena.hpp"
+
+#include <algorithm>
+
+using BType = BXDF::BXDFNature;
+
+namespace {
+
+// SoA path states, the slots [0, size) are in flight.
+// drawn from the arena of the render call
+struct PathQueue {
+  ScratchVector<Ray> ray; // the ray to extend, ray_o while shading
+  ScratchVector<HitRecord> hit; // of ray, written by extend
+  ScratchVector<Intersection> itsc; // built from hit to shade
+  ScratchVector<glm::vec3> beta, L;
+  ScratchVector<glm::vec2> rasPos;
+  ScratchVector<int> bounce, lastBType;
+  ScratchVector<char> alive, needMIS;
+  // bxdf pdf of ray at its origin, the MIS weight when ray hits a light
+  ScratchVector<float> lastPdfw;
+  ScratchVector<DiscreteDistribution1D> ldd1d;
+  ScratchVector<const BXDF*> bxdf;
+  ScratchVector<float> bxdfWeight;
+  // the random numbers of the path, copied to _ThreadSampler to shade
+  ScratchVector<GeneralSampler> sampler;
+  int size = 0;
+
+  PathQueue(int capacity, ScratchArena& arena): 
+    ray(capacity, Ray(), &arena), hit(capacity, HitRecord(), &arena),
+    itsc(capacity, Intersection(), &arena),
+    beta(capacity, glm::vec3(), &arena), L(capacity, glm::vec3(), &arena),
+    rasPos(capacity, glm::vec2(), &arena), bounce(capacity, 0, &arena),
+    lastBType(capacity, 0, &arena), alive(capacity, 0, &arena), 
+    needMIS(capacity, 0, &arena), lastPdfw(capacity, 0.0f, &arena), 
+    ldd1d(capacity, DiscreteDistribution1D(arena), &arena), 
+    bxdf(capacity, nullptr, &arena), bxdfWeight(capacity, 0.0f, &arena),
+    sampler(capacity, GeneralSampler(), &arena) {}
+
+  void start(int i, const Ray& r, glm::vec2 pos, int sampleIndex) {
+    ray[i] = r; rasPos[i] = pos;
+    sampler[i].startSample(glm::ivec2(pos), sampleIndex);
+    beta[i] = glm::vec3(1.0f); L[i] = glm::vec3(0.0f);
+    bounce[i] = 0; lastBType[i] = BType::DELTA;
+    alive[i] = true; needMIS[i] = false;
+  }
+
+  // move slot i to j between bounces, hit and itsc are not alive then.
+  // ldd1d is swapped to keep its memory
+  void move(int i, int j) {
+    ray[j] = ray[i];
+    beta[j] = beta[i]; L[j] = L[i]; rasPos[j] = rasPos[i];
+    bounce[j] = bounce[i]; lastBType[j] = lastBType[i];
+    alive[j] = alive[i]; needMIS[j] = needMIS[i];
+    lastPdfw[j] = lastPdfw[i];
+    sampler[j] = sampler[i];
+    std::swap(ldd1d[j], ldd1d[i]);
+  }
+};
+
+// the light samples of a shade stage, L is added if not occluded
+struct ShadowQueue {
+  ScratchVector<Ray> ray;
+  ScratchVector<float> tMax;
+  ScratchVector<const Primitive*> prim;
+  ScratchVector<glm::vec3> L;
+  ScratchVector<int> path;
+  bool* occluded; // vector<bool> has no data()
+  int size = 0;
+
+  ShadowQueue(int capacity, ScratchArena& arena): 
+    ray(capacity, Ray(), &arena), tMax(capacity, 0.0f, &arena),
+    prim(capacity, nullptr, &arena), L(capacity, glm::vec3(), &arena), 
+    path(capacity, 0, &arena), occluded(arena.alloc<bool>(capacity)) {}
+};
+
+// the part of estimateDirectLightByLi before the occlusion test,
+// rayo.o is at itsc and rayo.d points out
+bool sampleDirectLight(
+  const Scene& scene, const DiscreteDistribution1D& ldd1d,
+  const ShadingPoint& itsc, const BXDF* bxdf, const Ray& rayo,
+  bool needMIS, Ray& rayToLight, float& len,
+  const Primitive*& ltPrim, glm::vec3& L) {
+
+  Intersection itsc_lt; const Light* lt;
+  float lpdf_A = scene.dynamicSampleALight(ldd1d, lt);
+  lpdf_A *= lt->getItscOnLight(itsc_lt, itsc.itscVtx.position);
+  glm::vec3 dirToLight = itsc_lt.itscVtx.position -
+    itsc.itscVtx.position;
+  len = glm::length(dirToLight);
+  dirToLight /= len;
+
+  float lCosTheta = itsc_lt.itscVtx.cosTheta(-dirToLight);
+  if(lCosTheta <= 0.0f) return false;
+
+  if(_IsType(bxdf->getType(), REFLECT) &&
+    itsc.cosTheta(dirToLight) < 0) return false;
+  else if(_IsType(bxdf->getType(), TRANSMISSION) &&
+    itsc.cosTheta(dirToLight) > 0) return false;
+
+  rayToLight.o = itsc.itscVtx.position;
+  rayToLight.d = dirToLight;
+  ltPrim = itsc_lt.prim;
+
+  float invdis2 = 1.0f/(len*len);
+  glm::vec3 leCosDivR2 =
+    invdis2*lCosTheta*lt->evaluate(itsc_lt, -rayToLight.d);
+  L = leCosDivR2*bxdf->evaluate(itsc, rayo, rayToLight) / lpdf_A;
+
+  if(needMIS) {
+    float lpdf_S = PaToPw(lpdf_A, len*len, lCosTheta);
+    float pdfBxdf = bxdf->sample_pdf(itsc, rayToLight, rayo);
+    L *= PowerHeuristicWeight(lpdf_S, pdfBxdf);
+  }
+  return true;
+}
+
+// ray hits the light at itsc_lt, ray.o is the last vertex
+inline float lightHitMISWeight(
+  const Scene& scene, const DiscreteDistribution1D& ldd1d,
+  const ShadingPoint& itsc_lt, const Ray& ray, float sample_pdfw,
+  const Light* lt) {
+
+  float len2 = dist2(itsc_lt.itscVtx.position - ray.o);
+  float cosTheta = itsc_lt.itscVtx.cosTheta(-ray.d);
+  float lpdf_A = scene.getLightPdf(ldd1d, lt)*lt->getItscPdf(itsc_lt, ray);
+  float lpdf_S = PaToPw(lpdf_A, len2, cosTheta);
+  return PowerHeuristicWeight(sample_pdfw, lpdf_S);
+}
+
+}
+
+void WavefrontIntegrator::render(
+  const Scene& scene, RayGenerator* rayGen, Film& film) const {
+  if(scene.hasMediumInScene()) {
+    mediumPath.render(scene, rayGen, film);
+    return;
+  }
+
+  int capacity = std::max(queueSize, (int)RayPacket::MaxSize);
+  ScratchArena& arena = _ThreadArena;
+  ScratchScope renderScope(arena);
+  PathQueue q(capacity, arena);
+  ShadowQueue sq(capacity, arena);
+  ScratchVector<std::pair<const BXDF*, int>> order(capacity, 
+    std::pair<const BXDF*, int>(), &arena);
+  ScratchVector<Ray> sampleRay(capacity, Ray(), &arena);
+
+  RayPacket packet;
+  bool camDone = false;
+  GeneralSampler& threadSampler = _ThreadSampler;
+
+  auto finish = [&](int i) {
+    CheckRadiance(q.L[i], q.rasPos[i]);
+    film.addSplat(q.L[i], q.rasPos[i]);
+    q.alive[i] = false;
+  };
+
+  while(true) {
+    /**************************extend*****************************/
+    scene.intersect(q.ray.data(), q.size, q.hit.data());
+    // new camera paths, the packets write their first hits in place
+    while(!camDone && q.size+RayPacket::MaxSize <= capacity) {
+      if(!rayGen->genNextPacket(packet)) {camDone = true; break;}
+      scene.intersect(packet, q.hit.data() + q.size);
+      for(int k = 0; k<packet.size; k++) {
+        q.start(q.size++, packet.rays[k], packet.rasterPos[k], 
+          packet.sampleIndex[k]);
+      }
+    }
+    if(q.size == 0) break;
+
+    /*********************shade: emission, bxdf*******************/
+    int nShade = 0;
+    for(int i = 0; i<q.size; i++) {
+      Intersection& itsc = q.itsc[i];
+      Ray& ray = q.ray[i];
+      glm::vec3& beta = q.beta[i];
+      int lastBType = q.lastBType[i];
+      bool mis = q.needMIS[i] && _Connectable(lastBType);
+
+      if(!q.hit[i].prim) {
+        if(scene.envLight && _HasFeature(lastBType, DELTA)) {
+          q.L[i] += scene.envLight->evaluate(itsc, -ray.d)*beta;
+        }
+        if(scene.envLight && mis) {
+          Intersection itsc_lt;
+          scene.envLight->genRayItsc(itsc_lt, ray, ray.o);
+          float w = lightHitMISWeight(scene, q.ldd1d[i],
+            itsc_lt, ray, q.lastPdfw[i], scene.envLight);
+          q.L[i] += w*scene.envLight->evaluate(itsc_lt, -ray.d)*beta;
+        }
+        finish(i);
+        continue;
+      }
+
+      scene.handleItscResult(ray, q.hit[i], itsc);
+      const Material& mat = itsc.prim->getMesh()->material;
+      if(itsc.prim->hasSurface() && itsc.cosTheta(ray.d)>0.0f)
+        itsc.reverseNormal();
+
+      if(mat.light) {
+        if(!itsc.normalReverse && _HasFeature(lastBType, DELTA)) {
+          q.L[i] += mat.light->evaluate(itsc, -ray.d)*beta;
+        }
+        if(!itsc.normalReverse && mis) {
+          float w = lightHitMISWeight(scene, q.ldd1d[i],
+            itsc, ray, q.lastPdfw[i], mat.light);
+          q.L[i] += w*mat.light->evaluate(itsc, -ray.d)*beta;
+        }
+        if(!mat.bxdfNode) {finish(i); continue;}
+      }
+      if(!mat.bxdfNode) {
+        std::cout<<"WARNING: Detect No BXDF Material(not light)"<<std::endl;
+        finish(i);
+        continue;
+      }
+
+      ray.o = itsc.itscVtx.position;
+      ray.d = -ray.d;
+      threadSampler = q.sampler[i];
+      q.bxdfWeight[i] = scene.getBXDF(mat, itsc, ray, q.bxdf[i]);
+      q.sampler[i] = threadSampler;
+      order[nShade++] = {q.bxdf[i], i};
+    }
+
+    /*****************shade: sample, by bxdf order****************/
+    // by (bxdf, slot), the paths of a bxdf stay in camera order.
+    // not stable_sort, which allocates a buffer every call
+    std::sort(order.begin(), order.begin()+nShade);
+    sq.size = 0;
+    for(int k = 0; k<nShade; k++) {
+      int i = order[k].second;
+      Intersection& itsc = q.itsc[i];
+      const Ray& ray_o = q.ray[i];
+      const BXDF* bxdf = q.bxdf[i];
+      Ray& sRay = sampleRay[i];
+      threadSampler = q.sampler[i];
+
+      glm::vec3 nBeta = q.bxdfWeight[i]*bxdf->sample_ev(itsc, ray_o, sRay);
+      if(IsBlack(nBeta) || !sRay.checkDir()) {finish(i); continue;}
+
+      int bType = q.lastBType[i] = bxdf->getType();
+      if(!_IsType(bType, NoSurface)) {
+        itsc.maxErrorOffset(sRay.d, sRay.o);
+        itsc.itscVtx.position = sRay.o;
+      }
+
+      if(_Connectable(bType)) {
+        bool needMIS = useMIS && bxdf->needMIS(itsc);
+        q.needMIS[i] = needMIS;
+        scene.getPositionLightDD1D(itsc.itscVtx.position, q.ldd1d[i]);
+        int s = sq.size;
+        if(sampleDirectLight(scene, q.ldd1d[i], itsc, bxdf, ray_o,
+          needMIS, sq.ray[s], sq.tMax[s], sq.prim[s], sq.L[s])) {
+          sq.L[s] *= q.bxdfWeight[i];
+          CheckRadiance(sq.L[s], q.rasPos[i]);
+          sq.L[s] *= q.beta[i];
+          sq.path[s] = i;
+          sq.size++;
+        }
+        if(needMIS) q.lastPdfw[i] = bxdf->sample_pdf(itsc, sRay, ray_o);
+      }
+      q.beta[i] *= nBeta;
+      q.sampler[i] = threadSampler;
+    }
+
+    /***************************shadow****************************/
+    scene.occlude(sq.ray.data(), sq.tMax.data(), sq.size,
+      sq.occluded, sq.prim.data());
+    for(int s = 0; s<sq.size; s++)
+      if(!sq.occluded[s]) q.L[sq.path[s]] += sq.L[s];
+
+    /************************next bounce**************************/
+    int n = 0;
+    for(int i = 0; i<q.size; i++) {
+      if(!q.alive[i]) continue;
+      q.ray[i] = sampleRay[i];
+      if(++q.bounce[i] >= max_bounce) {finish(i); continue;}
+      if(n != i) q.move(i, n);
+      n++;
+    }
+    q.size = n;
+  }
+}
@@ -0,0 +1,366 @@
+#include "wbvh.hpp"
+
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define YCR_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// everything the box test needs from the ray, calculated once per query
+struct WideRay {
+  glm::vec3 o, invDir;
+  int dirIsNeg[3];
+
+  WideRay(const Ray& ray): o(ray.o), invDir(1.0f/ray.d) {
+    for(int i = 0; i<3; i++) dirIsNeg[i] = invDir[i] < 0;
+  }
+};
+
+constexpr float BoxErrorScale = 1.0f + 2.0f*_Gamma(3);
+
+// same as BB3::intersect, NaN distances are ignored by the comparisons
+template<int N>
+int intersectChildrenScalar(const float (&bMin)[3][N], const float (&bMax)[3][N],
+  const WideRay& wr, float tLimit, float* tNear) {
+  int mask = 0;
+  for(int i = 0; i<N; i++) {
+    float tMin = 0.0f, tMax = tLimit;
+    for(int axis = 0; axis<3; axis++) {
+      const float* nearP = wr.dirIsNeg[axis]? bMax[axis]: bMin[axis];
+      const float* farP = wr.dirIsNeg[axis]? bMin[axis]: bMax[axis];
+      float t1 = (nearP[i] - wr.o[axis])*wr.invDir[axis];
+      float t2 = (farP[i] - wr.o[axis])*wr.invDir[axis]*BoxErrorScale;
+      if(t1 > tMin) tMin = t1;
+      if(t2 < tMax) tMax = t2;
+    }
+    tNear[i] = tMin;
+    if(tMin <= tMax) mask |= 1<<i;
+  }
+  return mask;
+}
+
+#ifdef YCR_X86_SIMD
+// _mm_max_ps/_mm_min_ps return the second operand if one is NaN,
+// so the accumulated value always goes second
+int intersectChildrenSSE(const float (&bMin)[3][4], const float (&bMax)[3][4],
+  const WideRay& wr, float tLimit, float* tNear) {
+  __m128 tMin = _mm_setzero_ps(), tMax = _mm_set1_ps(tLimit);
+  __m128 errScale = _mm_set1_ps(BoxErrorScale);
+  for(int axis = 0; axis<3; axis++) {
+    const float* nearP = wr.dirIsNeg[axis]? bMax[axis]: bMin[axis];
+    const float* farP = wr.dirIsNeg[axis]? bMin[axis]: bMax[axis];
+    __m128 o = _mm_set1_ps(wr.o[axis]), inv = _mm_set1_ps(wr.invDir[axis]);
+    __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearP), o), inv);
+    __m128 t2 = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farP), o), inv), errScale);
+    tMin = _mm_max_ps(t1, tMin);
+    tMax = _mm_min_ps(t2, tMax);
+  }
+  _mm_storeu_ps(tNear, tMin);
+  return _mm_movemask_ps(_mm_cmple_ps(tMin, tMax));
+}
+
+__attribute__((target("avx2")))
+int intersectChildrenAVX(const float (&bMin)[3][8], const float (&bMax)[3][8],
+  const WideRay& wr, float tLimit, float* tNear) {
+  __m256 tMin = _mm256_setzero_ps(), tMax = _mm256_set1_ps(tLimit);
+  __m256 errScale = _mm256_set1_ps(BoxErrorScale);
+  for(int axis = 0; axis<3; axis++) {
+    const float* nearP = wr.dirIsNeg[axis]? bMax[axis]: bMin[axis];
+    const float* farP = wr.dirIsNeg[axis]? bMin[axis]: bMax[axis];
+    __m256 o = _mm256_set1_ps(wr.o[axis]), inv = _mm256_set1_ps(wr.invDir[axis]);
+    __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearP), o), inv);
+    __m256 t2 = _mm256_mul_ps(
+      _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farP), o), inv), errScale);
+    tMin = _mm256_max_ps(t1, tMin);
+    tMax = _mm256_min_ps(t2, tMax);
+  }
+  _mm256_storeu_ps(tNear, tMin);
+  return _mm256_movemask_ps(_mm256_cmp_ps(tMin, tMax, _CMP_LE_OQ));
+}
+#endif
+
+inline int intersectChildrenSIMD(const float (&bMin)[3][4], 
+  const float (&bMax)[3][4], const WideRay& wr, float tLimit, float* tNear) {
+#ifdef YCR_X86_SIMD
+  return intersectChildrenSSE(bMin, bMax, wr, tLimit, tNear);
+#else
+  return intersectChildrenScalar(bMin, bMax, wr, tLimit, tNear);
+#endif
+}
+
+inline int intersectChildrenSIMD(const float (&bMin)[3][8], 
+  const float (&bMax)[3][8], const WideRay& wr, float tLimit, float* tNear) {
+#ifdef YCR_X86_SIMD
+  return intersectChildrenAVX(bMin, bMax, wr, tLimit, tNear);
+#else
+  return intersectChildrenScalar(bMin, bMax, wr, tLimit, tNear);
+#endif
+}
+
+template<int N>
+inline int intersectChildren(const WideBVHNode<N>& node, bool useSIMD,
+  const WideRay& wr, float tLimit, float* tNear) {
+  return useSIMD ? 
+    intersectChildrenSIMD(node.bMin, node.bMax, wr, tLimit, tNear):
+    intersectChildrenScalar(node.bMin, node.bMax, wr, tLimit, tNear);
+}
+
+// decode the grid coordinates, the loops are vectorized by the compiler
+template<int N>
+inline int intersectChildren(const QuantizedWideBVHNode<N>& node, 
+  bool useSIMD, const WideRay& wr, float tLimit, float* tNear) {
+  float bMin[3][N], bMax[3][N];
+  for(int axis = 0; axis<3; axis++) {
+    for(int i = 0; i<N; i++) {
+      bMin[axis][i] = node.origin[axis] + node.qMin[axis][i]*node.scale[axis];
+      bMax[axis][i] = node.origin[axis] + node.qMax[axis][i]*node.scale[axis];
+    }
+  }
+  return useSIMD ? 
+    intersectChildrenSIMD(bMin, bMax, wr, tLimit, tNear):
+    intersectChildrenScalar(bMin, bMax, wr, tLimit, tNear);
+}
+
+// the smallest power of 2 scale that covers [lo, hi] with 255 cells,
+// then q is rounded outward until the decoded value really covers
+void quantizeAxis(float origin, float extent, const float* lo, 
+  const float* hi, int n, float& scale, unsigned char* qMin, unsigned char* qMax) {
+  int e = 0;
+  if(extent > 0.0f) std::frexp(extent/255.0f, &e);
+  scale = std::ldexp(1.0f, e);
+  for(int i = 0; i<n; i++) {
+    int q0 = std::min(std::max((int)std::floor((lo[i] - origin)/scale), 0), 255);
+    int q1 = std::min(std::max((int)std::ceil((hi[i] - origin)/scale), 0), 255);
+    while(q0 > 0 && origin + q0*scale > lo[i]) q0--;
+    while(q1 < 255 && origin + q1*scale < hi[i]) q1++;
+    if(origin + q1*scale < hi[i]) { // the grid is too small, next scale
+      quantizeAxis(origin, extent*2.0f, lo, hi, n, scale, qMin, qMax);
+      return;
+    }
+    qMin[i] = q0;
+    qMax[i] = q1;
+  }
+}
+
+struct WideStackItem {
+  int child, count;
+  float tNear;
+};
+
+}
+
+template<>
+bool WideBVH<4>::SIMDSupported() {
+#ifdef YCR_X86_SIMD
+  return __builtin_cpu_supports("sse2");
+#else
+  return false;
+#endif
+}
+
+template<>
+bool WideBVH<8>::SIMDSupported() {
+#ifdef YCR_X86_SIMD
+  return __builtin_cpu_supports("avx2");
+#else
+  return false;
+#endif
+}
+
+template<int N>
+void WideBVH<N>::setChild(WideBVHNode<N>& node, int slot, const BVHNode& bnode) {
+  glm::vec3 pMin = bnode.bb3.getMin(), pMax = bnode.bb3.getMax();
+  for(int axis = 0; axis<3; axis++) {
+    node.bMin[axis][slot] = pMin[axis];
+    node.bMax[axis][slot] = pMax[axis];
+  }
+  node.child[slot] = bnode.offset;
+  node.count[slot] = bnode._size;
+}
+
+template<int N>
+void WideBVH<N>::build(const BVH& bvh, bool quantized) {
+  this->bvh = &bvh;
+  nodes.clear();
+  qnodes.clear();
+  useSIMD = SIMDSupported();
+  this->quantized = quantized;
+  if(bvh.getNodes().empty()) return;
+  nodes.reserve(bvh.getNodes().size()/(N-1) + 1);
+  collapse(bvh, 0);
+  if(quantized) quantize();
+}
+
+// the float nodes are only kept until they are quantized
+template<int N>
+void WideBVH<N>::quantize() {
+  qnodes.resize(nodes.size());
+  for(size_t n = 0; n<nodes.size(); n++) {
+    const WideBVHNode<N>& node = nodes[n];
+    QuantizedWideBVHNode<N>& qnode = qnodes[n];
+    int valid[N], nValid = 0;
+    for(int i = 0; i<N; i++) {
+      qnode.child[i] = node.child[i];
+      qnode.count[i] = node.count[i];
+      if(node.count[i] >= 0) valid[nValid++] = i;
+    }
+    for(int axis = 0; axis<3; axis++) {
+      float lo[N], hi[N];
+      float bMin = FLOAT_INF, bMax = -FLOAT_INF;
+      for(int k = 0; k<nValid; k++) {
+        lo[k] = node.bMin[axis][valid[k]];
+        hi[k] = node.bMax[axis][valid[k]];
+        bMin = std::min(bMin, lo[k]);
+        bMax = std::max(bMax, hi[k]);
+      }
+      unsigned char qMin[N], qMax[N];
+      qnode.origin[axis] = bMin;
+      quantizeAxis(bMin, bMax - bMin, lo, hi, nValid, 
+        qnode.scale[axis], qMin, qMax);
+      for(int i = 0; i<N; i++) {
+        qnode.qMin[axis][i] = 255;
+        qnode.qMax[axis][i] = 0;
+      }
+      for(int k = 0; k<nValid; k++) {
+        qnode.qMin[axis][valid[k]] = qMin[k];
+        qnode.qMax[axis][valid[k]] = qMax[k];
+      }
+    }
+  }
+  std::vector<WideBVHNode<N>>().swap(nodes);
+}
+
+// open the child with the largest surface area until N children,
+// leaves can not be opened
+template<int N>
+int WideBVH<N>::collapse(const BVH& bvh, int bIdx) {
+  const std::vector<BVHNode>& bnodes = bvh.getNodes();
+  int children[N], nChild = 0;
+  if(bnodes[bIdx].isLeaf()) children[nChild++] = bIdx;
+  else {
+    children[nChild++] = bIdx + 1;
+    children[nChild++] = bnodes[bIdx].offset;
+  }
+  while(nChild < N) {
+    int best = -1; float maxArea = -1.0f;
+    for(int i = 0; i<nChild; i++) {
+      const BVHNode& bnode = bnodes[children[i]];
+      if(bnode.isLeaf()) continue;
+      float area = bnode.bb3.getSurfaceArea();
+      if(area > maxArea) {maxArea = area; best = i;}
+    }
+    if(best == -1) break;
+    int opened = children[best];
+    children[best] = opened + 1;
+    children[nChild++] = bnodes[opened].offset;
+  }
+
+  int nodePos = nodes.size();
+  nodes.push_back(WideBVHNode<N>());
+  for(int i = 0; i<N; i++) {
+    WideBVHNode<N>& node = nodes[nodePos];
+    if(i >= nChild) { // empty box, never hit
+      for(int axis = 0; axis<3; axis++) {
+        node.bMin[axis][i] = FLOAT_INF;
+        node.bMax[axis][i] = -FLOAT_INF;
+      }
+      node.child[i] = -1;
+      node.count[i] = -1;
+      continue;
+    }
+    const BVHNode& bnode = bnodes[children[i]];
+    setChild(node, i, bnode);
+    if(!bnode.isLeaf()) {
+      int child = collapse(bvh, children[i]); // may reallocate nodes
+      nodes[nodePos].child[i] = child;
+    }
+  }
+  return nodePos;
+}
+
+// children are pushed farthest first, so the nearest is visited first
+template<int N>
+template<typename Node>
+void WideBVH<N>::intersect(const std::vector<Node>& nodes, const Ray& ray, 
+  HitRecord& hit, const Primitive* prim, float tMin) const {
+
+  if(nodes.empty()) return;
+  WideRay wr(ray);
+  WideStackItem stack[BVHParams::MaxStackDeep*N];
+  int sp = 0;
+  stack[sp++] = {0, 0, 0.0f};
+  float tNear[N];
+  int hits[N];
+
+  while(sp) {
+    const WideStackItem item = stack[--sp];
+    if(item.tNear > hit.t) continue;
+    if(item.count > 0) {
+      bvh->intersectLeaf(ray, hit, item.child, item.count, prim, tMin);
+      continue;
+    }
+    const Node& node = nodes[item.child];
+    int mask = intersectChildren(node, useSIMD, wr, hit.t, tNear);
+    int nHit = 0;
+    while(mask) {
+      int i = __builtin_ctz(mask);
+      mask &= mask - 1;
+      if(node.count[i] < 0) continue; // empty slot, NaN on a box plane
+      int j = nHit++;
+      for(; j>0 && tNear[hits[j-1]] < tNear[i]; j--) hits[j] = hits[j-1];
+      hits[j] = i;
+    }
+    for(int k = 0; k<nHit; k++) 
+      stack[sp++] = {node.child[hits[k]], node.count[hits[k]], tNear[hits[k]]};
+  }
+}
+
+template<int N>
+template<typename Node>
+bool WideBVH<N>::intersectTest(const std::vector<Node>& nodes, 
+  const Ray& ray, const Primitive* prim, float tMin, float tMax) const {
+
+  if(nodes.empty()) return false;
+  WideRay wr(ray);
+  int stack[BVHParams::MaxStackDeep*N];
+  int sp = 0;
+  stack[sp++] = 0;
+  float tNear[N];
+
+  while(sp) {
+    const Node& node = nodes[stack[--sp]];
+    int mask = intersectChildren(node, useSIMD, wr, tMax, tNear);
+    while(mask) {
+      int i = __builtin_ctz(mask);
+      mask &= mask - 1;
+      if(node.count[i] < 0) continue;
+      if(node.count[i] == 0) {
+        stack[sp++] = node.child[i];
+        continue;
+      }
+      if(bvh->intersectTestLeaf(ray, node.child[i], node.count[i], 
+        prim, tMin, tMax)) return true;
+    }
+  }
+  return false;
+}
+
+template<int N>
+void WideBVH<N>::intersect(const Ray& ray, HitRecord& hit, 
+  const Primitive* prim, float tMin) const {
+  if(quantized) intersect(qnodes, ray, hit, prim, tMin);
+  else intersect(nodes, ray, hit, prim, tMin);
+}
+
+template<int N>
+bool WideBVH<N>::intersectTest(const Ray& ray, const Primitive* prim, 
+  float tMin, float tMax) const {
+  return quantized ? intersectTest(qnodes, ray, prim, tMin, tMax):
+    intersectTest(nodes, ray, prim, tMin, tMax);
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
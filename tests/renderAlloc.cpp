@@ -0,0 +1,134 @@
+#include <iostream>
+#include <cstdlib>
+#include <new>
+
+#include "scene.hpp"
+#include "model.hpp"
+#include "bxdfc.hpp"
+#include "light.hpp"
+#include "camera.hpp"
+#include "medium.hpp"
+#include "path.hpp"
+#include "bdpt.hpp"
+#include "wavefront.hpp"
+#include "arena.hpp"
+
+// the render loops draw their scratch memory from the thread arena, so
+// once a render call has grown the arena blocks, the next call on the
+// same thread must not allocate: the global new/delete and the arena
+// block counts are taken around the second call of each integrator
+
+namespace {
+
+long long newCount = 0, deleteCount = 0;
+bool counting = false;
+
+}
+
+void* operator new(std::size_t n) {
+  if(counting) newCount++;
+  void* p = std::malloc(n ? n : 1);
+  if(!p) throw std::bad_alloc();
+  return p;
+}
+void* operator new[](std::size_t n) {
+  if(counting) newCount++;
+  void* p = std::malloc(n ? n : 1);
+  if(!p) throw std::bad_alloc();
+  return p;
+}
+void operator delete(void* p) noexcept {
+  if(counting && p) deleteCount++;
+  std::free(p);
+}
+void operator delete[](void* p) noexcept {
+  if(counting && p) deleteCount++;
+  std::free(p);
+}
+void operator delete(void* p, std::size_t) noexcept {operator delete(p);}
+void operator delete[](void* p, std::size_t) noexcept {operator delete[](p);}
+
+Model* quad(glm::vec3 a, glm::vec3 b, glm::vec3 c, glm::vec3 d,
+  const BXDFNode* bxdf) {
+  glm::vec3 pos[4] = {a, b, c, d};
+  Model* model = new Model(VertexMesh::CreateRectangle(pos));
+  if(bxdf) model->setBxdfForAllMeshes(bxdf);
+  return model;
+}
+
+// a box with a glass and a mirror sphere, lit by a quad light
+void buildScene(Scene& scene, bool medium) {
+  const BXDFNode* white = new LambertianReflection(new SolidTexture(0.7f));
+  const BXDFNode* red = new LambertianReflection(
+    new SolidTexture(glm::vec3(0.8f, 0.3f, 0.3f)));
+  const BXDFNode* ggx = new StandardGGXRefl(1.45f, new SolidTexture(0.2f),
+    new SolidTexture(0.4f), new SolidTexture(1.0f));
+  float s = 10.0f;
+  scene.addModel(*quad({0,0,0}, {s,0,0}, {s,0,s}, {0,0,s}, white));
+  scene.addModel(*quad({0,s,0}, {0,s,s}, {s,s,s}, {s,s,0}, white));
+  scene.addModel(*quad({0,0,0}, {0,s,0}, {s,s,0}, {s,0,0}, ggx));
+  scene.addModel(*quad({0,0,0}, {0,0,s}, {0,s,s}, {0,s,0}, red));
+  scene.addModel(*quad({s,0,0}, {s,s,0}, {s,s,s}, {s,0,s}, white));
+  Model* glass = new Model(CustomMesh::CreateSphere({3,2,4}, 2));
+  glass->setBxdfForAllMeshes(new PerfectGlass(1.5f, new SolidTexture(1.0f)));
+  scene.addModel(*glass);
+  Model* mirror = new Model(CustomMesh::CreateSphere({7,2,3}, 2));
+  mirror->setBxdfForAllMeshes(new PerfectSpecular(new SolidTexture(0.9f)));
+  scene.addModel(*mirror);
+  Model* light = quad(
+    {4,s-0.01f,4}, {6,s-0.01f,4}, {6,s-0.01f,6}, {4,s-0.01f,6}, nullptr);
+  scene.addLight(new ShapeLight(new SolidTexture(30.0f), *light));
+  if(medium) {
+    Model* bound = new Model(CustomMesh::CreateSphere({5,6,5}, 2.5f));
+    scene.addMedium(new Medium(0.4f, glm::vec3(0.3f), bound,
+      new HenyeyPhase(0.3f, glm::vec3(0.3f))));
+  }
+  scene.init();
+}
+
+// true if the second render call allocates nothing
+bool steadyRender(const char* name, const Scene& scene,
+  const Integrator& integrator) {
+  const int W = 64, H = 48;
+  Film film(W, H, 60, true);
+  film.clear();
+  Camera cam(film, {5,5,24}, {0,0,-1});
+  StractifiedRGen rayGen(cam, 4);
+  ScratchArena& arena = _ThreadArena;
+
+  long long news[2], deletes[2], blocks[2];
+  for(int pass = 0; pass<2; pass++) {
+    rayGen.reset(Block2D{W, H, 0, 0});
+    long long blocksBefore = arena.getHeapAllocCount();
+    newCount = deleteCount = 0;
+    counting = true;
+    integrator.render(scene, &rayGen, film);
+    counting = false;
+    news[pass] = newCount;
+    deletes[pass] = deleteCount;
+    blocks[pass] = arena.getHeapAllocCount() - blocksBefore;
+  }
+  bool ok = news[1] == 0 && deletes[1] == 0 && blocks[1] == 0;
+  std::cout<<name<<": first call "<<news[0]<<" new, "<<deletes[0]
+    <<" delete, "<<blocks[0]<<" arena blocks; second call "<<news[1]
+    <<" new, "<<deletes[1]<<" delete, "<<blocks[1]<<" arena blocks"
+    <<(ok ? "" : "  FAILED")<<std::endl;
+  return ok;
+}
+
+int main() {
+  Scene scene, mediumScene;
+  buildScene(scene, false);
+  buildScene(mediumScene, true);
+
+  PathIntegrator path(8);
+  BDPTIntegrator bdpt(6);
+  WavefrontIntegrator wavefront(8);
+  int failed = 0;
+  failed += !steadyRender("path", scene, path);
+  failed += !steadyRender("bdpt", scene, bdpt);
+  failed += !steadyRender("wavefront", scene, wavefront);
+  failed += !steadyRender("path, medium", mediumScene, path);
+  failed += !steadyRender("bdpt, medium", mediumScene, bdpt);
+  return failed ? 1 : 0;
+}
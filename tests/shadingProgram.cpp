@@ -0,0 +1,127 @@
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <algorithm>
+
+#include "material.hpp"
+#include "bxdfc.hpp"
+#include "shadingProgram.hpp"
+#include "sampler.hpp"
+
+// the compiled program of a material must give the same bxdf as the
+// tree walk in expectation: E[weight*f] for a few fixed directions and
+// the albedo estimated by sample_ev, compared within 5 standard errors
+// (and float rounding for the constant ones)
+
+struct Estimate {
+  double sum = 0, sum2 = 0;
+  inline void add(double v) {sum += v; sum2 += v*v;}
+  inline double mean(int n) const {return sum/n;}
+  inline double var(int n) const {
+    return std::max(0.0, sum2/n - mean(n)*mean(n));
+  }
+};
+
+constexpr int DirNum = 3;
+
+void estimate(const ShadingProgram* program, const BXDFNode* tree,
+  const ShadingPoint& sp, const Ray& ray_o, const Ray* rays_i, int n,
+  Estimate* f, Estimate& albedo) {
+  for(int i = 0; i<n; i++) {
+    _ThreadSampler.startSample(glm::ivec2(program ? 1 : 0, 0), i);
+    const BXDF* bxdf;
+    float w = program ? program->getBXDF(sp, ray_o, bxdf):
+      tree->getBXDF(sp, ray_o, bxdf);
+    for(int k = 0; k<DirNum; k++)
+      f[k].add(w*bxdf->evaluate(sp, ray_o, rays_i[k]).x);
+    Ray ray;
+    glm::vec3 ev = bxdf->sample_ev(sp, ray_o, ray);
+    albedo.add(ray.checkDir() ? w*ev.x : 0.0f);
+  }
+}
+
+bool same(const Estimate& a, const Estimate& b, int n) {
+  double err = std::sqrt((a.var(n) + b.var(n))/n);
+  double ulp = 1e-5*(std::abs(a.mean(n)) + std::abs(b.mean(n)));
+  return std::abs(a.mean(n) - b.mean(n)) <= 5.0*err + ulp + 1e-7;
+}
+
+int main() {
+  std::vector<std::pair<const char*, const BXDFNode*>> trees = {
+    {"Lambertian", new LambertianReflection(new SolidTexture(0.5f))},
+    {"FixMixed", new MixedBXDF(
+      new LambertianReflection(new SolidTexture(0.5f)),
+      new AddBXDF(
+        new PerfectSpecular(new SolidTexture(1.0f)),
+        new WeightedBXDF(
+          new LambertianReflection(new SolidTexture(0.1f)),
+          new FixBlender(0.3f))),
+      new FixBlender(0.8f))},
+    {"PerfectGlass", new PerfectGlass(1.5f, new SolidTexture(1.0f))},
+    {"PerfectGlass2", new PerfectGlass(1.33f,
+      new SolidTexture(0.9f), new SolidTexture(0.7f))},
+    {"StandardSpecular", new StandardSpecular(1.5f,
+      new SolidTexture(0.2f), new SolidTexture(1.0f))},
+    {"StandardGGXRefl", new StandardGGXRefl(1.45f, new SolidTexture(0.3f),
+      new SolidTexture(0.4f), new SolidTexture(1.0f))},
+    {"PrincipleBSDF1", new PrincipleBSDF1(
+      new SolidTexture(0.3f), new SolidTexture(0.6f))},
+    {"PrincipleBSDF1-3", new PrincipleBSDF1(new SolidTexture(0.3f),
+      new SolidTexture(0.6f), new SolidTexture(0.25f))},
+    {"PrincipleBSDF1-5", new PrincipleBSDF1(new SolidTexture(0.3f),
+      new SolidTexture(0.6f), new SolidTexture(0.25f),
+      new SolidTexture(0.7f), 1.5f)},
+  };
+
+  std::vector<Material> materials(trees.size());
+  std::vector<const Material*> mp;
+  for(unsigned int i = 0; i<trees.size(); i++) {
+    materials[i].bxdfNode = trees[i].second;
+    mp.push_back(&materials[i]);
+  }
+  MaterialCompiler compiler;
+  compiler.compile(mp);
+  std::cout<<compiler.getProgramNum()<<" programs, "
+    <<compiler.getLobeNum()<<" lobes"<<std::endl;
+
+  ShadingPoint sp;
+  sp.itscVtx.position = glm::vec3(0.0f);
+  sp.itscVtx.normal = sp.geoNormal = glm::vec3(0, 0, 1);
+  sp.itscVtx.tangent = glm::vec3(1, 0, 0);
+  sp.itscVtx.btangent = glm::vec3(0, 1, 0);
+  sp.itscVtx.uv = glm::vec2(0.3f);
+  sp.normalReverse = false;
+  Ray ray_o(glm::vec3(0.0f), glm::normalize(glm::vec3(0.5f, 0.2f, 0.8f)));
+  // two reflection directions and one transmission direction
+  Ray rays_i[DirNum] = {
+    Ray(glm::vec3(0.0f), glm::normalize(glm::vec3(-0.3f, 0.1f, 0.9f))),
+    Ray(glm::vec3(0.0f), glm::normalize(glm::vec3(-0.5f, -0.2f, 0.3f))),
+    Ray(glm::vec3(0.0f), glm::normalize(glm::vec3(-0.2f, -0.1f, -0.9f)))
+  };
+
+  const int n = 200000;
+  int failed = 0;
+  std::cout<<std::fixed<<std::setprecision(5);
+  for(unsigned int t = 0; t<trees.size(); t++) {
+    const ShadingProgram* program = compiler.getProgram(&materials[t]);
+    if(!program) {
+      std::cout<<trees[t].first<<": not compiled"<<std::endl;
+      failed++;
+      continue;
+    }
+    Estimate fTree[DirNum], fProgram[DirNum], aTree, aProgram;
+    estimate(nullptr, trees[t].second, sp, ray_o, rays_i, n, fTree, aTree);
+    estimate(program, trees[t].second, sp, ray_o, rays_i, n,
+      fProgram, aProgram);
+    bool ok = same(aTree, aProgram, n);
+    std::cout<<std::setw(18)<<std::left<<trees[t].first;
+    for(int k = 0; k<DirNum; k++) {
+      ok = ok && same(fTree[k], fProgram[k], n);
+      std::cout<<" f"<<k<<" "<<fTree[k].mean(n)<<" "<<fProgram[k].mean(n);
+    }
+    std::cout<<" albedo "<<aTree.mean(n)<<" "<<aProgram.mean(n)
+      <<(ok ? "" : "  FAILED")<<std::endl;
+    failed += !ok;
+  }
+  return failed ? 1 : 0;
+}
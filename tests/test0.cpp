@@ -23,8 +23,8 @@ int main() {
 
   Ray ray; glm::vec2 raster;
   while(rGen.genNextRay(ray, raster)) {
-    Intersection itsc = scene.intersect(ray);
-    float t = itsc.prim ? itsc.t : 20;
+    HitRecord hit = scene.intersect(ray);
+    float t = hit.prim ? hit.t : 20;
     ray.saveSegLineAsPointCloud(pc, t, {0,1,0}, 30);
   }
 